@@ -0,0 +1,80 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "access-trace.h"
+
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static const char *const kOpNames[] = {
+  "open", "read", "getattr", "fgetattr", "readdir", "release"
+};
+
+AccessTrace::AccessTrace(FILE *out)
+  : start_time_(folve::CurrentTime()), out_(out) {
+  fprintf(out_, "# folve access trace\n"
+          "# time thread op handle offset size result micros path\n");
+  fflush(out_);
+}
+
+AccessTrace::~AccessTrace() {
+  fclose(out_);
+}
+
+const char *AccessTrace::OpName(Op op) {
+  return (op >= 0 && op < NUM_OPS) ? kOpNames[op] : "?";
+}
+
+void AccessTrace::Record(Op op, const char *path, uint64_t handle,
+                         off_t offset, size_t size, int result,
+                         double start_time) {
+  const double now = folve::CurrentTime();
+  folve::MutexLock l(&mutex_);
+  fprintf(out_, "%.6f %lx %s %llx %lld %zu %d %d %s\n",
+          start_time - start_time_, syscall(SYS_gettid), OpName(op),
+          (unsigned long long) handle, (long long) offset, size, result,
+          (int) ((now - start_time) * 1e6), path);
+  if (op != READ) fflush(out_);  // Reads are plenty; flush less often.
+}
+
+bool AccessTrace::ParseLine(const char *line, Event *event) {
+  if (line[0] == '#')
+    return false;
+  char op_name[16];
+  unsigned long long handle;
+  long long offset;
+  int path_start = -1;
+  if (sscanf(line, "%lf %lx %15s %llx %lld %zu %d %d %n",
+             &event->time, &event->thread, op_name, &handle, &offset,
+             &event->size, &event->result, &event->micros, &path_start) < 8
+      || path_start < 0) {
+    return false;
+  }
+  int op = 0;
+  while (op < NUM_OPS && strcmp(op_name, kOpNames[op]) != 0) ++op;
+  if (op == NUM_OPS)
+    return false;
+  event->op = (Op) op;
+  event->handle = handle;
+  event->offset = offset;
+  event->path = line + path_start;
+  const std::string::size_type end = event->path.find_last_not_of("\r\n");
+  event->path.erase(end == std::string::npos ? 0 : end + 1);
+  return !event->path.empty();
+}
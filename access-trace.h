@@ -0,0 +1,76 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_ACCESS_TRACE_H
+#define FOLVE_ACCESS_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "util.h"
+
+// Trace of the filesystem calls clients make, one line per call:
+//
+//   <time> <thread> <op> <handle> <offset> <size> <result> <micros> <path>
+//
+// "time" is seconds since the start of the trace, "handle" identifies the
+// open file in open, read, fgetattr and release; "result" is what the call
+// returned (bytes read, -errno...) and "micros" how long it took. The path
+// comes last, as it might contain spaces.
+// Written by folve with -R, replayed with folve-replay.
+class AccessTrace {
+public:
+  enum Op { OPEN, READ, GETATTR, FGETATTR, READDIR, RELEASE, NUM_OPS };
+
+  struct Event {
+    double time;
+    long thread;
+    Op op;
+    uint64_t handle;
+    off_t offset;
+    size_t size;
+    int result;
+    int micros;
+    std::string path;
+  };
+
+  // Write the trace to "out"; takes over ownership.
+  explicit AccessTrace(FILE *out);
+  ~AccessTrace();
+
+  // Record a call that started at folve::CurrentTime() "start_time" and
+  // just returned "result".
+  void Record(Op op, const char *path, uint64_t handle, off_t offset,
+              size_t size, int result, double start_time);
+
+  static const char *OpName(Op op);
+
+  // Parse a line of the trace. Returns 'false' for comments and
+  // lines that can't be parsed.
+  static bool ParseLine(const char *line, Event *event);
+
+private:
+  const double start_time_;
+  folve::Mutex mutex_;
+  FILE *const out_;
+};
+
+#endif  // FOLVE_ACCESS_TRACE_H
@@ -23,81 +23,155 @@
 #include "conversion-buffer.h"
 #include "util.h"
 
-BufferThread::BufferThread(int buffer_ahead)
-  : buffer_ahead_size_(buffer_ahead), current_work_buffer_(NULL) {
+// Amount converted in one go before re-evaluating what is most urgent.
+static const int kBufferChunk = (8 << 10);
+
+class BufferThreadPool::Worker : public folve::Thread {
+public:
+  Worker(BufferThreadPool *pool) : pool_(pool) {}
+  virtual void Run() {
+    folve::PinToConversionCpus();
+    pool_->ProcessQueue();
+  }
+
+private:
+  BufferThreadPool *const pool_;
+};
+
+BufferThreadPool::BufferThreadPool(off_t min_lead, off_t budget,
+                                   int num_threads)
+  : min_lead_(min_lead), budget_(budget),
+    num_threads_(std::max(1, num_threads)) {
   pthread_cond_init(&enqueue_event_, NULL);
-  pthread_cond_init(&picked_work_, NULL);
+  pthread_cond_init(&work_done_, NULL);
+}
+
+void BufferThreadPool::Start() {
+  for (int i = 0; i < num_threads_; ++i) {
+    Worker *worker = new Worker(this);
+    worker->Start();
+    workers_.push_back(worker);
+  }
 }
 
-void BufferThread::EnqueueWork(ConversionBuffer *buffer) {
-  const off_t goal = buffer->MaxAccessed() + buffer_ahead_size_;
+void BufferThreadPool::EnqueueWork(ConversionBuffer *buffer, off_t goal) {
   folve::MutexLock l(&mutex_);
-  bool found = false;
   // This is O(n), but n is typically in the order of max=4
   for (WorkQueue::iterator it = queue_.begin(); it != queue_.end(); ++it) {
     if (it->buffer == buffer) {
-      it->goal = goal;  // Already in queue; update goal.
-      found = true;
-      break;
+      // Already in queue, maybe being worked on; the worker picks up the
+      // new goal after its current chunk.
+      it->goal = std::max(it->goal, goal);
+      return;
     }
   }
-  if (!found) {
-    WorkItem new_work;
-    new_work.buffer = buffer;
-    new_work.goal = goal;
-    queue_.push_back(new_work);
-    pthread_cond_signal(&enqueue_event_);
-  }
+  buffered_.insert(buffer);
+  WorkItem new_work;
+  new_work.buffer = buffer;
+  new_work.goal = goal;
+  new_work.in_progress = false;
+  queue_.push_back(new_work);
+  pthread_cond_signal(&enqueue_event_);
 }
 
-void BufferThread::Forget(ConversionBuffer *buffer) {
+int BufferThreadPool::QueueSize() {
   folve::MutexLock l(&mutex_);
-  // If this was currently what we were working on, wait until that is gone
-  // to not delete conversion buffer being accessed.
-  while (current_work_buffer_ == buffer) {
-    mutex_.WaitOn(&picked_work_);
-  }
+  return queue_.size();
+}
 
-  // Again, O(n), but typical n is low.
+void BufferThreadPool::Forget(ConversionBuffer *buffer) {
+  folve::MutexLock l(&mutex_);
   WorkQueue::iterator it = queue_.begin();
   while (it != queue_.end()) {
-    if (it->buffer == buffer) {
-      it = queue_.erase(it);
-    } else  {
+    if (it->buffer != buffer) {
       ++it;
+      continue;
     }
+    // If a worker is currently working on this, wait until that is done
+    // to not delete conversion buffer being accessed. The worker might have
+    // re-arranged the queue in the meantime, so start over.
+    if (it->in_progress) {
+      mutex_.WaitOn(&work_done_);
+      it = queue_.begin();
+      continue;
+    }
+    it = queue_.erase(it);
+  }
+  buffered_.erase(buffer);
+}
+
+BufferThreadPool::WorkQueue::iterator
+BufferThreadPool::PickMostUrgent_Locked() {
+  // The most urgent buffer is the one whose reader is closest to the end
+  // of what we already have converted.
+  // Again, O(n), but typical n is low.
+  WorkQueue::iterator result = queue_.end();
+  off_t smallest_lead = 0;
+  for (WorkQueue::iterator it = queue_.begin(); it != queue_.end(); ++it) {
+    if (it->in_progress) continue;
+    const off_t lead
+      = it->buffer->WritePosition() - it->buffer->MaxAccessed();
+    if (result == queue_.end() || lead < smallest_lead) {
+      result = it;
+      smallest_lead = lead;
+    }
+  }
+  return result;
+}
+
+off_t BufferThreadPool::TotalLead_Locked() const {
+  off_t result = 0;
+  for (std::set<ConversionBuffer*>::const_iterator it = buffered_.begin();
+       it != buffered_.end(); ++it) {
+    const off_t lead = (*it)->WritePosition() - (*it)->MaxAccessed();
+    result += std::max((off_t) 0, lead - min_lead_);
+  }
+  for (WorkQueue::const_iterator it = queue_.begin(); it != queue_.end();
+       ++it) {
+    if (it->in_progress) result += kBufferChunk;
   }
+  return result;
 }
 
-void BufferThread::Run() {
-  const int kBufferChunk = (8 << 10);
+void BufferThreadPool::ProcessQueue() {
   for (;;) {
-    WorkItem work;
+    WorkQueue::iterator work;
+    ConversionBuffer *buffer;
     {
       folve::MutexLock l(&mutex_);
-      while (queue_.empty()) {
+      while ((work = PickMostUrgent_Locked()) == queue_.end()) {
         mutex_.WaitOn(&enqueue_event_);
       }
-      work = queue_.front();
-      current_work_buffer_ = work.buffer;
-      pthread_cond_signal(&picked_work_);
+      work->in_progress = true;
+      buffer = work->buffer;
     }
 
     // We only do one chunk at the time so that the main thread has a chance to
-    // get into there and _we_ can round-robin through all work scheduled.
-    const bool work_complete
-      = (work.buffer->FillUntil(work.buffer->FileSize() + kBufferChunk)
-         || work.buffer->FileSize() >= work.goal);
+    // get into there and _we_ can re-evaluate what is most urgent.
+    const bool file_complete
+      = buffer->FillUntil(buffer->WritePosition() + kBufferChunk);
 
     {
       folve::MutexLock l(&mutex_);
-      assert(queue_.front().buffer == current_work_buffer_);
-      if (!work_complete) { // More work to do ? Re-schedule.
-        queue_.push_back(queue_.front());
+      // Nobody else removes items in progress, so our iterator is still valid.
+      assert(work->buffer == buffer && work->in_progress);
+      work->in_progress = false;
+      // EnqueueWork() might have raised the goal while we were busy.
+      bool work_complete = (file_complete
+                            || buffer->WritePosition() >= work->goal);
+      // Beyond our budget, we only keep the minimum ahead; the reader will
+      // ask again once it gets close.
+      if (!work_complete && TotalLead_Locked() > budget_
+          && buffer->WritePosition() - buffer->MaxAccessed() >= min_lead_) {
+        work_complete = true;
+      }
+      if (work_complete) {
+        queue_.erase(work);
+      } else {
+        // Others might want to pick this up now that it is not busy anymore.
+        pthread_cond_signal(&enqueue_event_);
       }
-      queue_.pop_front();
-      current_work_buffer_ = NULL;
-      pthread_cond_signal(&picked_work_);
+      pthread_cond_broadcast(&work_done_);
     }
     pthread_yield();
   }
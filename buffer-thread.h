@@ -23,37 +23,70 @@
 #include <unistd.h>
 
 #include <list>
+#include <set>
+#include <vector>
 
 class ConversionBuffer;
+// A pool of threads pre-buffering conversion buffers ahead of the reader.
+// Each buffer is only worked on by one thread at a time, but different
+// buffers are filled in parallel. Buffers whose readers are closest to
+// the end of what is already converted are worked on first.
+// If the sum of what is converted ahead of the readers beyond the minimum
+// lead exceeds the budget, buffers are only filled up to the minimum lead.
 // NOTE: runs forever the whole program lifetime; does not provide a way to quit.
-class BufferThread : public folve::Thread {
+class BufferThreadPool {
 public:
-  BufferThread(int buffer_ahead);
+  // Buffers are always converted "min_lead" bytes ahead of their reader,
+  // more only while within "budget" bytes beyond that for all buffers.
+  BufferThreadPool(off_t min_lead, off_t budget, int num_threads);
 
-  // Enqueue a conversion buffer to work on.
-  void EnqueueWork(ConversionBuffer *buffer);
+  // Start the worker threads.
+  void Start();
+
+  // Enqueue a conversion buffer to work on until it is converted up to
+  // "goal".
+  void EnqueueWork(ConversionBuffer *buffer, off_t goal);
 
   // If the given buffer is enqueued, forget about it. We don't need it anymore.
+  // If a worker is currently busy with it, waits until it is done.
   void Forget(ConversionBuffer *buffer);
 
- protected:
-  virtual void Run();
+  // Number of buffers in the queue, including the ones worked on.
+  int QueueSize();
 
 private:
+  class Worker;
+  friend class Worker;
+
   struct WorkItem {
     ConversionBuffer *buffer;
     off_t goal;
+    bool in_progress;
   };
   typedef std::list<WorkItem> WorkQueue;
 
-  const int buffer_ahead_size_;
+  // Work on the queue; called in each worker thread. Never returns.
+  void ProcessQueue();
+
+  // Find the most urgent work item nobody else is working on. Returns
+  // queue_.end() if there is none.
+  WorkQueue::iterator PickMostUrgent_Locked();
+
+  // Sum of data converted ahead of the readers beyond the minimum lead, of
+  // all buffers we have pre-buffered and that are still open. This includes
+  // what workers are converting right now.
+  off_t TotalLead_Locked() const;
+
+  const off_t min_lead_;
+  const off_t budget_;
+  const int num_threads_;
+  std::vector<Worker*> workers_;
 
   folve::Mutex mutex_;
-  WorkQueue queue_;   // crude initial impl. of work-queue
+  WorkQueue queue_;
+  std::set<ConversionBuffer*> buffered_;  // Pre-buffered, not forgotten yet.
   pthread_cond_t enqueue_event_;
-
-  pthread_cond_t picked_work_;
-  ConversionBuffer *current_work_buffer_;
+  pthread_cond_t work_done_;
 };
 
 #endif  // FOLVE_BUFFER_THREAD_H_
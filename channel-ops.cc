@@ -0,0 +1,405 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "channel-ops.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#  define FOLVE_VECTOR_OPS 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#  define FOLVE_VECTOR_OPS 1
+#endif
+
+namespace {
+using folve::DitherState;
+using folve::kSoftClipKnee;
+using folve::PCM_DITHER;
+using folve::PCM_SOFT_CLIP;
+
+// Scalar versions; used for whatever the vector versions don't cover.
+void DeinterleaveScalar(const float *in, int channels, int from, int to,
+                        float *const *out) {
+  for (int ch = 0; ch < channels; ++ch) {
+    float *dest = out[ch];
+    for (int j = from; j < to; ++j) {
+      dest[j] = in[j * channels + ch];
+    }
+  }
+}
+
+float InterleaveScalar(const float *const *in, int channels, int from, int to,
+                       float *out) {
+  float peak = 0.0f;
+  for (int ch = 0; ch < channels; ++ch) {
+    const float *source = in[ch];
+    for (int j = from; j < to; ++j) {
+      const float value = source[j];
+      out[j * channels + ch] = value;
+      const float value_abs = fabsf(value);
+      peak = value_abs > peak ? value_abs : peak;
+    }
+  }
+  return peak;
+}
+
+// xorshift32; good enough for dither and fast.
+inline uint32_t NextRandom(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+// Uniformly distributed in 0..1
+inline float Uniform(uint32_t random) {
+  return (random >> 8) * (1.0f / 16777216.0f);
+}
+
+// Linear up to the knee, then y = knee + headroom * e / (1 + e) with
+// e = (|x| - knee) / headroom; same slope at the knee and approaching 1.0.
+inline float SoftClip(float value) {
+  const float value_abs = fabsf(value);
+  if (value_abs <= kSoftClipKnee)
+    return value;
+  const float headroom = 1.0f - kSoftClipKnee;
+  const float e = (value_abs - kSoftClipKnee) / headroom;
+  const float result = kSoftClipKnee + headroom * e / (1.0f + e);
+  return value < 0 ? -result : result;
+}
+
+void ConvertToPcmScalar(const float *in, int from, int to, int bits,
+                        int options, DitherState *dither, int *out) {
+  const float scale = (float) (1 << (bits - 1));
+  const float max_value = scale - 1.0f;
+  const int shift = 32 - bits;
+  for (int i = from; i < to; ++i) {
+    float value = in[i];
+    if (options & PCM_SOFT_CLIP) value = SoftClip(value);
+    value *= scale;
+    if (options & PCM_DITHER) {
+      // Separate statements: the same order as the vector version.
+      uint32_t *const state = &dither->lanes[i & 3];
+      const float r1 = Uniform(NextRandom(state));
+      const float r2 = Uniform(NextRandom(state));
+      value += r1 - r2;
+    }
+    value = value < -scale ? -scale : (value > max_value ? max_value : value);
+    out[i] = (int) ((uint32_t) lrintf(value) << shift);
+  }
+}
+
+#ifdef FOLVE_VECTOR_OPS
+// Minimal abstraction of a vector of four floats, so that the kernels below
+// only need to be written once.
+#if defined(__SSE2__)
+typedef __m128 V4;
+inline V4 Load(const float *p) { return _mm_loadu_ps(p); }
+inline void Store(float *p, V4 v) { _mm_storeu_ps(p, v); }
+inline V4 Zero() { return _mm_setzero_ps(); }
+inline V4 Max(V4 a, V4 b) { return _mm_max_ps(a, b); }
+inline V4 Abs(V4 v) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), v); }
+inline V4 Set(float f) { return _mm_set1_ps(f); }
+inline V4 Min(V4 a, V4 b) { return _mm_min_ps(a, b); }
+inline V4 Add(V4 a, V4 b) { return _mm_add_ps(a, b); }
+inline V4 Sub(V4 a, V4 b) { return _mm_sub_ps(a, b); }
+inline V4 Mul(V4 a, V4 b) { return _mm_mul_ps(a, b); }
+inline V4 Div(V4 a, V4 b) { return _mm_div_ps(a, b); }
+inline V4 CopySign(V4 magnitude, V4 sign) {
+  return _mm_or_ps(magnitude, _mm_and_ps(sign, _mm_set1_ps(-0.0f)));
+}
+
+// Integer vectors for the PCM conversion.
+typedef __m128i V4i;
+typedef __m128i V4u;
+inline V4i RoundToInt(V4 v) { return _mm_cvtps_epi32(v); }  // to nearest.
+inline V4i ShiftLeft(V4i v, int bits) {
+  return _mm_sll_epi32(v, _mm_cvtsi32_si128(bits));
+}
+inline void StoreInt(int *p, V4i v) { _mm_storeu_si128((__m128i*) p, v); }
+inline V4u LoadState(const uint32_t *p) {
+  return _mm_loadu_si128((const __m128i*) p);
+}
+inline void StoreState(uint32_t *p, V4u v) {
+  _mm_storeu_si128((__m128i*) p, v);
+}
+inline V4u NextRandom(V4u *state) {
+  V4u x = *state;
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+  x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+  x = _mm_xor_si128(x, _mm_slli_epi32(x, 5));
+  return *state = x;
+}
+inline V4 Uniform(V4u random) {
+  return _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(random, 8)),
+                    _mm_set1_ps(1.0f / 16777216.0f));
+}
+inline float HorizontalMax(V4 v) {
+  v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+  v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtss_f32(v);
+}
+inline void Transpose4(V4 *r0, V4 *r1, V4 *r2, V4 *r3) {
+  _MM_TRANSPOSE4_PS(*r0, *r1, *r2, *r3);
+}
+// LRLR LRLR -> LLLL RRRR
+inline void Unzip(V4 a, V4 b, V4 *left, V4 *right) {
+  *left = _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+  *right = _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+}
+// LLLL RRRR -> LRLR LRLR
+inline void Zip(V4 left, V4 right, V4 *a, V4 *b) {
+  *a = _mm_unpacklo_ps(left, right);
+  *b = _mm_unpackhi_ps(left, right);
+}
+#else  // NEON
+typedef float32x4_t V4;
+inline V4 Load(const float *p) { return vld1q_f32(p); }
+inline void Store(float *p, V4 v) { vst1q_f32(p, v); }
+inline V4 Zero() { return vdupq_n_f32(0.0f); }
+inline V4 Max(V4 a, V4 b) { return vmaxq_f32(a, b); }
+inline V4 Abs(V4 v) { return vabsq_f32(v); }
+inline V4 Set(float f) { return vdupq_n_f32(f); }
+inline V4 Min(V4 a, V4 b) { return vminq_f32(a, b); }
+inline V4 Add(V4 a, V4 b) { return vaddq_f32(a, b); }
+inline V4 Sub(V4 a, V4 b) { return vsubq_f32(a, b); }
+inline V4 Mul(V4 a, V4 b) { return vmulq_f32(a, b); }
+inline V4 Div(V4 a, V4 b) {
+  // No division on ARMv7; estimate and two Newton-Raphson steps.
+  V4 reciprocal = vrecpeq_f32(b);
+  reciprocal = vmulq_f32(vrecpsq_f32(b, reciprocal), reciprocal);
+  reciprocal = vmulq_f32(vrecpsq_f32(b, reciprocal), reciprocal);
+  return vmulq_f32(a, reciprocal);
+}
+inline V4 CopySign(V4 magnitude, V4 sign) {
+  return vbslq_f32(vdupq_n_u32(0x80000000), sign, magnitude);
+}
+
+typedef int32x4_t V4i;
+typedef uint32x4_t V4u;
+inline V4i RoundToInt(V4 v) {  // vcvtq truncates.
+  return vcvtq_s32_f32(vaddq_f32(v, CopySign(vdupq_n_f32(0.5f), v)));
+}
+inline V4i ShiftLeft(V4i v, int bits) { return vshlq_s32(v, vdupq_n_s32(bits)); }
+inline void StoreInt(int *p, V4i v) { vst1q_s32(p, v); }
+inline V4u LoadState(const uint32_t *p) { return vld1q_u32(p); }
+inline void StoreState(uint32_t *p, V4u v) { vst1q_u32(p, v); }
+inline V4u NextRandom(V4u *state) {
+  V4u x = *state;
+  x = veorq_u32(x, vshlq_n_u32(x, 13));
+  x = veorq_u32(x, vshrq_n_u32(x, 17));
+  x = veorq_u32(x, vshlq_n_u32(x, 5));
+  return *state = x;
+}
+inline V4 Uniform(V4u random) {
+  return vmulq_n_f32(vcvtq_f32_u32(vshrq_n_u32(random, 8)),
+                     1.0f / 16777216.0f);
+}
+inline float HorizontalMax(V4 v) {
+  float32x2_t m = vpmax_f32(vget_low_f32(v), vget_high_f32(v));
+  m = vpmax_f32(m, m);
+  return vget_lane_f32(m, 0);
+}
+inline void Transpose4(V4 *r0, V4 *r1, V4 *r2, V4 *r3) {
+  const float32x4x2_t t01 = vtrnq_f32(*r0, *r1);
+  const float32x4x2_t t23 = vtrnq_f32(*r2, *r3);
+  *r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+  *r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+  *r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+  *r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+}
+inline void Unzip(V4 a, V4 b, V4 *left, V4 *right) {
+  const float32x4x2_t r = vuzpq_f32(a, b);
+  *left = r.val[0];
+  *right = r.val[1];
+}
+inline void Zip(V4 left, V4 right, V4 *a, V4 *b) {
+  const float32x4x2_t r = vzipq_f32(left, right);
+  *a = r.val[0];
+  *b = r.val[1];
+}
+#endif
+
+// Returns number of frames handled; the rest is left to the scalar version.
+int DeinterleaveVector(const float *in, int channels, int frames,
+                       float *const *out) {
+  const int vector_frames = frames & ~3;
+  if (channels == 1) {
+    memcpy(out[0], in, vector_frames * sizeof(float));
+  }
+  else if (channels == 2) {
+    for (int j = 0; j < vector_frames; j += 4) {
+      V4 left, right;
+      Unzip(Load(in + 2 * j), Load(in + 2 * j + 4), &left, &right);
+      Store(out[0] + j, left);
+      Store(out[1] + j, right);
+    }
+  }
+  else if (channels >= 4) {
+    // Transpose blocks of 4 channels x 4 frames. If the number of channels
+    // is not a multiple of four (e.g. 5.1), the last block overlaps with the
+    // previous one; these channels are just written twice.
+    for (int j = 0; j < vector_frames; j += 4) {
+      const float *frame = in + j * channels;
+      for (int ch = 0; ch < channels; ch += 4) {
+        if (ch + 4 > channels) ch = channels - 4;
+        V4 r0 = Load(frame + ch);
+        V4 r1 = Load(frame + channels + ch);
+        V4 r2 = Load(frame + 2 * channels + ch);
+        V4 r3 = Load(frame + 3 * channels + ch);
+        Transpose4(&r0, &r1, &r2, &r3);
+        Store(out[ch] + j, r0);
+        Store(out[ch + 1] + j, r1);
+        Store(out[ch + 2] + j, r2);
+        Store(out[ch + 3] + j, r3);
+      }
+    }
+  }
+  else {
+    return 0;  // 3 channels. Rare enough to not bother.
+  }
+  return vector_frames;
+}
+
+int InterleaveVector(const float *const *in, int channels, int frames,
+                     float *out, float *peak) {
+  const int vector_frames = frames & ~3;
+  V4 max_abs = Zero();
+  if (channels == 1) {
+    for (int j = 0; j < vector_frames; j += 4) {
+      const V4 v = Load(in[0] + j);
+      Store(out + j, v);
+      max_abs = Max(max_abs, Abs(v));
+    }
+  }
+  else if (channels == 2) {
+    for (int j = 0; j < vector_frames; j += 4) {
+      const V4 left = Load(in[0] + j);
+      const V4 right = Load(in[1] + j);
+      V4 a, b;
+      Zip(left, right, &a, &b);
+      Store(out + 2 * j, a);
+      Store(out + 2 * j + 4, b);
+      max_abs = Max(max_abs, Max(Abs(left), Abs(right)));
+    }
+  }
+  else if (channels >= 4) {
+    for (int j = 0; j < vector_frames; j += 4) {
+      float *frame = out + j * channels;
+      for (int ch = 0; ch < channels; ch += 4) {
+        if (ch + 4 > channels) ch = channels - 4;  // overlap; see above.
+        V4 r0 = Load(in[ch] + j);
+        V4 r1 = Load(in[ch + 1] + j);
+        V4 r2 = Load(in[ch + 2] + j);
+        V4 r3 = Load(in[ch + 3] + j);
+        max_abs = Max(max_abs, Max(Max(Abs(r0), Abs(r1)),
+                                   Max(Abs(r2), Abs(r3))));
+        Transpose4(&r0, &r1, &r2, &r3);
+        Store(frame + ch, r0);
+        Store(frame + channels + ch, r1);
+        Store(frame + 2 * channels + ch, r2);
+        Store(frame + 3 * channels + ch, r3);
+      }
+    }
+  }
+  else {
+    *peak = 0.0f;
+    return 0;
+  }
+  *peak = HorizontalMax(max_abs);
+  return vector_frames;
+}
+
+// Same as ConvertToPcmScalar(), four samples at a time.
+int ConvertToPcmVector(const float *in, int count, int bits, int options,
+                       DitherState *dither, int *out) {
+  const int vector_count = count & ~3;
+  const float full_scale = (float) (1 << (bits - 1));
+  const V4 scale = Set(full_scale);
+  const V4 min_value = Set(-full_scale);
+  const V4 max_value = Set(full_scale - 1.0f);
+  const V4 knee = Set(kSoftClipKnee);
+  const V4 headroom = Set(1.0f - kSoftClipKnee);
+  const V4 one = Set(1.0f);
+  const int shift = 32 - bits;
+  V4u random = LoadState(dither->lanes);
+  for (int i = 0; i < vector_count; i += 4) {
+    V4 v = Load(in + i);
+    if (options & PCM_SOFT_CLIP) {
+      const V4 v_abs = Abs(v);
+      const V4 e = Div(Max(Sub(v_abs, knee), Zero()), headroom);
+      v = CopySign(Add(Min(v_abs, knee), Mul(headroom, Div(e, Add(one, e)))),
+                   v);
+    }
+    v = Mul(v, scale);
+    if (options & PCM_DITHER) {
+      const V4 r1 = Uniform(NextRandom(&random));
+      const V4 r2 = Uniform(NextRandom(&random));
+      v = Add(v, Sub(r1, r2));
+    }
+    v = Min(Max(v, min_value), max_value);
+    StoreInt(out + i, ShiftLeft(RoundToInt(v), shift));
+  }
+  StoreState(dither->lanes, random);
+  return vector_count;
+}
+#endif  // FOLVE_VECTOR_OPS
+}  // namespace
+
+namespace folve {
+void DeinterleaveChannels(const float *in, int channels, int frames,
+                          float *const *out) {
+  int done = 0;
+#ifdef FOLVE_VECTOR_OPS
+  done = DeinterleaveVector(in, channels, frames, out);
+#endif
+  DeinterleaveScalar(in, channels, done, frames, out);
+}
+
+float InterleaveChannels(const float *const *in, int channels, int frames,
+                         float *out) {
+  float peak = 0.0f;
+  int done = 0;
+#ifdef FOLVE_VECTOR_OPS
+  done = InterleaveVector(in, channels, frames, out, &peak);
+#endif
+  const float rest_peak = InterleaveScalar(in, channels, done, frames, out);
+  return rest_peak > peak ? rest_peak : peak;
+}
+
+DitherState::DitherState() {
+  // Any non-zero seed will do.
+  lanes[0] = 0x9e3779b9;
+  lanes[1] = 0x7f4a7c15;
+  lanes[2] = 0x94d049bb;
+  lanes[3] = 0x2545f491;
+}
+
+void ConvertToPcm(const float *in, int count, int bits, int options,
+                  DitherState *dither, int *out) {
+  int done = 0;
+#ifdef FOLVE_VECTOR_OPS
+  done = ConvertToPcmVector(in, count, bits, options, dither, out);
+#endif
+  ConvertToPcmScalar(in, done, count, bits, options, dither, out);
+}
+}  // namespace folve
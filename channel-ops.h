@@ -0,0 +1,63 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_CHANNEL_OPS_H
+#define FOLVE_CHANNEL_OPS_H
+
+#include <stdint.h>
+
+// Converting between interleaved sound files and the separate channel
+// buffers the convolver works on. These are in the hot path, so they
+// are vectorized with SSE2 or NEON if available; with a scalar fallback
+// otherwise.
+namespace folve {
+  // Split "frames" interleaved frames of "channels" samples each into
+  // separate channel buffers: LRLRLR -> LLL, RRR.
+  void DeinterleaveChannels(const float *in, int channels, int frames,
+                            float *const *out);
+
+  // Join separate channel buffers into "frames" interleaved frames in "out":
+  // LLL, RRR -> LRLRLR. Returns the maximum absolute sample value seen.
+  float InterleaveChannels(const float *const *in, int channels, int frames,
+                           float *out);
+
+  // Options for ConvertToPcm().
+  enum {
+    PCM_DITHER    = 0x01,   // Triangular (TPDF) dither of +/- 1 LSB.
+    PCM_SOFT_CLIP = 0x02,   // Compress peaks above kSoftClipKnee smoothly.
+  };
+
+  // Above this absolute value, PCM_SOFT_CLIP bends samples towards 1.0
+  // instead of clipping them hard.
+  static const float kSoftClipKnee = 0.9f;
+
+  // State of the random generator for dither; one per output stream.
+  struct DitherState {
+    DitherState();
+    uint32_t lanes[4];
+  };
+
+  // Convert "count" float samples (nominally -1..1) to signed integers of
+  // "bits" (8..24) bits, left aligned in an int as sf_writef_int() wants
+  // them. Samples out of range are clipped. "options" are PCM_* flags;
+  // "dither" is only used with PCM_DITHER.
+  void ConvertToPcm(const float *in, int count, int bits, int options,
+                    DitherState *dither, int *out);
+}  // namespace folve
+
+#endif  // FOLVE_CHANNEL_OPS_H
@@ -0,0 +1,196 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Compares the channel operations, vectorized where the machine allows,
+// with straightforward scalar versions: for channel counts covering every
+// vector path, frame counts leaving a remainder, and the PCM conversion
+// of values around the soft clip knee and out of range.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "channel-ops.h"
+
+namespace {
+const int kChannels[] = { 1, 2, 3, 4, 5, 6, 8 };
+const int kFrames[] = { 0, 1, 3, 4, 7, 17, 64, 1001 };
+const int kBits[] = { 8, 16, 24 };
+const int kOptions[] = { 0, folve::PCM_DITHER, folve::PCM_SOFT_CLIP,
+                         folve::PCM_DITHER | folve::PCM_SOFT_CLIP };
+
+// Values of interest: around the knee, full scale and beyond.
+const float kSpecialValues[] = {
+  0.0f, 0.5f, -0.5f, 0.8999f, 0.9f, -0.9f, 0.9001f, 0.95f, -0.95f,
+  0.999f, 1.0f, -1.0f, 1.0001f, -1.0001f, 1.5f, -1.5f, 10.0f, -10.0f,
+  1e-6f, -1e-6f,
+};
+const int kSpecialCount = sizeof(kSpecialValues) / sizeof(kSpecialValues[0]);
+
+#define COUNT_OF(a) (int) (sizeof(a) / sizeof(a[0]))
+
+// Deterministic values, some of them out of range.
+std::vector<float> TestSamples(int count) {
+  std::vector<float> result(count);
+  unsigned int state = 4711;
+  for (int i = 0; i < count; ++i) {
+    if (i % 3 == 0) {
+      result[i] = kSpecialValues[(i / 3) % kSpecialCount];
+    } else {
+      state = state * 1103515245 + 12345;
+      result[i] = ((state >> 8) & 0xffff) / 21845.0f - 1.5f;  // -1.5..1.5
+    }
+  }
+  return result;
+}
+
+int TestInterleaving(int channels, int frames) {
+  const std::vector<float> interleaved = TestSamples(channels * frames + 1);
+  std::vector<std::vector<float> > split(channels,
+                                         std::vector<float>(frames + 1));
+  std::vector<float*> split_ptr(channels);
+  for (int ch = 0; ch < channels; ++ch) split_ptr[ch] = &split[ch][0];
+
+  int errors = 0;
+  folve::DeinterleaveChannels(&interleaved[0], channels, frames,
+                              &split_ptr[0]);
+  float expected_peak = 0.0f;
+  for (int j = 0; j < frames; ++j) {
+    for (int ch = 0; ch < channels; ++ch) {
+      const float value = interleaved[j * channels + ch];
+      if (split[ch][j] != value) ++errors;
+      expected_peak = std::max(expected_peak, fabsf(value));
+    }
+  }
+
+  std::vector<float> joined(channels * frames + 1, 42.0f);
+  std::vector<const float*> const_ptr(split_ptr.begin(), split_ptr.end());
+  const float peak = folve::InterleaveChannels(&const_ptr[0], channels,
+                                               frames, &joined[0]);
+  for (int i = 0; i < channels * frames; ++i) {
+    if (joined[i] != interleaved[i]) ++errors;
+  }
+  if (joined[channels * frames] != 42.0f) ++errors;  // Wrote past the end.
+  if (peak != expected_peak) ++errors;
+  if (errors) {
+    fprintf(stderr, "  interleaving %d channels, %d frames: %d errors\n",
+            channels, frames, errors);
+  }
+  return errors;
+}
+
+uint32_t NextRandom(uint32_t *state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+int ReferencePcm(float value, int bits, int options,
+                 folve::DitherState *dither, int i) {
+  const float scale = (float) (1 << (bits - 1));
+  if (options & folve::PCM_SOFT_CLIP) {
+    const float knee = folve::kSoftClipKnee;
+    const float headroom = 1.0f - knee;
+    const float value_abs = fabsf(value);
+    if (value_abs > knee) {
+      const float e = (value_abs - knee) / headroom;
+      const float bent = knee + headroom * e / (1.0f + e);
+      value = value < 0 ? -bent : bent;
+    }
+  }
+  value *= scale;
+  if (options & folve::PCM_DITHER) {
+    uint32_t *const state = &dither->lanes[i & 3];
+    const float r1 = (NextRandom(state) >> 8) * (1.0f / 16777216.0f);
+    const float r2 = (NextRandom(state) >> 8) * (1.0f / 16777216.0f);
+    value += r1 - r2;
+  }
+  value = std::max(-scale, std::min(scale - 1.0f, value));
+  return (int) floorf(value + 0.5f);
+}
+
+int TestPcm(int count, int bits, int options) {
+  const std::vector<float> in = TestSamples(count);
+  std::vector<int> out(count + 1, 42);
+  folve::DitherState dither;
+  folve::ConvertToPcm(&in[0], count, bits, options, &dither, &out[0]);
+  folve::DitherState reference_dither;
+  const int shift = 32 - bits;
+  const int max_value = (1 << (bits - 1)) - 1;
+  int errors = 0;
+  for (int i = 0; i < count; ++i) {
+    const int expected = ReferencePcm(in[i], bits, options,
+                                      &reference_dither, i);
+    const int got = out[i] >> shift;   // Arithmetic shift; keeps the sign.
+    // Rounding of halves and the vector division may differ by one step.
+    if (abs(got - expected) > 1 || (out[i] & ((1 << shift) - 1)) != 0
+        || got > max_value || got < -max_value - 1) {
+      if (errors < 3) {
+        fprintf(stderr, "  %d bits, options %d: %f -> %d, expected %d\n",
+                bits, options, in[i], got, expected);
+      }
+      ++errors;
+    }
+  }
+  if (out[count] != 42) ++errors;  // Wrote past the end.
+  // The soft clip never reaches full scale, but gets close. With 8 bits,
+  // the last step is too coarse to tell.
+  if ((options & folve::PCM_SOFT_CLIP) && !(options & folve::PCM_DITHER)
+      && bits > 8) {
+    const float loud = 10.0f;
+    int loud_out;
+    folve::ConvertToPcm(&loud, 1, bits, options, &dither, &loud_out);
+    if ((loud_out >> shift) >= max_value
+        || (loud_out >> shift) < 0.99 * max_value) {
+      fprintf(stderr, "  %d bits: soft clip of %f gives %d\n",
+              bits, loud, loud_out >> shift);
+      ++errors;
+    }
+  }
+  // Remaining dither state has to be the same, so that the next call
+  // continues the same sequence.
+  for (int lane = 0; lane < 4; ++lane) {
+    if (dither.lanes[lane] != reference_dither.lanes[lane]) ++errors;
+  }
+  return errors;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  int failures = 0;
+  for (int c = 0; c < COUNT_OF(kChannels); ++c) {
+    for (int f = 0; f < COUNT_OF(kFrames); ++f) {
+      if (TestInterleaving(kChannels[c], kFrames[f]) != 0) ++failures;
+    }
+  }
+  for (int b = 0; b < COUNT_OF(kBits); ++b) {
+    for (int o = 0; o < COUNT_OF(kOptions); ++o) {
+      for (int f = 1; f < COUNT_OF(kFrames); ++f) {
+        if (TestPcm(kFrames[f], kBits[b], kOptions[o]) != 0) ++failures;
+      }
+    }
+  }
+  fprintf(stderr, "channel-ops: %s\n", failures ? "FAIL" : "ok");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "chunk-pool.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+
+// Number of chunks allocated at once.
+static const size_t kSlabChunks = 16;
+
+// Buffers not read or written for this long are considered idle; they are
+// the first to give their memory to others.
+static const time_t kIdleSeconds = 10;
+
+ChunkPool *ChunkPool::instance() {
+  static ChunkPool *pool = new ChunkPool();
+  return pool;
+}
+
+ChunkPool::ChunkPool()
+  : max_chunks_(0), allocated_chunks_(0), in_use_(0), reclaiming_(NULL) {
+  pthread_cond_init(&reclaim_done_, NULL);
+}
+
+void ChunkPool::set_max_bytes(size_t max_bytes) {
+  folve::MutexLock l(&mutex_);
+  max_chunks_ = max_bytes / kChunkSize;
+}
+
+size_t ChunkPool::used_bytes() {
+  folve::MutexLock l(&mutex_);
+  return in_use_ * kChunkSize;
+}
+
+char *ChunkPool::Allocate(User *user) {
+  folve::MutexLock l(&mutex_);
+  if (in_use_ >= max_chunks_)
+    return NULL;
+  if (free_list_.empty()) {
+    const size_t count = std::min(kSlabChunks,
+                                  max_chunks_ - allocated_chunks_);
+    char *slab = (char*) malloc(count * kChunkSize);
+    if (slab == NULL)
+      return NULL;
+    for (size_t i = 0; i < count; ++i) {
+      free_list_.push_back(slab + i * kChunkSize);
+    }
+    allocated_chunks_ += count;
+  }
+  char *result = free_list_.back();
+  free_list_.pop_back();
+  ++in_use_;
+  ++users_[user];
+  return result;
+}
+
+void ChunkPool::Free(User *user, char *chunk) {
+  if (chunk == NULL) return;
+  folve::MutexLock l(&mutex_);
+  free_list_.push_back(chunk);
+  --in_use_;
+  std::map<User*, size_t>::iterator found = users_.find(user);
+  if (found != users_.end() && found->second > 0) --found->second;
+}
+
+bool ChunkPool::Reclaim(User *requester) {
+  User *victim = NULL;
+  {
+    folve::MutexLock l(&mutex_);
+    if (in_use_ < max_chunks_) return true;   // Somebody freed some.
+    if (reclaiming_ != NULL) return false;    // Others are on it.
+    // O(n), but this only happens if memory is tight, and n is the number
+    // of open buffers.
+    const time_t idle_since = time(NULL) - kIdleSeconds;
+    time_t oldest = 0;
+    for (std::map<User*, size_t>::const_iterator it = users_.begin();
+         it != users_.end(); ++it) {
+      if (it->first == requester || it->second == 0) continue;
+      const time_t last_use = it->first->LastUse();
+      if (last_use < idle_since && (victim == NULL || last_use < oldest)) {
+        victim = it->first;
+        oldest = last_use;
+      }
+    }
+    if (victim == NULL) return false;
+    reclaiming_ = victim;
+  }
+  // Not holding the lock, as the victim gives the chunks back with Free().
+  const bool released = victim->ReleaseChunks() > 0;
+  folve::MutexLock l(&mutex_);
+  reclaiming_ = NULL;
+  pthread_cond_broadcast(&reclaim_done_);
+  return released;
+}
+
+void ChunkPool::Unregister(User *user) {
+  folve::MutexLock l(&mutex_);
+  while (reclaiming_ == user) {
+    mutex_.WaitOn(&reclaim_done_);
+  }
+  users_.erase(user);
+}
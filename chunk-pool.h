@@ -0,0 +1,95 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_CHUNK_POOL_H
+#define FOLVE_CHUNK_POOL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include "util.h"
+
+// A global pool of fixed size memory chunks the ConversionBuffers keep
+// their data in. The total memory is capped; if no chunk is available
+// anymore, it is taken from the least recently used buffer that has been
+// idle for a while; only if there is none, buffers spill to their temp file.
+// Memory is allocated in larger slabs and never given back to the system,
+// but re-used (the cap is a hard upper bound).
+// This class is thread-safe.
+class ChunkPool {
+public:
+  static const size_t kChunkSize = 64 << 10;
+
+  // Holds chunks, and can give them back if asked to.
+  class User {
+  public:
+    virtual ~User() {}
+
+    // Move all chunks elsewhere and Free() them. Called from other threads;
+    // must not wait for locks that might be held while in Allocate().
+    // Returns the number of chunks given back.
+    virtual size_t ReleaseChunks() = 0;
+
+    // When this user last accessed its data.
+    virtual time_t LastUse() const = 0;
+  };
+
+  static ChunkPool *instance();
+
+  // Set maximum memory to be used. Default is 0, i.e. buffers only
+  // use temp files. To be called at startup.
+  void set_max_bytes(size_t max_bytes);
+  size_t max_bytes() const { return max_chunks_ * kChunkSize; }
+
+  // Bytes currently handed out.
+  size_t used_bytes();
+
+  // Get a chunk of kChunkSize bytes for "user". Returns NULL if the limit
+  // is reached.
+  char *Allocate(User *user);
+
+  // Give back a chunk received from Allocate().
+  void Free(User *user, char *chunk);
+
+  // If the limit is reached, ask the least recently used idle user other
+  // than "requester" to release its chunks. Returns 'true' if that freed
+  // some.
+  bool Reclaim(User *requester);
+
+  // The user is going away; it won't be asked to release chunks anymore.
+  // Waits if it is just being asked.
+  void Unregister(User *user);
+
+private:
+  ChunkPool();
+
+  folve::Mutex mutex_;
+  size_t max_chunks_;
+  size_t allocated_chunks_;   // Number of chunks carved from slabs so far.
+  size_t in_use_;
+  std::vector<char*> free_list_;
+  std::map<User*, size_t> users_;   // Chunks held by each user.
+  User *reclaiming_;                // Asked to release chunks right now.
+  pthread_cond_t reclaim_done_;
+};
+
+#endif  // FOLVE_CHUNK_POOL_H
@@ -0,0 +1,179 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "config-watcher.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <unistd.h>
+
+using folve::DLogf;
+
+// Everything that can leave a file with a different content. Editors
+// usually write a new file and rename it over the old one.
+static const uint32_t kWatchMask = (IN_CLOSE_WRITE | IN_MOVED_TO
+                                    | IN_MOVED_FROM | IN_CREATE | IN_DELETE
+                                    | IN_ATTRIB);
+
+class ConfigWatcher::WatcherThread : public folve::Thread {
+public:
+  // Not a background thread: we want to know about changes timely.
+  WatcherThread(ConfigWatcher *watcher) : Thread(false), watcher_(watcher) {}
+  virtual void Run() { watcher_->ProcessEvents(); }
+
+private:
+  ConfigWatcher *const watcher_;
+};
+
+ConfigWatcher::ConfigWatcher(Listener *listener)
+  : listener_(listener), inotify_fd_(-1), failed_(false), generation_(0),
+    thread_(NULL) {
+}
+
+bool ConfigWatcher::Watch(const std::vector<std::string> &files) {
+  folve::MutexLock l(&mutex_);
+  if (failed_)
+    return false;
+  if (inotify_fd_ < 0) {
+    // Not done in the constructor: the filesystem might still fork into
+    // the background.
+    inotify_fd_ = inotify_init();
+    if (inotify_fd_ < 0) {
+      syslog(LOG_INFO, "No inotify (%s); checking filter configurations "
+             "on each use.", strerror(errno));
+      failed_ = true;
+      return false;
+    }
+    thread_ = new WatcherThread(this);
+    thread_->Start();
+  }
+  bool all_watched = true;
+  for (size_t i = 0; i < files.size(); ++i) {
+    const std::string &file = files[i];
+    const std::string::size_type slash = file.find_last_of('/');
+    const std::string dir = (slash == std::string::npos)
+      ? "." : file.substr(0, slash);
+    if (watches_.find(dir) == watches_.end()) {
+      const int wd = inotify_add_watch(inotify_fd_, dir.c_str(), kWatchMask);
+      if (wd < 0) {
+        DLogf("Can't watch %s: %s", dir.c_str(), strerror(errno));
+        all_watched = false;
+        continue;
+      }
+      watches_[dir] = wd;
+      dirs_[wd].insert(dir);  // Same directory might be spelled differently.
+    }
+    files_.insert(std::make_pair(file, (int64_t) 0));
+  }
+  return all_watched;
+}
+
+int64_t ConfigWatcher::generation() {
+  folve::MutexLock l(&mutex_);
+  return generation_;
+}
+
+bool ConfigWatcher::ChangedSince(const std::vector<std::string> &files,
+                                 int64_t generation) {
+  folve::MutexLock l(&mutex_);
+  if (failed_)
+    return true;
+  if (generation_ == generation)
+    return false;  // Nothing at all changed.
+  for (size_t i = 0; i < files.size(); ++i) {
+    FileMap::const_iterator found = files_.find(files[i]);
+    if (found == files_.end() || found->second > generation)
+      return true;
+  }
+  return false;
+}
+
+void ConfigWatcher::DirectoryChanged_Locked(const std::string &dir,
+                                            std::vector<std::string> *changed) {
+  const std::string prefix = dir + "/";
+  for (FileMap::iterator it = files_.lower_bound(prefix);
+       it != files_.end() && it->first.compare(0, prefix.length(), prefix) == 0;
+       ++it) {
+    if (it->first.find('/', prefix.length()) != std::string::npos)
+      continue;  // In a subdirectory.
+    it->second = generation_;
+    changed->push_back(it->first);
+  }
+}
+
+void ConfigWatcher::ProcessEvents() {
+  char buffer[8192] __attribute__((aligned(__alignof__(struct inotify_event))));
+  for (;;) {
+    const ssize_t len = read(inotify_fd_, buffer, sizeof(buffer));
+    if (len < 0 && errno == EINTR)
+      continue;
+    std::vector<std::string> changed;
+    {
+      folve::MutexLock l(&mutex_);
+      ++generation_;
+      if (len <= 0) {
+        syslog(LOG_ERR, "Reading inotify events: %s; checking filter "
+               "configurations on each use.", strerror(errno));
+        failed_ = true;   // Everything is suspicious now.
+        return;
+      }
+      for (const char *pos = buffer; pos < buffer + len; ) {
+        const struct inotify_event *event = (const struct inotify_event*) pos;
+        pos += sizeof(struct inotify_event) + event->len;
+        if (event->mask & IN_Q_OVERFLOW) {
+          // Lost events, so all files might have changed.
+          for (FileMap::iterator it = files_.begin(); it != files_.end(); ++it) {
+            it->second = generation_;
+            changed.push_back(it->first);
+          }
+          continue;
+        }
+        DirMap::iterator found = dirs_.find(event->wd);
+        if (found == dirs_.end())
+          continue;
+        const std::set<std::string> &dirs = found->second;
+        for (std::set<std::string>::const_iterator dir = dirs.begin();
+             dir != dirs.end(); ++dir) {
+          if (event->mask & IN_IGNORED) {
+            // Directory gone (or unmounted): watch it again when used.
+            DirectoryChanged_Locked(*dir, &changed);
+            watches_.erase(*dir);
+            continue;
+          }
+          if (event->len == 0)
+            continue;
+          FileMap::iterator file = files_.find(*dir + "/" + event->name);
+          if (file != files_.end()) {
+            file->second = generation_;
+            changed.push_back(file->first);
+          }
+        }
+        if (event->mask & IN_IGNORED) {
+          dirs_.erase(found);
+        }
+      }
+    }
+    if (!changed.empty()) {
+      DLogf("Config watcher: %zd file(s) changed, first %s", changed.size(),
+            changed[0].c_str());
+      if (listener_) listener_->FilesChanged(changed);
+    }
+  }
+}
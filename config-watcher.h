@@ -0,0 +1,92 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_CONFIG_WATCHER_H
+#define FOLVE_CONFIG_WATCHER_H
+
+#include <stdint.h>
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// Watches filter configuration and impulse response files with inotify, so
+// that checking whether a processor is still up-to-date doesn't need to
+// stat() all its files.
+//
+// Each change of a watched file increments a generation counter. Users
+// remember the generation() at the time they read the files and later ask
+// ChangedSince() that generation.
+// The directories of the files are watched, not the files themselves, as
+// editors typically replace files instead of writing them in place.
+// This class is thread-safe.
+class ConfigWatcher {
+public:
+  class Listener {
+  public:
+    virtual ~Listener() {}
+
+    // Called in the watcher thread with the watched files that changed.
+    virtual void FilesChanged(const std::vector<std::string> &files) = 0;
+  };
+
+  // Does not take over ownership of the listener; it can be NULL.
+  ConfigWatcher(Listener *listener);
+
+  // Watch the given files. Returns 'false' if not all of them can be
+  // watched (e.g. no inotify available); changes of these need to be
+  // detected otherwise.
+  // The watcher thread is started with the first call.
+  bool Watch(const std::vector<std::string> &files);
+
+  // Current generation.
+  int64_t generation();
+
+  // Returns 'true' if any of the files changed after "generation" or is
+  // not watched (anymore).
+  bool ChangedSince(const std::vector<std::string> &files, int64_t generation);
+
+private:
+  class WatcherThread;
+  friend class WatcherThread;
+  typedef std::map<int, std::set<std::string> > DirMap;  // wd -> directories
+  typedef std::map<std::string, int> WatchMap;           // directory -> wd
+  typedef std::map<std::string, int64_t> FileMap;        // file -> change
+
+  // Read events; called in the watcher thread. Returns on fatal errors.
+  void ProcessEvents();
+
+  // Mark all watched files in the given directory as changed.
+  void DirectoryChanged_Locked(const std::string &dir,
+                               std::vector<std::string> *changed);
+
+  Listener *const listener_;
+  folve::Mutex mutex_;       // Protects the following.
+  int inotify_fd_;
+  bool failed_;
+  int64_t generation_;
+  DirMap dirs_;
+  WatchMap watches_;
+  FileMap files_;
+  WatcherThread *thread_;    // Lazily created.
+};
+
+#endif  // FOLVE_CONFIG_WATCHER_H
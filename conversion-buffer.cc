@@ -19,13 +19,42 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include "chunk-pool.h"
+#include "metrics.h"
+
+// Reads that are further away than this from the position we're converting
+// ask the SoundSource to seek instead of converting everything in-between.
+static const off_t kMaxSequentialDistance = 2 << 20;
+
+// Measure the read rate over intervals of at least this many seconds; the
+// result is smoothed with this weight for the new value.
+static const double kReadRateInterval = 0.5;
+static const double kReadRateWeight = 0.3;
+
+// The encoder writes in many small pieces; collect up to this many bytes
+// before storing them.
+static const size_t kStagingSize = 64 << 10;
+
+// Readers look at the available range without locking. The producer
+// publishes new data only after it is in the store.
+static inline off_t LoadAcquire(const off_t *value) {
+  return __atomic_load_n(value, __ATOMIC_ACQUIRE);
+}
+static inline void StoreRelease(off_t *value, off_t new_value) {
+  __atomic_store_n(value, new_value, __ATOMIC_RELEASE);
+}
+
 // Annoyingly, mkstemp() does not do TMPDIR trickery and tempnam() is obsolete.
 static char *TempNameAllocated(const char *pattern) {
   const char *tmp_path = getenv("TMPDIR");
@@ -39,28 +68,180 @@ static char *TempNameAllocated(const char *pattern) {
 }
 
 ConversionBuffer::ConversionBuffer(SoundSource *source, const SF_INFO &info)
-  : source_(source), out_filedes_(-1), snd_writing_enabled_(true),
-    total_written_(0), max_accessed_(0), header_end_(0), file_complete_(false) {
+  : source_(source), out_filedes_(-1), spill_failed_(false),
+    store_size_(0), first_memory_chunk_(0), snd_writing_enabled_(true),
+    staging_(new char[kStagingSize]), staged_bytes_(0),
+    total_written_(0), active_start_(0), region_generation_(0),
+    max_written_(0), max_accessed_(0), rate_window_start_(folve::CurrentTime()),
+    rate_window_pos_(0), read_rate_(0.0),
+    header_end_(0), file_complete_(false), finished_(false),
+    producing_(false), last_use_(time(NULL)) {
+  pthread_cond_init(&data_available_, NULL);
+  // After file-open: SetOutputSoundfile() already might attempt to write data.
+  source_->SetOutputSoundfile(this, info, CreateOutputSoundfile(info));
+}
+
+ConversionBuffer::~ConversionBuffer() {
+  ChunkPool::instance()->Unregister(this);
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    ChunkPool::instance()->Free(this, chunks_[i]);
+  }
+  if (out_filedes_ >= 0) close(out_filedes_);
+  delete [] staging_;
+  pthread_cond_destroy(&data_available_);
+}
+
+bool ConversionBuffer::EnsureSpillFile_Locked() {
+  if (out_filedes_ >= 0) return true;
+  if (spill_failed_) return false;
   char *filename = TempNameAllocated("folve-XXXXXX");
   out_filedes_ = mkstemp(filename);
   if (out_filedes_ < 0) {
     perror("Problem opening buffer file");
+    spill_failed_ = true;
   }
   unlink(filename);
   free(filename);
+  return out_filedes_ >= 0;
+}
 
-  // After file-open: SetOutputSoundfile() already might attempt to write data.
-  source_->SetOutputSoundfile(this, info, CreateOutputSoundfile(info));
+bool ConversionBuffer::WriteToFile_Locked(const char *data, size_t count,
+                                          off_t pos) {
+  if (!EnsureSpillFile_Locked()) return false;
+  while (count > 0) {
+    const ssize_t w = pwrite(out_filedes_, data, count, pos);
+    if (w < 0) return false;
+    count -= w;
+    data += w;
+    pos += w;
+  }
+  return true;
 }
 
-ConversionBuffer::~ConversionBuffer() {
-  close(out_filedes_);
+char *ConversionBuffer::GetChunkForWrite_Locked(size_t index) {
+  if (index >= chunks_.size()) {
+    chunks_.resize(index + 1, NULL);
+    in_file_.resize(index + 1, false);
+  }
+  if (chunks_[index] != NULL) return chunks_[index];
+  if (in_file_[index]) return NULL;  // Parts of it are already in the file.
+  ChunkPool *const pool = ChunkPool::instance();
+  char *chunk = pool->Allocate(this);
+  if (chunk == NULL && pool->Reclaim(this)) {
+    chunk = pool->Allocate(this);  // Others might have been quicker.
+  }
+  if (chunk == NULL) {
+    // Under memory pressure and nobody idle. Move our oldest chunk to the
+    // file and re-use its memory; recent data is what is most likely read
+    // next.
+    size_t oldest = first_memory_chunk_;
+    while (oldest < chunks_.size() && (chunks_[oldest] == NULL
+                                       || oldest == index)) {
+      ++oldest;
+    }
+    if (oldest >= chunks_.size()
+        || !WriteToFile_Locked(chunks_[oldest], ChunkPool::kChunkSize,
+                               oldest * ChunkPool::kChunkSize)) {
+      return NULL;  // Nothing to give away; write directly to file.
+    }
+    chunk = chunks_[oldest];
+    chunks_[oldest] = NULL;
+    in_file_[oldest] = true;
+    first_memory_chunk_ = oldest + 1;
+  }
+  // Reads of parts not written yet should not show previous content.
+  memset(chunk, 0, ChunkPool::kChunkSize);
+  chunks_[index] = chunk;
+  if (index < first_memory_chunk_) first_memory_chunk_ = index;
+  return chunk;
+}
+
+size_t ConversionBuffer::ReleaseChunks() {
+  // Asked from another buffer holding its own store lock; don't wait for
+  // ours, it might be the other way round right now.
+  if (!store_mutex_.TryLock()) return 0;
+  size_t released = 0;
+  for (size_t i = first_memory_chunk_; i < chunks_.size(); ++i) {
+    if (chunks_[i] == NULL) continue;
+    if (!WriteToFile_Locked(chunks_[i], ChunkPool::kChunkSize,
+                            i * ChunkPool::kChunkSize)) {
+      break;  // Keep the rest in memory.
+    }
+    ChunkPool::instance()->Free(this, chunks_[i]);
+    chunks_[i] = NULL;
+    in_file_[i] = true;
+    first_memory_chunk_ = i + 1;
+    ++released;
+  }
+  store_mutex_.Unlock();
+  return released;
+}
+
+time_t ConversionBuffer::LastUse() const {
+  return __atomic_load_n(&last_use_, __ATOMIC_RELAXED);
+}
+
+void ConversionBuffer::Touch() {
+  __atomic_store_n(&last_use_, time(NULL), __ATOMIC_RELAXED);
+}
+
+bool ConversionBuffer::WriteAt(const void *data, size_t count, off_t pos) {
+  Touch();
+  folve::MutexLock l(&store_mutex_);
+  const char *buf = (const char*) data;
+  const off_t end = pos + count;
+  while (count > 0) {
+    const size_t index = pos / ChunkPool::kChunkSize;
+    const size_t chunk_pos = pos % ChunkPool::kChunkSize;
+    const size_t len = std::min(count, ChunkPool::kChunkSize - chunk_pos);
+    char *chunk = GetChunkForWrite_Locked(index);
+    if (chunk != NULL) {
+      memcpy(chunk + chunk_pos, buf, len);
+    } else if (WriteToFile_Locked(buf, len, pos)) {
+      in_file_[index] = true;
+    } else {
+      return false;
+    }
+    buf += len;
+    pos += len;
+    count -= len;
+  }
+  if (end > store_size_) store_size_ = end;
+  return true;
+}
+
+ssize_t ConversionBuffer::ReadFromStore(char *buf, size_t size, off_t pos) {
+  folve::MutexLock l(&store_mutex_);
+  if (pos >= store_size_) return 0;
+  size = std::min((off_t) size, store_size_ - pos);
+  size_t done = 0;
+  while (done < size) {
+    const size_t index = pos / ChunkPool::kChunkSize;
+    const size_t chunk_pos = pos % ChunkPool::kChunkSize;
+    const size_t len = std::min(size - done, ChunkPool::kChunkSize - chunk_pos);
+    if (index < chunks_.size() && chunks_[index] != NULL) {
+      memcpy(buf + done, chunks_[index] + chunk_pos, len);
+    } else {
+      ssize_t r = 0;
+      if (out_filedes_ >= 0) {
+        r = pread(out_filedes_, buf + done, len, pos);
+        if (r < 0) return done > 0 ? (ssize_t) done : -errno;
+      }
+      if ((size_t) r < len) {
+        memset(buf + done + r, 0, len - r);  // Not written (yet).
+      }
+    }
+    done += len;
+    pos += len;
+  }
+  return done;
 }
 
 sf_count_t ConversionBuffer::SndTell(void *userdata) {
   // This will be called within writing, when our mutex is locked. So only
   // call the version that assumed locked by mutex.
-  return reinterpret_cast<ConversionBuffer*>(userdata)->FileSize();
+  ConversionBuffer *buffer = reinterpret_cast<ConversionBuffer*>(userdata);
+  return buffer->WritePosition() + buffer->staged_bytes_;
 }
 sf_count_t ConversionBuffer::SndWrite(const void *ptr, sf_count_t count,
                                       void *userdata) {
@@ -97,50 +278,124 @@ SNDFILE *ConversionBuffer::CreateOutputSoundfile(const SF_INFO &out_info) {
   return sf_open_virtual(&virtual_io, SFM_WRITE, &info_copy, this);
 }
 
-ssize_t ConversionBuffer::Append(const void *data, size_t count) {
-  if (out_filedes_ < 0) return -1;
+bool ConversionBuffer::Publish(const void *data, size_t count) {
   //fprintf(stderr, "Extend horizon by %ld bytes.\n", count);
-  int remaining = count;
-  const char *buf = (const char*)data;
-  while (remaining > 0) {
-    int w = write(out_filedes_, data, count);
-    if (w < 0) return -errno;
-    remaining -= w;
-    buf += w;
-  }
-  total_written_ += count;
+  // Only the producer appends, so nobody else modifies total_written_.
+  const off_t pos = LoadAcquire(&total_written_);
+  if (!WriteAt(data, count, pos)) return false;
+  const off_t end = pos + count;
+  StoreRelease(&total_written_, end);
+  if (end > LoadAcquire(&max_written_)) {
+    StoreRelease(&max_written_, end);
+  }
+  folve::metrics::bytes_produced.Add(count);
+  return true;
+}
+
+bool ConversionBuffer::FlushStaging() {
+  if (staged_bytes_ == 0) return true;
+  const size_t count = staged_bytes_;
+  staged_bytes_ = 0;
+  if (!Publish(staging_, count)) {
+    fprintf(stderr, "Couldn't store %zu bytes of encoded data.\n", count);
+    return false;
+  }
+  return true;
+}
+
+ssize_t ConversionBuffer::Append(const void *data, size_t count) {
+  if (!FlushStaging() || !Publish(data, count)) return -1;
   return count;
 }
 
 void ConversionBuffer::WriteCharAt(unsigned char c, off_t offset) {
-  if (out_filedes_ < 0) return;
-  if (pwrite(out_filedes_, &c, 1, offset) != 1) fprintf(stderr, "Oops.");
+  FlushStaging();  // Might be a position we haven't stored yet.
+  if (!WriteAt(&c, 1, offset)) fprintf(stderr, "Oops.");
 }
 
 ssize_t ConversionBuffer::SndAppend(const void *data, size_t count) {
   if (!snd_writing_enabled_) return count;
-  return Append(data, count);
+  if (staged_bytes_ + count > kStagingSize) {
+    if (!FlushStaging()) return -1;
+    if (count >= kStagingSize) {
+      return Publish(data, count) ? (ssize_t) count : -1;
+    }
+  }
+  memcpy(staging_ + staged_bytes_, data, count);
+  staged_bytes_ += count;
+  return count;
 }
 
-void ConversionBuffer::HeaderFinished() { header_end_ = FileSize(); }
+void ConversionBuffer::HeaderFinished() {
+  FlushStaging();
+  header_end_ = WritePosition();
+}
 
-// The following are rather informal; because we access them in 
-// StatusServer:
-//  FileCacheHandler::GetHandlerStatus() -> ConversionBuffer::FileSize()
-// PreBufferThread:
-//  ConversionBuffer::FillUntil() -> FileHandlerCache::FindAndPin
-// We don't lock these values here.
 off_t ConversionBuffer::FileSize() const {
-  return total_written_;
+  return LoadAcquire(&max_written_);
+}
+
+off_t ConversionBuffer::WritePosition() const {
+  return LoadAcquire(&total_written_);
+}
+
+bool ConversionBuffer::IsContiguous() const {
+  folve::MutexLock l(&mutex_);
+  return IsContiguous_Locked();
+}
+
+bool ConversionBuffer::IsContiguous_Locked() const {
+  if (active_start_ == 0)
+    return true;
+  // Regions are merged, so the first one has to reach up to the active one.
+  std::map<off_t, off_t>::const_iterator first = done_regions_.begin();
+  return (first != done_regions_.end() && first->first == 0
+          && first->second >= active_start_);
 }
 
+off_t ConversionBuffer::StoredBytes() {
+  folve::MutexLock l(&store_mutex_);
+  return store_size_;
+}
+
+// This one is rather informal; it is only used for statistics and
+// pre-buffer heuristics. We don't lock this value here.
 off_t ConversionBuffer::MaxAccessed() const {
   return max_accessed_;
 }
 
+double ConversionBuffer::ReadRate() const {
+  folve::MutexLock l(&mutex_);
+  return read_rate_;
+}
+
 void ConversionBuffer::NotifyFileComplete() {
   folve::MutexLock l(&mutex_);
   file_complete_ = true;
+  // Callers expect the source not to be in use anymore once we return.
+  while (producing_) {
+    mutex_.WaitOn(&data_available_);
+  }
+  Finish_Locked();
+  source_ = NULL;  // Might be gone soon; we live on in the render cache.
+}
+
+void ConversionBuffer::Finish_Locked() {
+  finished_ = true;
+  // From now on, everything is just one more region that is converted.
+  if (WritePosition() > active_start_) {
+    AddConvertedRegion_Locked(active_start_, WritePosition());
+  }
+}
+
+off_t ConversionBuffer::NextConvertedRegion(off_t position, off_t *end) const {
+  folve::MutexLock l(&mutex_);
+  std::map<off_t, off_t>::const_iterator it
+    = done_regions_.lower_bound(position);
+  if (it == done_regions_.end())
+    return -1;
+  *end = it->second;
+  return it->first;
 }
 
 bool ConversionBuffer::IsFileComplete() const {
@@ -148,21 +403,163 @@ bool ConversionBuffer::IsFileComplete() const {
   return file_complete_;
 }
 
+void ConversionBuffer::BecomeProducer_Locked() {
+  while (producing_) {
+    mutex_.WaitOn(&data_available_);
+  }
+  producing_ = true;
+}
+
+bool ConversionBuffer::BecomeProducer() {
+  folve::MutexLock l(&mutex_);
+  if (finished_)
+    return false;
+  BecomeProducer_Locked();
+  if (finished_) {   // While we were waiting.
+    StopProducing_Locked();
+    return false;
+  }
+  return true;
+}
+
+void ConversionBuffer::StopProducing() {
+  folve::MutexLock l(&mutex_);
+  StopProducing_Locked();
+}
+
+void ConversionBuffer::StopProducing_Locked() {
+  producing_ = false;
+  pthread_cond_broadcast(&data_available_);
+}
+
 bool ConversionBuffer::FillUntil(off_t requested_min_written) {
   // As soon as someone tries to read beyond of what we already have, we call
   // the callback that fills more of it.
-  // We are shared between potentially several open files. Serialize threads.
+  // We are shared between potentially several open files and the pre-buffer
+  // threads. Only one of them produces at a time, the others wait for
+  // the data to show up. We don't hold the lock while producing, so that
+  // readers of available data and other waiters are not blocked.
   folve::MutexLock l(&mutex_);
-  while (!file_complete_ && total_written_ < requested_min_written) {
-    if (!source_->AddMoreSoundData()) {
+  if (file_complete_ || WritePosition() >= requested_min_written)
+    return file_complete_;
+  folve::ScopedTimer timer(&folve::metrics::fill_wait_time);
+  while (!file_complete_ && WritePosition() < requested_min_written) {
+    if (producing_) {
+      mutex_.WaitOn(&data_available_);  // Somebody else working on it.
+      continue;
+    }
+    BecomeProducer_Locked();
+    mutex_.Unlock();
+    const bool more_data = source_->AddMoreSoundData();
+    FlushStaging();  // Make what we've got visible to readers.
+    mutex_.Lock();
+    if (!more_data) {
       file_complete_ = true;
-      break;
+      // Unless there are gaps left, nobody will ask for more.
+      if (IsContiguous_Locked()) Finish_Locked();
     }
+    StopProducing_Locked();
   }
   return file_complete_;
 }
 
-ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset) {
+void ConversionBuffer::Reposition(off_t position) {
+  // Called by the producer from the SoundSource; mutex_ is not held.
+  FlushStaging();  // Still belongs to the old position.
+  folve::MutexLock l(&mutex_);
+  const off_t end = WritePosition();
+  if (end > active_start_) {
+    AddConvertedRegion_Locked(active_start_, end);
+  }
+  // Readers without lock must never see a mix of old and new values, so
+  // mark that we're changing the region (see IsAvailable()).
+  __atomic_add_fetch(&region_generation_, 1, __ATOMIC_SEQ_CST);
+  StoreRelease(&active_start_, position);
+  StoreRelease(&total_written_, position);
+  __atomic_add_fetch(&region_generation_, 1, __ATOMIC_SEQ_CST);
+  file_complete_ = false;
+}
+
+bool ConversionBuffer::IsAvailable(off_t from, off_t to) const {
+  const int generation = __atomic_load_n(&region_generation_, __ATOMIC_ACQUIRE);
+  if (generation & 1)
+    return false;  // Reposition() in progress.
+  const bool result = (from >= LoadAcquire(&active_start_)
+                       && to <= LoadAcquire(&total_written_));
+  return result && (generation
+                    == __atomic_load_n(&region_generation_, __ATOMIC_ACQUIRE));
+}
+
+void ConversionBuffer::AddConvertedRegion_Locked(off_t start, off_t end) {
+  // Merge with all regions overlapping or adjacent to this.
+  std::map<off_t, off_t>::iterator it = done_regions_.upper_bound(start);
+  if (it != done_regions_.begin()) {
+    std::map<off_t, off_t>::iterator before = it;
+    --before;
+    if (before->second >= start) {
+      start = before->first;
+      end = std::max(end, before->second);
+      done_regions_.erase(before);
+    }
+  }
+  while (it != done_regions_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    done_regions_.erase(it++);
+  }
+  done_regions_[start] = end;
+}
+
+bool ConversionBuffer::IsConverted_Locked(off_t from, off_t to) const {
+  if (from >= active_start_ && to <= WritePosition())
+    return true;
+  const off_t end = ConvertedEnd_Locked(from);
+  if (to <= end)
+    return true;
+  // The region we're appending to might continue right where this ends.
+  return end >= active_start_ && end > from && to <= WritePosition();
+}
+
+off_t ConversionBuffer::ConvertedEnd_Locked(off_t position) const {
+  std::map<off_t, off_t>::const_iterator it
+    = done_regions_.upper_bound(position);
+  if (it == done_regions_.begin())
+    return position;
+  --it;
+  return std::max(position, it->second);
+}
+
+bool ConversionBuffer::IsFarAway_Locked(off_t offset) const {
+  return offset < active_start_
+    || offset > WritePosition() + kMaxSequentialDistance;
+}
+
+bool ConversionBuffer::SeekIfFarAway(off_t offset, off_t required_end) {
+  folve::MutexLock l(&mutex_);
+  if (finished_)
+    return true;  // Nothing more to come; what we have is all there is.
+  if (IsConverted_Locked(offset, required_end))
+    return true;
+  // If the beginning is converted already, only the rest is needed.
+  const off_t position = ConvertedEnd_Locked(offset);
+  if (!IsFarAway_Locked(position))
+    return false;
+  // Somebody skipped far ahead (or back to a region we skipped over
+  // before). If possible, start converting right there. Changing
+  // the position of the source is only possible if nobody else is
+  // producing right now.
+  BecomeProducer_Locked();
+  if (!finished_ && !IsConverted_Locked(offset, required_end)
+      && IsFarAway_Locked(position)) {
+    mutex_.Unlock();
+    source_->SeekOutput(position);
+    FlushStaging();
+    mutex_.Lock();
+  }
+  StopProducing_Locked();
+  return IsConverted_Locked(offset, required_end);
+}
+
+void ConversionBuffer::MakeAvailable(size_t size, off_t offset) {
   // As long as we're reading only within the header area, allow 'short' reads,
   // i.e. reads that return less bytes than requested (but up to the headers'
   // size). That means:
@@ -178,15 +575,76 @@ ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset) {
   //     required_min_written = offset + size;  // all requested bytes.
   const off_t required_min_written = offset + (offset >= header_end_ ? size : 1);
 
-  FillUntil(required_min_written);
+  // Common case: we already have the data. No need to wait for anyone.
+  if (!IsAvailable(offset, required_min_written)) {
+    folve::ScopedPlaybackPriority priority;  // If a player waits for us.
+    if (!SeekIfFarAway(offset, required_min_written)) {
+      FillUntil(required_min_written);
+    }
+  }
+}
 
-  const ssize_t read_result = pread(out_filedes_, buf, size, offset);
+void ConversionBuffer::UpdateMaxAccessed(off_t offset, off_t end) {
+  if (end <= max_accessed_)
+    return;
+  folve::MutexLock l(&mutex_);
+  if (end <= max_accessed_)
+    return;
+  const double now = folve::CurrentTime();
+  if (offset > max_accessed_) {
+    // A skip ahead doesn't tell us anything about the rate; start over.
+    rate_window_start_ = now;
+    rate_window_pos_ = end;
+  } else if (now - rate_window_start_ >= kReadRateInterval) {
+    const double rate = (end - rate_window_pos_) / (now - rate_window_start_);
+    read_rate_ = (read_rate_ == 0.0)
+      ? rate
+      : (1 - kReadRateWeight) * read_rate_ + kReadRateWeight * rate;
+    rate_window_start_ = now;
+    rate_window_pos_ = end;
+  }
+  max_accessed_ = end;
+}
+
+ssize_t ConversionBuffer::Read(char *buf, size_t size, off_t offset) {
+  Touch();
+  MakeAvailable(size, offset);
+  const ssize_t read_result = ReadFromStore(buf, size, offset);
   if (read_result > 0) {
-    const off_t new_max_accessed = offset + read_result;
-    if (new_max_accessed > max_accessed_) {
-      folve::MutexLock l(&mutex_);
-      max_accessed_ = new_max_accessed;
-    }
+    UpdateMaxAccessed(offset, offset + read_result);
   }
   return read_result;
 }
+
+bool ConversionBuffer::GetFileRegion(size_t size, off_t offset,
+                                     int *fd, off_t *fd_offset,
+                                     size_t *available) {
+  Touch();
+  MakeAvailable(size, offset);
+  size_t len;
+  {
+    folve::MutexLock l(&store_mutex_);
+    if (out_filedes_ < 0 || offset >= store_size_)
+      return false;
+    size = std::min((off_t) size, store_size_ - offset);
+    // Chunks don't move back from the file to memory, so the data stays
+    // there after we let go of the lock.
+    len = 0;
+    while (len < size) {
+      const off_t pos = offset + len;
+      const size_t index = pos / ChunkPool::kChunkSize;
+      if (index >= in_file_.size() || !in_file_[index]
+          || chunks_[index] != NULL)
+        break;
+      len = std::min(size, len + ChunkPool::kChunkSize
+                     - pos % ChunkPool::kChunkSize);
+    }
+    if (len == 0)
+      return false;
+  }
+  *fd = out_filedes_;
+  *fd_offset = offset;
+  *available = len;
+  UpdateMaxAccessed(offset, offset + len);
+  return true;
+}
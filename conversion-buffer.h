@@ -19,14 +19,23 @@
 #ifndef FOLVE_CONVERSION_BUFFER_H
 #define FOLVE_CONVERSION_BUFFER_H
 
+#include <pthread.h>
 #include <sndfile.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
+
+#include "chunk-pool.h"
 #include "util.h"
 
-// A file-backed buffer for a SNDFILE, that is only filled on demand via
-// a SoundSource.
+// A buffer for a SNDFILE, that is only filled on demand via a SoundSource.
 // If Read() is called beyond the current available data, a callback is
 // called to write more into the SNDFILE.
-class ConversionBuffer {
+// The data is kept in memory chunks from the ChunkPool; if there is not
+// enough memory, it is spilled to a temp file. Buffers not accessed for a
+// while give their chunks to others that need them.
+class ConversionBuffer : public ChunkPool::User {
 public:
   // SoundSource, a instance of which needs to be passed to the
   // ConversionBuffer.
@@ -48,6 +57,12 @@ public:
     // Rerturns 'true' if there is more, 'false' if that was the last available
     // data.
     virtual bool AddMoreSoundData() = 0;
+
+    // Called if a read() is far away from the region we are currently
+    // converting. If the source can continue converting near "offset", it
+    // calls Reposition() on the buffer with the new position and returns
+    // 'true'. Otherwise, everything up to "offset" will be converted.
+    virtual bool SeekOutput(off_t offset) { return false; }
   };
 
   // Create a conversion buffer providing an sound output described in
@@ -57,15 +72,22 @@ public:
   //
   // Ownership is not taken over for source.
   ConversionBuffer(SoundSource *source, const SF_INFO &out_info);
-  ~ConversionBuffer();
+  virtual ~ConversionBuffer();
 
   // Read data from buffer. Can block and call the SoundSource first to get
   // more data if needed.
   ssize_t Read(char *buf, size_t size, off_t offset);
 
+  // Like Read(), but instead of copying, return where the data is stored
+  // in the temp file. Returns 'false' if not all of the beginning of the
+  // range is in the file (e.g. in memory); use Read() then.
+  bool GetFileRegion(size_t size, off_t offset,
+                     int *fd, off_t *fd_offset, size_t *available);
+
   // Append data. Usually called via the SndWrite() virtual-SNFFILE callback,
   // but can be used to write raw data as well (e.g. to write headers in
-  // SetOutputSoundfile())
+  // SetOutputSoundfile()). Pending data written via the SNDFILE is stored
+  // first.
   ssize_t Append(const void *data, size_t count);
 
   // Write at a particular position. Writes a single character - this is
@@ -76,6 +98,12 @@ public:
   // Return 'true' if file is complete
   bool FillUntil(off_t requested_min_written);
 
+  // Continue appending data at "position". To be called only from within
+  // the SoundSource callbacks. The region converted so far is kept, so
+  // reads there are still served; the gap in between is filled once
+  // someone reads it.
+  void Reposition(off_t position);
+
   // Enable writing through the SNDFILE.
   // If set to 'false', writes via the SNDFILE are ignored.
   // To be used to suppress writing of the header or
@@ -93,35 +121,152 @@ public:
   bool IsFileComplete() const;
 
   // Tell conversion buffer, that we're finished with this file. Any further
-  // FillUntil() calls will return immediately.
+  // FillUntil() calls will return immediately and the SoundSource is not
+  // called anymore, so it can go away while the buffer is still read.
   void NotifyFileComplete();
 
-  // Current max file position.
+  // Size of the file as far as we know it: the highest position written so
+  // far. This never goes back, not even after Reposition().
   off_t FileSize() const;
 
+  // End of the region we're currently converting; after a Reposition()
+  // this might be before FileSize().
+  off_t WritePosition() const;
+
+  // Returns if everything up to WritePosition() is converted, i.e. there
+  // are no gaps left from skipping ahead with Reposition().
+  bool IsContiguous() const;
+
+  // Start of the first region converted before at or after "position",
+  // with its end stored in "end"; -1 if there is none. For the SoundSource
+  // to not convert that again while filling a gap.
+  off_t NextConvertedRegion(off_t position, off_t *end) const;
+
   // Maximum position accessed. This might be different from FileSize in case
   // we have a pre-buffering thread running.
   off_t MaxAccessed() const;
 
+  // Size of the store, in memory chunks or the temp file.
+  off_t StoredBytes();
+
+  // Smoothed rate in bytes/second at which the reader advances through the
+  // file; 0.0 if not known yet.
+  double ReadRate() const;
+
+  // Use the SoundSource outside of its callbacks: waits until nobody else
+  // produces and keeps it so until StopProducing(). Returns 'false' if the
+  // file is finished; the source must not be used then.
+  bool BecomeProducer();
+  void StopProducing();
+
+  // ChunkPool::User: move the chunks in memory to the temp file.
+  virtual size_t ReleaseChunks();
+  virtual time_t LastUse() const;
+
 private:
   static sf_count_t SndTell(void *userdata);
   static sf_count_t SndWrite(const void *ptr, sf_count_t count, void *userdata);
 
-  // Append for the SndWrite callback.
+  // Append for the SndWrite callback. Data is collected in the staging
+  // buffer, which the producer flushes after each call to the SoundSource.
   ssize_t SndAppend(const void *data, size_t count);
 
+  // Store data at the end and make it visible to readers.
+  bool Publish(const void *data, size_t count);
+  bool FlushStaging();
+
+  // Make sure the data needed to serve a read of "size" bytes at "offset"
+  // is converted.
+  void MakeAvailable(size_t size, off_t offset);
+
+  // A read from "offset" to "end" has been served.
+  void UpdateMaxAccessed(off_t offset, off_t end);
+
+  // Remember that we're being accessed now.
+  void Touch();
+
+  // Store data at given position in memory chunks or the temp file.
+  bool WriteAt(const void *data, size_t count, off_t pos);
+  ssize_t ReadFromStore(char *buf, size_t size, off_t pos);
+
+  // Get the memory chunk with the given index to write to, allocating it if
+  // needed. Returns NULL if the data for this chunk has to go to the file.
+  char *GetChunkForWrite_Locked(size_t index);
+  bool EnsureSpillFile_Locked();
+  bool WriteToFile_Locked(const char *data, size_t count, off_t pos);
+
+  // Returns if the bytes from "from" to "to" are already converted.
+  bool IsConverted_Locked(off_t from, off_t to) const;
+
+  // End of the converted region "position" is in; "position" if it is not
+  // in one we skipped away from.
+  off_t ConvertedEnd_Locked(off_t position) const;
+
+  bool IsContiguous_Locked() const;
+
+  // The file is complete for good: nothing will be converted anymore.
+  void Finish_Locked();
+
+  // Quick check without locking if "from" to "to" is in the region we're
+  // currently appending to. If this returns false, it might still be
+  // available, ask IsConverted_Locked().
+  bool IsAvailable(off_t from, off_t to) const;
+
+  // If "offset" is too far from where we are converting, ask the source to
+  // seek. Returns 'true' if the range up to "required_end" is available.
+  bool SeekIfFarAway(off_t offset, off_t required_end);
+  bool IsFarAway_Locked(off_t offset) const;
+
+  // Only one thread at a time calls the SoundSource; it becomes the producer.
+  // Others wait on data_available_.
+  void BecomeProducer_Locked();
+  void StopProducing_Locked();
+
+  // Remember region from "start" to "end" as converted.
+  void AddConvertedRegion_Locked(off_t start, off_t end);
+
   // Create a SNDFILE the user has to write to in the WriteToSoundfile callback.
   // Can be NULL on error.
   SNDFILE *CreateOutputSoundfile(const SF_INFO &info);
 
-  SoundSource *const source_;
-  int out_filedes_;
+  SoundSource *source_;           // NULL once finished.
+
+  // The store. Chunks are either in memory, in the file or not written yet.
+  folve::Mutex store_mutex_;
+  std::vector<char*> chunks_;    // Memory chunk per index, NULL if none.
+  std::vector<bool> in_file_;    // Chunk with this index is in the file.
+  int out_filedes_;              // Temp file; created on first spill.
+  bool spill_failed_;
+  off_t store_size_;             // End of the highest byte written.
+  size_t first_memory_chunk_;    // No memory chunks below this index.
+
   bool snd_writing_enabled_;
+
+  // Written by the producer only.
+  char *const staging_;
+  size_t staged_bytes_;
+
+  // Region we are currently appending to. Read without lock; only
+  // modified by the producer. Modifying active_start_ (in Reposition())
+  // increments region_generation_ before and after.
   off_t total_written_;
+  off_t active_start_;
+  int region_generation_;
+  off_t max_written_;            // Highest total_written_ so far.
+
+  mutable folve::Mutex mutex_;   // Protects the following.
+  std::map<off_t, off_t> done_regions_;  // Other converted regions start->end
   off_t max_accessed_;
+  double rate_window_start_;     // Start of current read rate measurement.
+  off_t rate_window_pos_;        // max_accessed_ at rate_window_start_.
+  double read_rate_;
   off_t header_end_;
   bool file_complete_;
-  mutable folve::Mutex mutex_;
+  bool finished_;                // No gaps left to fill either.
+  bool producing_;               // Somebody is calling the SoundSource.
+  pthread_cond_t data_available_;
+
+  time_t last_use_;              // Atomic; last read or write.
 };
 
 #endif  // FOLVE_CONVERSION_BUFFER_H
@@ -0,0 +1,244 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Reads a ConversionBuffer like a player does that skips ahead and back:
+// the gaps are filled later, nothing is converted twice and the finished
+// file reads back completely after its source is gone, like it does when
+// it is stored in the render cache.
+
+#include <sndfile.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "chunk-pool.h"
+#include "conversion-buffer.h"
+
+namespace {
+const off_t kHeaderSize = 100;
+const off_t kFrameBytes = 4;
+const off_t kFileSize = kHeaderSize + (1500000 * kFrameBytes);
+const off_t kStep = 16384;        // Bytes converted per AddMoreSoundData().
+const off_t kReadSize = 64 << 10;
+
+int errors = 0;
+
+#define EXPECT(cond) do {                                               \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "%s:%d: Expected %s\n", __FILE__, __LINE__, #cond); \
+      ++errors;                                                         \
+    }                                                                   \
+  } while (0)
+
+unsigned char ByteAt(off_t pos) {
+  return (pos * 7 + pos / 251) & 0xff;
+}
+
+// Produces ByteAt() for every position; can continue anywhere after a
+// frame-aligned header, like a ConvolveFileHandler with PCM output.
+// With "skip_converted", it continues after regions converted before
+// instead of converting them again.
+class FakeSource : public ConversionBuffer::SoundSource {
+public:
+  explicit FakeSource(bool skip_converted)
+    : skip_converted_(skip_converted), buffer_(NULL), sndfile_(NULL),
+      alive_(true), seeks_(0), writes_(kFileSize, 0) {}
+  virtual ~FakeSource() { if (sndfile_) sf_close(sndfile_); }
+
+  virtual void SetOutputSoundfile(ConversionBuffer *parent,
+                                  const SF_INFO &info, SNDFILE *sndfile) {
+    buffer_ = parent;
+    sndfile_ = sndfile;
+    buffer_->set_sndfile_writes_enabled(false);  // We write raw data.
+    Produce(0, kHeaderSize);
+    buffer_->HeaderFinished();
+  }
+
+  virtual bool AddMoreSoundData() {
+    EXPECT(alive_);
+    const off_t pos = buffer_->WritePosition();
+    off_t len = std::min(kStep, kFileSize - pos);
+    // Don't convert again what is converted already.
+    off_t converted_end = 0;
+    const off_t converted = skip_converted_
+      ? buffer_->NextConvertedRegion(pos, &converted_end) : -1;
+    if (converted >= 0 && converted < pos + len) {
+      len = converted - pos;
+    }
+    Produce(pos, len);
+    if (converted >= 0 && pos + len == converted) {
+      buffer_->Reposition(converted_end);
+    }
+    return buffer_->WritePosition() < kFileSize;
+  }
+
+  virtual bool SeekOutput(off_t offset) {
+    EXPECT(alive_);
+    if (offset < kHeaderSize) return false;
+    ++seeks_;
+    buffer_->Reposition(offset - (offset - kHeaderSize) % kFrameBytes);
+    return true;
+  }
+
+  // The handler is gone; the buffer must not call us anymore.
+  void set_alive(bool alive) { alive_ = alive; }
+  int seeks() const { return seeks_; }
+
+  // Returns the number of bytes not converted exactly once.
+  int WriteErrors() const {
+    int result = 0;
+    for (off_t i = 0; i < kFileSize; ++i) {
+      if (writes_[i] != 1) ++result;
+    }
+    return result;
+  }
+
+private:
+  void Produce(off_t pos, off_t len) {
+    unsigned char data[kStep];
+    for (off_t i = 0; i < len; ++i) {
+      data[i] = ByteAt(pos + i);
+      ++writes_[pos + i];
+    }
+    if (len > 0) buffer_->Append(data, len);
+  }
+
+  const bool skip_converted_;
+  ConversionBuffer *buffer_;
+  SNDFILE *sndfile_;
+  bool alive_;
+  int seeks_;
+  std::vector<unsigned char> writes_;
+};
+
+// Read "size" bytes at "offset", compare and return how many we got.
+ssize_t ReadAndCompare(ConversionBuffer *buffer, off_t offset, size_t size) {
+  std::vector<char> buf(size);
+  const ssize_t r = buffer->Read(&buf[0], size, offset);
+  for (ssize_t i = 0; i < r; ++i) {
+    if ((unsigned char) buf[i] != ByteAt(offset + i)) {
+      fprintf(stderr, "  Byte at %lld differs\n", (long long) (offset + i));
+      ++errors;
+      break;
+    }
+  }
+  return r;
+}
+
+// Read sequentially in player-sized pieces from "from" to "to".
+void ReadRange(ConversionBuffer *buffer, off_t from, off_t to) {
+  for (off_t pos = from; pos < to; pos += kReadSize) {
+    const size_t size = std::min(kReadSize, to - pos);
+    EXPECT(ReadAndCompare(buffer, pos, size) == (ssize_t) size);
+  }
+}
+
+ConversionBuffer *CreateBuffer(FakeSource *source) {
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.samplerate = 44100;
+  info.channels = 2;
+  info.format = SF_FORMAT_RAW | SF_FORMAT_PCM_16;
+  ConversionBuffer *buffer = new ConversionBuffer(source, info);
+  EXPECT(buffer->HeaderSize() == kHeaderSize);
+  return buffer;
+}
+
+// Like a handler handing its buffer to the render cache: the source goes
+// away, the complete file can still be read.
+void ReadAfterSourceIsGone(ConversionBuffer *buffer, FakeSource *source) {
+  buffer->NotifyFileComplete();
+  source->set_alive(false);
+  ReadRange(buffer, 0, kFileSize);
+  EXPECT(ReadAndCompare(buffer, kFileSize, kReadSize) == 0);
+  delete source;
+  delete buffer;
+}
+
+void TestSkipAround() {
+  FakeSource *source = new FakeSource(true);
+  ConversionBuffer *buffer = CreateBuffer(source);
+
+  // Skip far ahead: continue converting there, then to the end.
+  const off_t skip = kHeaderSize + 1000000 * kFrameBytes;
+  ReadRange(buffer, skip, kFileSize);
+  EXPECT(source->seeks() == 1);
+  EXPECT(!buffer->IsContiguous());
+  EXPECT(buffer->FileSize() == kFileSize);
+
+  // Back into the gap. The size reported doesn't shrink while that is
+  // filled; once it reaches what we have, conversion continues after that.
+  const off_t gap = kHeaderSize + 250000 * kFrameBytes;
+  ReadRange(buffer, gap, gap + kReadSize);
+  EXPECT(source->seeks() == 2);
+  EXPECT(buffer->WritePosition() < kFileSize);
+  EXPECT(buffer->FileSize() == kFileSize);
+  ReadRange(buffer, gap, skip + kReadSize);
+  EXPECT(source->seeks() == 2);
+  EXPECT(!buffer->IsContiguous());
+
+  // Another skip into the gap, then back to right after the header.
+  // Filling up to there continues after the region converted with the
+  // skip, so that one becomes adjacent to what we're converting.
+  const off_t mid = kHeaderSize + 100000 * kFrameBytes;
+  ReadRange(buffer, mid, mid + kReadSize);
+  EXPECT(source->seeks() == 3);
+  const off_t resume = buffer->WritePosition();
+  ReadRange(buffer, kHeaderSize, mid + 2 * kReadSize);
+  EXPECT(source->seeks() == 4);
+  EXPECT(buffer->WritePosition() >= mid + 2 * kReadSize);
+  // A read spanning both regions doesn't need to seek again.
+  EXPECT(ReadAndCompare(buffer, resume - 1000, kReadSize)
+         == (ssize_t) kReadSize);
+  EXPECT(source->seeks() == 4);
+  ReadRange(buffer, resume, gap + kReadSize);
+  EXPECT(source->seeks() == 4);
+  EXPECT(buffer->IsContiguous());
+  EXPECT(buffer->FileSize() == kFileSize);
+  EXPECT(source->WriteErrors() == 0);
+  ReadAfterSourceIsGone(buffer, source);
+}
+
+// A source that can't skip what is converted already fills the last gap
+// up to the end, so it ends up right after the region before it.
+void TestConvertThroughToEnd() {
+  FakeSource *source = new FakeSource(false);
+  ConversionBuffer *buffer = CreateBuffer(source);
+  const off_t skip = kHeaderSize + 1000000 * kFrameBytes;
+  ReadRange(buffer, kHeaderSize, kHeaderSize + kReadSize);
+  ReadRange(buffer, skip, kFileSize);
+  const off_t gap = kHeaderSize + kReadSize;
+  EXPECT(buffer->WritePosition() == kFileSize);
+  ReadRange(buffer, gap, kFileSize);
+  EXPECT(source->seeks() == 2);
+  EXPECT(buffer->IsContiguous());
+  ReadAfterSourceIsGone(buffer, source);
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // Some in memory, most of it spilled to the temp file.
+  ChunkPool::instance()->set_max_bytes(1 << 20);
+  TestSkipAround();
+  TestConvertThroughToEnd();
+  fprintf(stderr, "conversion-buffer: %s\n", errors ? "FAIL" : "ok");
+  return errors == 0 ? 0 : 1;
+}
@@ -19,13 +19,18 @@
 #include "convolve-file-handler.h"
 
 #include <FLAC/metadata.h>
+#include <math.h>
 #include <sndfile.h>
 #include <string.h>
 #include <syslog.h>
 #include <assert.h>
 
+#include <vector>
+
 #include "conversion-buffer.h"
 #include "folve-filesystem.h"
+#include "pass-through-handler.h"
+#include "render-cache.h"
 #include "sound-processor.h"
 #include "util.h"
 #include "zita-config.h"
@@ -42,6 +47,15 @@
 #  define FLAC_BLOCK_SIZE 4096
 #endif
 
+// In gapless mode, open the next file once we've read this fraction of
+// the input.
+static const float kLookAheadFraction = 0.9;
+
+// Estimating the size of compressed output: encode this many windows of
+// this many seconds, evenly spread over the file.
+static const int kEstimateWindows = 3;
+static const float kEstimateWindowSeconds = 0.5;
+
 using folve::DLogf;
 using folve::Appendf;
 using folve::StringPrintf;
@@ -59,10 +73,12 @@ FileHandler *ConvolveFileHandler::Create(FolveFilesystem *fs,
                                          HandlerStats *partial_file_info) {
   SF_INFO in_info;
   memset(&in_info, 0, sizeof(in_info));
-  SNDFILE *snd = sf_open_fd(filedes, SFM_READ, &in_info, 0);
+  ReadAheadFile *input_file = new ReadAheadFile(filedes);
+  SNDFILE *snd = input_file->Open(&in_info);
   if (snd == NULL) {
     DLogf("File %s: %s", underlying_file.c_str(), sf_strerror(NULL));
     partial_file_info->message = sf_strerror(NULL);
+    delete input_file;
     return NULL;
   }
 
@@ -74,34 +90,103 @@ FileHandler *ConvolveFileHandler::Create(FolveFilesystem *fs,
   Appendf(&partial_file_info->format, "%.1fkHz, %d Bit",
           in_info.samplerate / 1000.0, bits);
   partial_file_info->duration_seconds = in_info.frames / in_info.samplerate;
+  const std::string encoder_profile = fs->EncoderProfileName();
+  if (!encoder_profile.empty()) {
+    Appendf(&partial_file_info->format, ", %s", encoder_profile.c_str());
+  }
 
-  SoundProcessor *processor = fs->processor_pool()
-    ->GetOrCreate(zita_config_dir, in_info.samplerate, in_info.channels, bits,
-                  &partial_file_info->message);
-  if (processor == NULL) {
+  std::string config_path;
+  if (!fs->processor_pool()->FindConfigFile(zita_config_dir,
+                                            in_info.samplerate,
+                                            in_info.channels, bits,
+                                            &config_path,
+                                            &partial_file_info->message)) {
     sf_close(snd);
+    delete input_file;
+    return NULL;
+  }
+
+  // If we have rendered this file with the same filter before, we can just
+  // serve these bytes without any convolving work.
+  std::string render_cache_key;
+  RenderCache *const render_cache = fs->render_cache();
+  if (render_cache != NULL) {
+    struct stat source_stat;
+    time_t config_timestamp;
+    if (fstat(filedes, &source_stat) != 0
+        || !fs->processor_pool()->GetConfigTimestamp(
+             config_path, &config_timestamp, &partial_file_info->message)) {
+      sf_close(snd);
+      delete input_file;
+      return NULL;
+    }
+    render_cache_key = RenderCache::CreateKey(underlying_file, source_stat,
+                                              config_path, config_timestamp,
+                                              encoder_profile,
+                                              fs->processor_pool()
+                                              ->output_options());
+    const int cached_fd = render_cache->Open(render_cache_key);
+    if (cached_fd >= 0) {
+      DLogf("File %s: served from render cache", underlying_file.c_str());
+      sf_close(snd);
+      delete input_file;
+      close(filedes);
+      partial_file_info->format.append(", cached");
+      return new PassThroughHandler(cached_fd, filter_subdir,
+                                    *partial_file_info);
+    }
+  }
+
+  // Many clients only look at the header, e.g. while scanning a library.
+  // So we only need to know what the output looks like now; the expensive
+  // processor is acquired once sound data is requested.
+  int output_channels;
+  if (!fs->processor_pool()->GetOutputChannels(config_path, &output_channels,
+                                               &partial_file_info->message)) {
+    syslog(LOG_ERR, "filter-config %s: %s", config_path.c_str(),
+           partial_file_info->message.c_str());
+    sf_close(snd);
+    delete input_file;
     return NULL;
   }
   const int seconds = in_info.frames / in_info.samplerate;
   DLogf("File %s, %.1fkHz, %d Bit, %d:%02d: filter config %s",
         underlying_file.c_str(), in_info.samplerate / 1000.0, bits,
-        seconds / 60, seconds % 60,
-        processor->config_file().c_str());
-  return new ConvolveFileHandler(fs, fs_path, filter_subdir,
-                                 underlying_file, filedes, snd, in_info,
-                                 *partial_file_info, processor);
+        seconds / 60, seconds % 60, config_path.c_str());
+  ConvolveFileHandler *handler
+    = new ConvolveFileHandler(fs, fs_path, filter_subdir,
+                              underlying_file, filedes, input_file, snd,
+                              in_info,
+                              *partial_file_info, config_path,
+                              output_channels);
+  handler->render_cache_key_ = render_cache_key;
+  return handler;
 }
 
 ConvolveFileHandler::~ConvolveFileHandler() {
   output_buffer_->NotifyFileComplete();
   fs_->QuitBuffering(output_buffer_);  // stop working on our files.
+  if (next_file_requested_) {
+    fs_->ForgetNextFile(base_stats_.filename);
+  }
   Close();                             // ... so that we can close them :)
-  delete output_buffer_;
+  delete input_;
+  // Instead of throwing away a fully convolved file, keep it for next time.
+  // Not if it was joined gapless: then it begins with the tail of the file
+  // before or lacks its own, which is wrong once played on its own.
+  // Copying the file is left to the render cache; we might be called in
+  // a thread somebody is waiting for.
+  const bool gapless = base_stats_.in_gapless || base_stats_.out_gapless;
+  if (conversion_complete_ && !error_ && !gapless
+      && fs_->render_cache() != NULL && !render_cache_key_.empty()) {
+    fs_->render_cache()->StoreLater(render_cache_key_, output_buffer_);
+  } else {
+    delete output_buffer_;
+  }
 }
 
-int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
-  if (error_) return -1;
-  const off_t current_filesize = output_buffer_->FileSize();
+bool ConvolveFileHandler::IsSkipToEnd(size_t size, off_t offset,
+                                      off_t current_filesize) const {
   const off_t read_horizon = offset + size;
   // If this is a skip suspiciously at the very end of the file as
   // reported by stat, we don't do any encoding, just return garbage.
@@ -113,8 +198,14 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
   static const int kFudgeOverhang = 512;
   // But of course only if this is really a skip, not a regular approaching
   // end-of-file.
-  if (current_filesize < offset
-      && (int) (read_horizon + kFudgeOverhang) >= file_stat_.st_size) {
+  return (current_filesize < offset
+          && (int) (read_horizon + kFudgeOverhang) >= file_stat_.st_size);
+}
+
+int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
+  if (error_) return -1;
+  const off_t current_filesize = output_buffer_->FileSize();
+  if (IsSkipToEnd(size, offset, current_filesize)) {
     const int pretended_bytes = std::min((off_t)size,
                                          file_stat_.st_size - offset);
     if (pretended_bytes > 0) {
@@ -128,7 +219,25 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
   // The following read might block and call WriteToSoundfile() until the
   // buffer is filled.
   int result = output_buffer_->Read(buf, size, offset);
+  RequestPrebufferIfNeeded(offset + size, output_buffer_->WritePosition());
+  return result;
+}
 
+bool ConvolveFileHandler::GetFileRegion(size_t size, off_t offset,
+                                        int *fd, off_t *fd_offset,
+                                        size_t *available) {
+  if (error_) return false;
+  const off_t current_filesize = output_buffer_->FileSize();
+  if (IsSkipToEnd(size, offset, current_filesize))
+    return false;
+  if (!output_buffer_->GetFileRegion(size, offset, fd, fd_offset, available))
+    return false;
+  RequestPrebufferIfNeeded(offset + size, output_buffer_->WritePosition());
+  return true;
+}
+
+void ConvolveFileHandler::RequestPrebufferIfNeeded(off_t read_horizon,
+                                                   off_t write_position) {
   // Only if the user obviously read beyond our header, we start the
   // pre-buffering; otherwise things will get sluggish because any header
   // access that goes a bit overboard triggers pre-buffer (i.e. while indexing)
@@ -142,21 +251,26 @@ int ConvolveFileHandler::Read(char *buf, size_t size, off_t offset) {
   // covered.
   const off_t well_beyond_header = output_buffer_->HeaderSize() + (64 << 10);
   const bool should_request_prebuffer = read_horizon > well_beyond_header
-    && read_horizon + fs_->pre_buffer_size() > current_filesize
+    && read_horizon + fs_->PrebufferLead(output_buffer_) > write_position
     && !output_buffer_->IsFileComplete();
   if (should_request_prebuffer) {
     fs_->RequestPrebuffer(output_buffer_);
   }
-  return result;
+}
+
+off_t ConvolveFileHandler::BufferBytes() {
+  return output_buffer_->StoredBytes();
 }
 
 void ConvolveFileHandler::GetHandlerStatus(HandlerStats *stats) {
+  // Called by the status server while the file is converted; we only look
+  // at what the producer publishes, never at the processor.
   const off_t file_size = output_buffer_->FileSize();
   const off_t max_access = output_buffer_->MaxAccessed();
-  if (processor_ != NULL) {
-    base_stats_.max_output_value = processor_->max_output_value();
-  }
+  stats_mutex_.Lock();
   *stats = base_stats_;
+  stats_mutex_.Unlock();
+  stats->max_output_value = max_output_value();
   const int frames_done = in_info_.frames - frames_left();
   if (frames_done == 0 || in_info_.frames == 0) {
     stats->buffer_progress = 0.0;
@@ -166,23 +280,29 @@ void ConvolveFileHandler::GetHandlerStatus(HandlerStats *stats) {
     stats->access_progress = stats->buffer_progress * max_access / file_size;
   }
 
-  if (base_stats_.max_output_value > 1.0) {
+  if (stats->max_output_value > 1.0) {
     // TODO: the status server could inspect this value and make better
     // rendering.
-    base_stats_.message =
+    stats->message =
       StringPrintf("Output clipping! "
                    "(max=%.3f; Multiply gain with <= %.5f<br/>in %s)",
-                   base_stats_.max_output_value,
-                   1.0 / base_stats_.max_output_value,
-                   processor_ != NULL
-                   ? processor_->config_file().c_str()
-                   : "filter");
+                   stats->max_output_value,
+                   1.0 / stats->max_output_value,
+                   config_path_.c_str());
   }
 }
 
 int ConvolveFileHandler::Stat(struct stat *st) {
+  if (__atomic_load_n(&estimate_pending_, __ATOMIC_ACQUIRE)) {
+    EstimateOutputSize();
+  }
   const off_t current_file_size = output_buffer_->FileSize();
-  if (current_file_size > start_estimating_size_) {
+  if (size_exact_) {
+    // Trailing chunks such as tags written on close are not predicted.
+    if (current_file_size > file_stat_.st_size) {
+      file_stat_.st_size = current_file_size;
+    }
+  } else if (current_file_size > start_estimating_size_) {
     const int frames_done = in_info_.frames - frames_left();
     if (frames_done > 0) {
       const float estimated_end = 1.0 * in_info_.frames / frames_done;
@@ -204,39 +324,55 @@ ConvolveFileHandler::ConvolveFileHandler(FolveFilesystem *fs,
                                          const char *fs_path,
                                          const std::string &filter_dir,
                                          const std::string &underlying_file,
-                                         int filedes, SNDFILE *snd_in,
+                                         int filedes,
+                                         ReadAheadFile *input_file,
+                                         SNDFILE *snd_in,
                                          const SF_INFO &in_info,
                                          const HandlerStats &file_info,
-                                         SoundProcessor *processor)
+                                         const std::string &config_path,
+                                         int output_channels)
   : FileHandler(filter_dir), fs_(fs),
-    filedes_(filedes), snd_in_(snd_in), in_info_(in_info),
-  base_stats_(file_info),
-  error_(false), output_buffer_(NULL),
-  snd_out_(NULL), processor_(processor),
-  input_frames_left_(in_info.frames) {
+    filedes_(filedes), input_file_(input_file), snd_in_(snd_in), input_(NULL),
+    in_info_(in_info),
+  base_stats_(file_info), predicted_size_(0), size_exact_(false),
+  estimate_pending_(false),
+  error_(false), conversion_complete_(false), sparse_(false),
+  next_file_requested_(false),
+  output_frame_bytes_(0), output_buffer_(NULL),
+  snd_out_(NULL), config_path_(config_path),
+  output_channels_(output_channels), processor_(NULL),
+  input_frames_left_(in_info.frames), max_output_value_(0) {
 
   // Initial stat that we're going to report to clients. We'll adapt
   // the filesize as we see it grow. Some clients continuously monitor
   // the size of the file to check when to stop.
   fstat(filedes_, &file_stat_);
   start_estimating_size_ = 0.4 * file_stat_.st_size;
+
+  // The same file converted with other filters decodes the same input;
+  // share that work if they're read at the same time.
+  const std::string decode_key = StringPrintf(
+       "%s:%lld:%lld", underlying_file.c_str(),
+       (long long) file_stat_.st_mtime, (long long) file_stat_.st_size);
+  input_ = fs->shared_decoder()->CreateReader(decode_key, underlying_file,
+                                              snd_in, in_info);
   original_file_size_ = file_stat_.st_size;
   file_stat_.st_size *= fs->file_oversize_factor();
 
-  // The flac header we get is more rich than what we can create via
-  // sndfile. So if we have one, just copy it.
-  copy_flac_header_verbatim_ = LooksLikeInputIsFlac(in_info, filedes);
-
-  if (fs_->workaround_flac_header_issue()) {
-    copy_flac_header_verbatim_ = false;  // Disable again in that case.
-  }
-
   // Create a conversion buffer that creates a soundfile of a particular
   // format that we choose here. Essentially we want to generate mostly what
   // our input is.
   SF_INFO out_info = in_info;
   out_info.seekable = 0;
-  if ((in_info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_OGG) {
+  if (fs->uncompressed_output()) {
+    // Bandwidth is cheaper than CPU. Keep 16 bit input 16 bit.
+    const int sub = in_info.format & SF_FORMAT_SUBMASK;
+    out_info.format = SF_FORMAT_WAV;
+    out_info.format |= (sub == SF_FORMAT_PCM_16 || sub == SF_FORMAT_PCM_S8
+                        || sub == SF_FORMAT_PCM_U8)
+      ? SF_FORMAT_PCM_16 : SF_FORMAT_PCM_24;
+  }
+  else if ((in_info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_OGG) {
     // If the input was ogg, we're re-coding this to flac, because it
     // wouldn't let us stream the output.
     out_info.format = SF_FORMAT_FLAC;
@@ -250,10 +386,42 @@ ConvolveFileHandler::ConvolveFileHandler(FolveFilesystem *fs,
     out_info.format = in_info.format;
   }
 
-  out_info.channels = processor->output_channels();
+  out_info.channels = output_channels_;
   DLogf("Output channels: %d", out_info.channels);
 
+  // The flac header we get is more rich than what we can create via
+  // sndfile. So if we have one, just copy it.
+  copy_flac_header_verbatim_
+    = ((out_info.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_FLAC
+       && LooksLikeInputIsFlac(in_info, filedes));
+
+  if (fs_->workaround_flac_header_issue()) {
+    copy_flac_header_verbatim_ = false;  // Disable again in that case.
+  }
+
   output_buffer_ = new ConversionBuffer(this, out_info);
+  PredictOutputSize(out_info);
+}
+
+// Returns the size of a frame in bytes if the given format is PCM with
+// constant size frames. Returns 0 otherwise, e.g. for compressed formats
+// such as FLAC.
+static int PcmFrameBytes(const SF_INFO &info) {
+  const int type = info.format & SF_FORMAT_TYPEMASK;
+  if (type != SF_FORMAT_WAV && type != SF_FORMAT_WAVEX
+      && type != SF_FORMAT_AIFF)
+    return 0;
+  int sample_bytes = 0;
+  switch (info.format & SF_FORMAT_SUBMASK) {
+  case SF_FORMAT_PCM_S8:
+  case SF_FORMAT_PCM_U8:  sample_bytes = 1; break;
+  case SF_FORMAT_PCM_16:  sample_bytes = 2; break;
+  case SF_FORMAT_PCM_24:  sample_bytes = 3; break;
+  case SF_FORMAT_PCM_32:
+  case SF_FORMAT_FLOAT:   sample_bytes = 4; break;
+  case SF_FORMAT_DOUBLE:  sample_bytes = 8; break;
+  }
+  return sample_bytes * info.channels;
 }
 
 void ConvolveFileHandler::SetOutputSoundfile(ConversionBuffer *out_buffer,
@@ -263,10 +431,15 @@ void ConvolveFileHandler::SetOutputSoundfile(ConversionBuffer *out_buffer,
   if (snd_out_ == NULL) {
     error_ = true;
     syslog(LOG_ERR, "Opening output: %s", sf_strerror(NULL));
-    base_stats_.message = sf_strerror(NULL);
+    SetMessage(sf_strerror(NULL));
     return;
   }
-  if (copy_flac_header_verbatim_) {
+  SetCompressionLevel(snd_out_, info);
+  const bool own_wav_header = fs_->uncompressed_output();
+  if (own_wav_header) {
+    out_buffer->set_sndfile_writes_enabled(false);
+    CreateWavHeader(out_buffer, info);
+  } else if (copy_flac_header_verbatim_) {
     out_buffer->set_sndfile_writes_enabled(false);
     CopyFlacHeader(out_buffer);
   } else {
@@ -278,7 +451,7 @@ void ConvolveFileHandler::SetOutputSoundfile(ConversionBuffer *out_buffer,
   // We need to do this even if we copied our own header: that way we make
   // sure that the sndfile-header is flushed into the nirwana before we
   // re-enable sndfile_writes.
-  if (!fs_->workaround_flac_header_issue()) {
+  if (!fs_->workaround_flac_header_issue() || own_wav_header) {
     sf_command(snd_out_, SFC_UPDATE_HEADER_NOW, NULL, 0);
   }
 
@@ -319,10 +492,170 @@ void ConvolveFileHandler::SetOutputSoundfile(ConversionBuffer *out_buffer,
   out_buffer->set_sndfile_writes_enabled(true);  // ready for sound-stream.
   DLogf("Header init done (%s).", base_stats_.filename.c_str());
   out_buffer->HeaderFinished();
+
+  // We can only map byte positions to frames if we know where the sound
+  // data starts, i.e. the header has been flushed.
+  if ((!fs_->workaround_flac_header_issue() || own_wav_header)
+      && out_buffer->HeaderSize() > 0) {
+    output_frame_bytes_ = PcmFrameBytes(info);
+  }
+}
+
+void ConvolveFileHandler::PredictOutputSize(const SF_INFO &out_info) {
+  if (error_) return;
+  const off_t header_size = output_buffer_->HeaderSize();
+  if (output_frame_bytes_ > 0) {
+    // Uncompressed: header plus the sound data, padded to an even length.
+    off_t size = header_size + (off_t) in_info_.frames * output_frame_bytes_;
+    size += size % 2;
+    file_stat_.st_size = predicted_size_ = size;
+    size_exact_ = true;
+    return;
+  }
+  if (fs_->estimate_output_size()) {
+    // Expensive; only done once somebody asks for the size, not for
+    // clients only looking at the header.
+    out_info_ = out_info;
+    __atomic_store_n(&estimate_pending_, true, __ATOMIC_RELEASE);
+  }
+}
+
+void ConvolveFileHandler::EstimateOutputSize() {
+  // The estimate needs the input and the processor for itself.
+  if (!output_buffer_->BecomeProducer())
+    return;  // Finished already.
+  // Once converting, the input is somewhere else; we have to do without.
+  if (__atomic_load_n(&estimate_pending_, __ATOMIC_ACQUIRE)
+      && !error_ && !HasStarted() && AcquireProcessor()) {
+    const double bytes_per_frame = EstimateBytesPerFrame(out_info_);
+    if (bytes_per_frame > 0) {
+      predicted_size_ = output_buffer_->HeaderSize()
+        + (off_t) ceil(bytes_per_frame * in_info_.frames);
+      file_stat_.st_size = predicted_size_;
+      DLogf("File %s: estimated size %lld (%.2f bytes/frame)",
+            base_stats_.filename.c_str(), (long long) predicted_size_,
+            bytes_per_frame);
+    }
+  }
+  __atomic_store_n(&estimate_pending_, false, __ATOMIC_RELEASE);
+  output_buffer_->StopProducing();
+}
+
+// Virtual sound file for libsndfile that just counts the bytes written.
+namespace {
+struct ByteCounter {
+  sf_count_t pos;
+  sf_count_t length;
+};
+}  // namespace
+
+static sf_count_t CounterFileLen(void *user_data) {
+  return static_cast<ByteCounter*>(user_data)->length;
+}
+static sf_count_t CounterSeek(sf_count_t offset, int whence, void *user_data) {
+  ByteCounter *counter = static_cast<ByteCounter*>(user_data);
+  switch (whence) {
+  case SEEK_SET: counter->pos = offset; break;
+  case SEEK_CUR: counter->pos += offset; break;
+  case SEEK_END: counter->pos = counter->length + offset; break;
+  }
+  return counter->pos;
+}
+static sf_count_t CounterRead(void *ptr, sf_count_t count, void *user_data) {
+  return 0;
+}
+static sf_count_t CounterWrite(const void *ptr, sf_count_t count,
+                               void *user_data) {
+  ByteCounter *counter = static_cast<ByteCounter*>(user_data);
+  counter->pos += count;
+  counter->length = std::max(counter->length, counter->pos);
+  return count;
+}
+static sf_count_t CounterTell(void *user_data) {
+  return static_cast<ByteCounter*>(user_data)->pos;
+}
+
+double ConvolveFileHandler::EstimateBytesPerFrame(const SF_INFO &out_info) {
+  const int fragment = processor_->fragment_size();
+  int window = kEstimateWindowSeconds * in_info_.samplerate;
+  window = std::max(fragment, window - window % fragment);
+  if (in_info_.frames < (sf_count_t) kEstimateWindows * window)
+    return 0.0;   // Short files are quickly converted anyway.
+
+  SF_VIRTUAL_IO counter_io = { CounterFileLen, CounterSeek, CounterRead,
+                               CounterWrite, CounterTell };
+  // Each window is encoded on its own, so that we know exactly how many
+  // bytes it needs, including its last, partial, block. Parts of the file
+  // compress differently; the densest window is taken, so that we rather
+  // report a bit too much than programs reading short. If the file still
+  // turns out bigger, Stat() corrects the size while converting.
+  double max_bytes_per_frame = 0.0;
+  bool success = true;
+  const sf_count_t spacing = in_info_.frames / kEstimateWindows;
+  for (int w = 0; success && w < kEstimateWindows; ++w) {
+    ByteCounter counter = { 0, 0 };
+    SF_INFO info = out_info;
+    SNDFILE *sink = sf_open_virtual(&counter_io, SFM_WRITE, &info, &counter);
+    if (sink == NULL) {
+      success = false;
+      break;
+    }
+    SetCompressionLevel(sink, info);
+    sf_command(sink, SFC_UPDATE_HEADER_NOW, NULL, 0);
+    const sf_count_t header_bytes = counter.length;
+
+    // The windows start after the preroll of the filter.
+    const sf_count_t window_start = w * spacing + (spacing - window) / 2;
+    const sf_count_t start = std::max((sf_count_t) 0,
+                                      window_start
+                                      - processor_->filter_length());
+    if (!input_->Seek(start)) {
+      sf_close(sink);
+      success = false;
+      break;
+    }
+    processor_->Reset();
+    sf_count_t preroll = window_start - start;
+    sf_count_t todo = window;
+    while (todo > 0) {
+      const int r = processor_->FillBuffer(input_);
+      if (r == 0) {
+        success = false;
+        break;
+      }
+      const int discard = std::min((sf_count_t) r, preroll);
+      if (discard > 0) processor_->WriteProcessed(NULL, discard);
+      preroll -= discard;
+      const int keep = std::min((sf_count_t) (r - discard), todo);
+      if (keep > 0) processor_->WriteProcessed(sink, keep);
+      if (r - discard - keep > 0) {
+        processor_->WriteProcessed(NULL, r - discard - keep);
+      }
+      todo -= keep;
+    }
+    sf_close(sink);  // Flushes the last encoded block.
+    if (success) {
+      max_bytes_per_frame = std::max(max_bytes_per_frame,
+                                     1.0 * (counter.length - header_bytes)
+                                     / window);
+    }
+  }
+
+  // Back to the state a fresh file is in.
+  processor_->Reset();
+  processor_->ResetMaxValues();
+  if (!input_->Seek(0)) {
+    syslog(LOG_ERR, "Can't seek back to start after estimating size of '%s'",
+           base_stats_.filename.c_str());
+    SetMessage("Input not seekable.");
+    error_ = true;
+    return 0.0;
+  }
+  return success ? max_bytes_per_frame : 0.0;
 }
 
 bool ConvolveFileHandler::HasStarted() {
-  return in_info_.frames != input_frames_left_;
+  return in_info_.frames != frames_left();
 }
 
 bool ConvolveFileHandler::PassoverProcessor(SoundProcessor *passover_processor) {
@@ -331,10 +664,15 @@ bool ConvolveFileHandler::PassoverProcessor(SoundProcessor *passover_processor)
           base_stats_.filename.c_str());
     return false;
   }
-  assert(processor_);
-  if (passover_processor->config_file() != processor_->config_file()
-      || (passover_processor->config_file_timestamp()
-          != processor_->config_file_timestamp())) {
+  // Compare with the processor we have or would get.
+  const bool same_config = (processor_ != NULL)
+    ? (passover_processor->config_file() == processor_->config_file()
+       && (passover_processor->config_file_timestamp()
+           == processor_->config_file_timestamp()))
+    : (passover_processor->config_file() == config_path_
+       && fs_->processor_pool()->IsUpToDate(passover_processor)
+       && passover_processor->output_channels() == output_channels_);
+  if (!same_config) {
     DLogf("Gapless: Configuration changed; can't use %p to join gapless.",
           passover_processor);
     return false;
@@ -344,9 +682,11 @@ bool ConvolveFileHandler::PassoverProcessor(SoundProcessor *passover_processor)
   processor_ = passover_processor;
   if (!processor_->is_input_buffer_complete()) {
     // Fill with our beginning so that the donor can finish its processing.
-    input_frames_left_ -= processor_->FillBuffer(snd_in_);
+    SetFramesLeft(input_frames_left_ - processor_->FillBuffer(input_));
   }
+  stats_mutex_.Lock();
   base_stats_.in_gapless = true;
+  stats_mutex_.Unlock();
   return true;
 }
 
@@ -355,14 +695,27 @@ void ConvolveFileHandler::NotifyPassedProcessorUnreferenced() {
   fs_->RequestPrebuffer(output_buffer_);
 }
 
-static bool ExtractDirAndSuffix(const std::string &filename,
-                                std::string *dir, std::string *suffix) {
-  const std::string::size_type slash_pos = filename.find_last_of('/');
-  if (slash_pos == std::string::npos) return false;
-  *dir = filename.substr(0, slash_pos + 1);
-  const std::string::size_type dot_pos = filename.find_last_of('.');
-  if (dot_pos != std::string::npos && dot_pos > slash_pos) {
-    *suffix = filename.substr(dot_pos);
+bool ConvolveFileHandler::AcquireProcessor() {
+  if (processor_ != NULL)
+    return true;
+  if (error_)
+    return false;
+  std::string message;
+  processor_ = fs_->processor_pool()
+    ->GetOrCreateForConfig(config_path_, in_info_.samplerate,
+                           in_info_.channels, &message);
+  if (processor_ != NULL && processor_->output_channels() != output_channels_) {
+    // The header is already out; too late to change our mind.
+    syslog(LOG_ERR, "Filter %s changed number of outputs while '%s' was open",
+           config_path_.c_str(), base_stats_.filename.c_str());
+    message = "Filter configuration changed; re-open file.";
+    fs_->processor_pool()->Return(processor_);
+    processor_ = NULL;
+  }
+  if (processor_ == NULL) {
+    SetMessage(message);
+    error_ = true;
+    return false;
   }
   return true;
 }
@@ -370,66 +723,155 @@ static bool ExtractDirAndSuffix(const std::string &filename,
 bool ConvolveFileHandler::AddMoreSoundData() {
   if (!input_frames_left_)
     return false;
+  if (!AcquireProcessor()) {
+    SetFramesLeft(0);
+    Close();
+    return false;
+  }
   if (processor_->pending_writes() > 0) {
-    processor_->WriteProcessed(snd_out_, processor_->pending_writes());
+    WriteOutput(processor_->pending_writes());
+    PublishMaxOutput();
     return input_frames_left_;
   }
-  const int r = processor_->FillBuffer(snd_in_);
+  const int r = processor_->FillBuffer(input_);
   if (r == 0) {
     syslog(LOG_ERR, "Expected %d frames left, "
            "but got EOF; corrupt file '%s' ?",
            input_frames_left_, base_stats_.filename.c_str());
-    base_stats_.message = "Premature EOF in input file.";
-    input_frames_left_ = 0;
+    SetMessage("Premature EOF in input file.");
+    SetFramesLeft(0);
     Close();
     return false;
   }
-  stats_mutex_.Lock();
-  input_frames_left_ -= r;
-  stats_mutex_.Unlock();
+  SetFramesLeft(input_frames_left_ - r);
+  // Prepare the next file early, so that the handover at the end of the
+  // file doesn't need to wait for opening it.
+  if (!next_file_requested_ && fs_->gapless_processing() && !sparse_
+      && input_frames_left_ <= in_info_.frames * (1 - kLookAheadFraction)) {
+    fs_->PrepareNextFile(base_stats_.filename);
+    next_file_requested_ = true;
+  }
+  // If we skipped parts of this file, we need to hold on to our processor
+  // to fill them later; so no gapless passing on in that case.
   if (!input_frames_left_ && !processor_->is_input_buffer_complete()
-      && fs_->gapless_processing()) {
-    typedef std::set<std::string> DirSet;
-    DirSet dirset;
-    std::string fs_dir, file_suffix;
-    FileHandler *next_file = NULL;
-    DirSet::const_iterator found;
+      && fs_->gapless_processing() && !sparse_) {
+    std::string next_path;
+    FileHandler *next_file = fs_->TakeNextFile(base_stats_.filename,
+                                               &next_path);
+    next_file_requested_ = false;  // Taken; nothing to forget.
     const bool passed_processor
-      = (ExtractDirAndSuffix(base_stats_.filename, &fs_dir, &file_suffix)
-         && fs_->ListDirectory(fs_dir, file_suffix, &dirset)
-         && (found = dirset.upper_bound(base_stats_.filename)) != dirset.end()
-         && (next_file = fs_->GetOrCreateHandler(found->c_str()))
-         && next_file->PassoverProcessor(processor_));
+      = (next_file && next_file->PassoverProcessor(processor_));
     if (passed_processor) {
       DLogf("Processor %p: Gapless pass-on from "
             "'%s' to alphabetically next '%s'", processor_,
-            base_stats_.filename.c_str(), found->c_str());
+            base_stats_.filename.c_str(), next_path.c_str());
     }
     processor_->WriteProcessed(snd_out_, r);
     if (passed_processor) {
+      stats_mutex_.Lock();
       base_stats_.out_gapless = true;
+      stats_mutex_.Unlock();
       SaveOutputValues();
       processor_ = NULL;   // we handed over ownership.
       Close();  // make sure that our thread is done.
       next_file->NotifyPassedProcessorUnreferenced();
     }
-    if (next_file) fs_->Close(found->c_str(), next_file);
+    if (next_file) fs_->Close(next_path.c_str(), next_file);
   } else {
-    processor_->WriteProcessed(snd_out_, r);
+    WriteOutput(r);
+    PublishMaxOutput();
   }
-  if (input_frames_left_ == 0) {
+  // After skipping ahead, we're only complete once the gaps are filled as
+  // well; the last of them might just have been.
+  if (input_frames_left_ == 0
+      && (!sparse_ || output_buffer_->IsContiguous())) {
+    conversion_complete_ = true;
     Close();
   }
   return input_frames_left_;
 }
 
+void ConvolveFileHandler::WriteOutput(int frames) {
+  off_t converted_end = 0;
+  const off_t position = output_buffer_->WritePosition();  // Nothing staged.
+  const off_t converted_start = sparse_
+    ? output_buffer_->NextConvertedRegion(position, &converted_end) : -1;
+  const sf_count_t room = (converted_start < 0)
+    ? frames : (converted_start - position) / output_frame_bytes_;
+  if (room >= frames) {
+    processor_->WriteProcessed(snd_out_, frames);
+    return;
+  }
+  if (room > 0) processor_->WriteProcessed(snd_out_, room);
+  const off_t data_end = output_buffer_->HeaderSize()
+    + (off_t) in_info_.frames * output_frame_bytes_;
+  if (converted_end >= data_end) {
+    // Converted up to the end already; the gap is closed.
+    processor_->WriteProcessed(NULL, frames - room);
+    output_buffer_->Reposition(converted_end);
+    SetFramesLeft(0);
+  } else if (!SeekOutput(converted_end)) {
+    // Can't skip; convert it once more.
+    processor_->WriteProcessed(snd_out_, frames - room);
+  }
+}
+
+bool ConvolveFileHandler::SeekOutput(off_t offset) {
+  if (output_frame_bytes_ == 0 || snd_out_ == NULL || !AcquireProcessor())
+    return false;
+  const off_t data_start = output_buffer_->HeaderSize();
+  if (offset < data_start)
+    return false;
+  const sf_count_t frame = (offset - data_start) / output_frame_bytes_;
+  if (frame >= in_info_.frames)
+    return false;
+
+  // The output only depends on the last filter_length() input frames. So
+  // start convolving that much earlier and throw away the result; after that
+  // we're in sync with what a sequential conversion would've created.
+  const sf_count_t start = std::max((sf_count_t) 0,
+                                    frame - processor_->filter_length());
+  if (!input_->Seek(start)) {
+    DLogf("File %s: input not seekable; converting sequentially.",
+          base_stats_.filename.c_str());
+    output_frame_bytes_ = 0;  // Don't try again.
+    return false;
+  }
+  DLogf("File %s: skip to frame %lld (preroll %lld)",
+        base_stats_.filename.c_str(), (long long) frame,
+        (long long) (frame - start));
+  processor_->Reset();
+  output_buffer_->Reposition(data_start + frame * output_frame_bytes_);
+  sparse_ = true;
+  SetFramesLeft(in_info_.frames - start);
+
+  sf_count_t preroll = frame - start;
+  while (preroll > 0) {
+    const int r = processor_->FillBuffer(input_);
+    if (r == 0) {
+      SetFramesLeft(0);  // Premature EOF; AddMoreSoundData() reports.
+      break;
+    }
+    SetFramesLeft(input_frames_left_ - r);
+    const int discard = std::min((sf_count_t) r, preroll);
+    processor_->WriteProcessed(NULL, discard);
+    preroll -= discard;
+    if (discard < r) {
+      WriteOutput(r - discard);
+    }
+  }
+  return true;
+}
+
 // TODO add as a utility function to ConversionBuffer ?
 static void CopyBytes(int fd, off_t pos, ConversionBuffer *out, size_t len) {
-  char buf[256];
+  // Metadata blocks can be large (cover art), so copy in big pieces.
+  static const size_t kMaxCopyChunk = 256 << 10;
+  std::vector<char> buf(std::min(len, kMaxCopyChunk));
   while (len > 0) {
-    ssize_t r = pread(fd, buf, std::min(sizeof(buf), len), pos);
+    ssize_t r = pread(fd, &buf[0], std::min(buf.size(), len), pos);
     if (r <= 0) return;
-    out->Append(buf, r);
+    out->Append(&buf[0], r);
     len -= r;
     pos += r;
   }
@@ -453,7 +895,8 @@ void ConvolveFileHandler::CopyFlacHeader(ConversionBuffer *out_buffer) {
       out_buffer->Append(&header, sizeof(header));
       // Copy everything but the MD5 at the end - which we set to empty.
       CopyBytes(filedes_, pos, out_buffer, byte_len - 16);
-      for (int i = 0; i < 16; ++i) out_buffer->Append("\0", 1);
+      static const char kEmptyMD5[16] = {0};
+      out_buffer->Append(kEmptyMD5, sizeof(kEmptyMD5));
       extra_info = "Streaminfo; redact MD5.";
     }
     else if (type == FLAC__METADATA_TYPE_SEEKTABLE) {
@@ -481,6 +924,48 @@ void ConvolveFileHandler::CopyFlacHeader(ConversionBuffer *out_buffer) {
   }
 }
 
+void ConvolveFileHandler::SetCompressionLevel(SNDFILE *out,
+                                              const SF_INFO &info) {
+  const int level = fs_->flac_compression_level();
+  if (level < 0 || (info.format & SF_FORMAT_TYPEMASK) != SF_FORMAT_FLAC)
+    return;
+  // libsndfile maps 0.0 .. 1.0 to the FLAC levels 0 .. 8.
+  double compression = level / 8.0;
+  if (!sf_command(out, SFC_SET_COMPRESSION_LEVEL,
+                  &compression, sizeof(compression))) {
+    DLogf("File %s: can't set compression level %d",
+          base_stats_.filename.c_str(), level);
+  }
+}
+
+static void AppendLE(ConversionBuffer *out, uint32_t value, int bytes) {
+  for (int i = 0; i < bytes; ++i) {
+    const char c = (value >> (8 * i)) & 0xFF;
+    out->Append(&c, 1);
+  }
+}
+
+void ConvolveFileHandler::CreateWavHeader(ConversionBuffer *out_buffer,
+                                          const SF_INFO &info) {
+  // libsndfile can't know the data length up front while writing a stream,
+  // but we do; so write a canonical header with the final sizes ourselves.
+  const int frame_bytes = PcmFrameBytes(info);
+  const off_t data_size = (off_t) in_info_.frames * frame_bytes;
+  const uint32_t data_len = std::min(data_size, (off_t) 0xFFFFFFF0);
+  out_buffer->Append("RIFF", 4);
+  AppendLE(out_buffer, data_len + (data_len % 2) + 36, 4);
+  out_buffer->Append("WAVEfmt ", 8);
+  AppendLE(out_buffer, 16, 4);                          // fmt chunk size
+  AppendLE(out_buffer, 1, 2);                           // PCM
+  AppendLE(out_buffer, info.channels, 2);
+  AppendLE(out_buffer, info.samplerate, 4);
+  AppendLE(out_buffer, info.samplerate * frame_bytes, 4);
+  AppendLE(out_buffer, frame_bytes, 2);
+  AppendLE(out_buffer, 8 * frame_bytes / info.channels, 2);
+  out_buffer->Append("data", 4);
+  AppendLE(out_buffer, data_len, 4);
+}
+
 void ConvolveFileHandler::GenerateHeaderFromInputFile(
              ConversionBuffer *out_buffer) {
   DLogf("Generate header from original ID3-tags.");
@@ -496,31 +981,66 @@ void ConvolveFileHandler::GenerateHeaderFromInputFile(
 
 void ConvolveFileHandler::SaveOutputValues() {
   if (processor_) {
-    base_stats_.max_output_value = processor_->max_output_value();
+    PublishMaxOutput();
     processor_->ResetMaxValues();
   }
 }
 
+void ConvolveFileHandler::PublishMaxOutput() {
+  const float value = processor_->max_output_value();
+  __atomic_store(&max_output_value_, &value, __ATOMIC_RELAXED);
+}
+
+float ConvolveFileHandler::max_output_value() const {
+  float value;
+  __atomic_load(&max_output_value_, &value, __ATOMIC_RELAXED);
+  return value;
+}
+
+void ConvolveFileHandler::SetMessage(const std::string &message) {
+  folve::MutexLock l(&stats_mutex_);
+  base_stats_.message = message;
+}
+
+void ConvolveFileHandler::SetFramesLeft(int frames) {
+  // Only the producer writes, but Stat() and the status read concurrently.
+  __atomic_store_n(&input_frames_left_, frames, __ATOMIC_RELAXED);
+}
+
 void ConvolveFileHandler::Close() {
   if (snd_out_ == NULL) return;  // done.
-  input_frames_left_ = 0;
+  SetFramesLeft(0);
   SaveOutputValues();
-  if (base_stats_.max_output_value > 1.0) {
+  const float max_output = max_output_value();
+  if (max_output > 1.0) {
     syslog(LOG_ERR, "Observed output clipping in '%s': "
            "Max=%.3f; Multiply gain with <= %.5f in %s",
-           base_stats_.filename.c_str(), base_stats_.max_output_value,
-           1.0 / base_stats_.max_output_value,
-           processor_ != NULL ? processor_->config_file().c_str() : "filter");
+           base_stats_.filename.c_str(), max_output, 1.0 / max_output,
+           config_path_.c_str());
   }
   fs_->processor_pool()->Return(processor_);
   processor_ = NULL;
   // We can't disable buffer writes here, because outfile closing will flush
   // the last couple of sound samples.
+  delete input_;
+  input_ = NULL;
   if (snd_in_) sf_close(snd_in_);
+  delete input_file_;
+  input_file_ = NULL;
   if (snd_out_) sf_close(snd_out_);
   snd_out_ = NULL;
   close(filedes_);
 
+  if (predicted_size_ > 0) {
+    if (output_buffer_->FileSize() > predicted_size_) {
+      syslog(LOG_WARNING, "File larger than prediction: %lld < %lld '%s'; "
+             "naive streamer implementations might trip",
+             (long long)predicted_size_,
+             (long long)output_buffer_->FileSize(),
+             base_stats_.filename.c_str());
+    }
+    return;
+  }
   const double factor = 1.0 * output_buffer_->FileSize() / original_file_size_;
   if (factor > fs_->file_oversize_factor()) {
     syslog(LOG_WARNING, "File larger than prediction: "
@@ -546,7 +1066,6 @@ bool ConvolveFileHandler::LooksLikeInputIsFlac(const SF_INFO &sndinfo,
   return memcmp(flac_magic, "fLaC", sizeof(flac_magic)) == 0;
 }
 
-int ConvolveFileHandler::frames_left() {
-  folve::MutexLock l(&stats_mutex_);
-  return input_frames_left_;
+int ConvolveFileHandler::frames_left() const {
+  return __atomic_load_n(&input_frames_left_, __ATOMIC_RELAXED);
 }
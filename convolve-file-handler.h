@@ -24,6 +24,8 @@
 
 #include "file-handler.h"
 #include "conversion-buffer.h"
+#include "read-ahead-file.h"
+#include "shared-decoder.h"
 
 class FolveFilesystem;
 
@@ -46,7 +48,10 @@ public:
 
   // -- FileHandler interface
   virtual int Read(char *buf, size_t size, off_t offset);
+  virtual bool GetFileRegion(size_t size, off_t offset,
+                             int *fd, off_t *fd_offset, size_t *available);
   virtual void GetHandlerStatus(HandlerStats *stats);
+  virtual off_t BufferBytes();
   virtual int Stat(struct stat *st);
   virtual bool PassoverProcessor(SoundProcessor *passover_processor);
   virtual void NotifyPassedProcessorUnreferenced();
@@ -56,51 +61,112 @@ public:
                                   const SF_INFO &info,
                                   SNDFILE *sndfile);
   virtual bool AddMoreSoundData();
+  virtual bool SeekOutput(off_t offset);
 
 private:
   ConvolveFileHandler(FolveFilesystem *fs, const char *fs_path,
                       const std::string &filter_dir,
                       const std::string &underlying_file,
-                      int filedes, SNDFILE *snd_in,
+                      int filedes, ReadAheadFile *input_file,
+                      SNDFILE *snd_in,
                       const SF_INFO &in_info, const HandlerStats &file_info,
-                      SoundProcessor *processor);
+                      const std::string &config_path, int output_channels);
 
   bool HasStarted();
 
+  // Get our processor from the pool if we don't have one yet. Returns
+  // 'false' and sets error_ if that is not possible.
+  bool AcquireProcessor();
+
+  // A read suspiciously close to the end of the file while we're not there
+  // yet; just answered with zeros.
+  bool IsSkipToEnd(size_t size, off_t offset, off_t current_filesize) const;
+
+  // Start pre-buffering if the client reads the sound stream.
+  void RequestPrebufferIfNeeded(off_t read_horizon, off_t write_position);
+
   // Generate Header in case this is a FLAC file.
   void CopyFlacHeader(ConversionBuffer *out_buffer);
 
   // Generate Header from the generic tags.
   void GenerateHeaderFromInputFile(ConversionBuffer *out_buffer);
 
+  // With uncompressed output, we write the WAV header with the final sizes
+  // ourselves instead of libsndfile.
+  void CreateWavHeader(ConversionBuffer *out_buffer, const SF_INFO &info);
+
+  // Apply the configured FLAC compression level to "out".
+  void SetCompressionLevel(SNDFILE *out, const SF_INFO &info);
+
   void SaveOutputValues();
 
+  // Set the initial file size reported in Stat(). Exact for PCM output;
+  // compressed output is estimated on the first Stat() if requested,
+  // otherwise it is the original size times the oversize factor.
+  void PredictOutputSize(const SF_INFO &out_info);
+  void EstimateOutputSize();
+
+  // Estimate the compressed bytes per output frame by encoding a couple of
+  // short windows of the input; the densest one counts. Returns 0.0 if that
+  // was not possible.
+  double EstimateBytesPerFrame(const SF_INFO &out_info);
+
   // Close all sound files and flush data.
   void Close();
 
+  // Write "frames" processed frames to the output. While filling a gap left
+  // by SeekOutput(), stops where the next converted region starts and
+  // continues after it: that is converted already, and readers might have
+  // seen it.
+  void WriteOutput(int frames);
+
   bool LooksLikeInputIsFlac(const SF_INFO &sndinfo, int filedes);
-  int frames_left();
+
+  // Status published by the producer; see stats_mutex_.
+  int frames_left() const;
+  void SetFramesLeft(int frames);
+  float max_output_value() const;
+  void PublishMaxOutput();
+  void SetMessage(const std::string &message);
 
   FolveFilesystem *const fs_;
   const int filedes_;
+  ReadAheadFile *input_file_;     // Owned; snd_in_ reads through it.
   SNDFILE *const snd_in_;
+  SharedDecoder::Reader *input_;  // Reads from snd_in_ or shared decoding.
   const SF_INFO in_info_;
 
+  // The status server reads our state while we convert. Counters are
+  // published with atomic stores, so that the conversion never waits for
+  // it; the rarely changing rest of base_stats_ is protected by this mutex.
   folve::Mutex stats_mutex_;
   HandlerStats base_stats_;      // UI information about current file.
 
   struct stat file_stat_;        // we dynamically report a changing size.
   off_t original_file_size_;
   off_t start_estimating_size_;  // essentially const.
+  off_t predicted_size_;         // 0 if we only have the oversize factor.
+  bool size_exact_;              // We know the final size up front.
+  bool estimate_pending_;        // Atomic; estimate on next Stat().
+  SF_INFO out_info_;             // For the estimate.
 
   bool error_;
+  bool conversion_complete_;     // Processed all input without problems.
+  bool sparse_;                  // Skipped over parts with SeekOutput().
+  bool next_file_requested_;     // Asked fs to prepare the next file.
+  int output_frame_bytes_;       // Bytes per output frame; 0 if not seekable.
   bool copy_flac_header_verbatim_;
   ConversionBuffer *output_buffer_;
   SNDFILE *snd_out_;
 
   // Used in conversion.
-  SoundProcessor *processor_;
-  int input_frames_left_;
+  const std::string config_path_;
+  const int output_channels_;    // As announced in the header.
+  SoundProcessor *processor_;    // Acquired when reading sound data.
+  int input_frames_left_;        // Only written with SetFramesLeft().
+  float max_output_value_;       // Atomic; see PublishMaxOutput().
+
+  std::string render_cache_key_;  // Key to store result in render cache.
 };
 
 #endif  // FOLVE_CONVOLVE_FILE_HANDLER_H_
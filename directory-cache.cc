@@ -0,0 +1,193 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "directory-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+// Don't look at the directory modification time more often than this.
+static const double kRecheckSeconds = 1.0;
+
+struct DirectoryCache::Directory {
+  struct StatResult {
+    int error;             // errno; 0 if successful.
+    struct stat st;
+  };
+  typedef std::map<std::string, StatResult> StatMap;
+
+  struct timespec mtime;
+  bool recently_modified;  // Might not see changes by looking at mtime.
+  double last_checked;
+  double last_used;
+  std::vector<Entry> entries;
+  StatMap stats;           // Since last_checked.
+};
+
+static bool SameTime(const struct timespec &a, const struct timespec &b) {
+  return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool CompareName(const DirectoryCache::Entry &a,
+                        const DirectoryCache::Entry &b) {
+  return a.name < b.name;
+}
+
+DirectoryCache::DirectoryCache(size_t max_directories)
+  : max_directories_(max_directories) {
+}
+
+DirectoryCache::~DirectoryCache() {
+  for (DirectoryMap::iterator it = directories_.begin();
+       it != directories_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+DirectoryCache::Directory *DirectoryCache::ReadDirectory(
+     const std::string &dir) {
+  const double now = folve::CurrentTime();
+  struct stat dir_stat;
+  if (stat(dir.c_str(), &dir_stat) != 0)
+    return NULL;
+  DIR *dp = opendir(dir.c_str());
+  if (dp == NULL)
+    return NULL;
+  Directory *result = new Directory();
+  result->mtime = dir_stat.st_mtim;
+  // Changes within the timestamp resolution would go unnoticed.
+  result->recently_modified = (dir_stat.st_mtime >= (time_t) now - 1);
+  result->last_checked = now;
+  result->last_used = now;
+  struct dirent *dent;
+  while ((dent = readdir(dp)) != NULL) {
+    Entry entry;
+    entry.name = dent->d_name;
+    entry.inode = dent->d_ino;
+    entry.type = dent->d_type;
+    result->entries.push_back(entry);
+  }
+  closedir(dp);
+  std::sort(result->entries.begin(), result->entries.end(), CompareName);
+  return result;
+}
+
+DirectoryCache::Directory *DirectoryCache::GetDirectory_Locked(
+     const std::string &dir) {
+  const double now = folve::CurrentTime();
+  DirectoryMap::iterator found = directories_.find(dir);
+  if (found != directories_.end()) {
+    Directory *d = found->second;
+    if (now - d->last_checked < kRecheckSeconds) {
+      d->last_used = now;
+      return d;
+    }
+    struct stat dir_stat;
+    if (!d->recently_modified && stat(dir.c_str(), &dir_stat) == 0
+        && SameTime(dir_stat.st_mtim, d->mtime)) {
+      d->last_checked = now;
+      d->last_used = now;
+      d->stats.clear();  // Files might've changed in-place.
+      return d;
+    }
+    delete d;
+    directories_.erase(found);
+  }
+  // Not there or outdated. While reading, other threads shouldn't be
+  // blocked.
+  mutex_.Unlock();
+  Directory *d = ReadDirectory(dir);
+  const int read_errno = errno;
+  mutex_.Lock();
+  if (d == NULL) {
+    errno = read_errno;
+    return NULL;
+  }
+  Directory *&slot = directories_[dir];
+  delete slot;  // Someone else might've read it in the meantime.
+  slot = d;
+  Evict_Locked();
+  return d;
+}
+
+void DirectoryCache::Evict_Locked() {
+  while (directories_.size() > max_directories_) {
+    DirectoryMap::iterator oldest = directories_.begin();
+    for (DirectoryMap::iterator it = directories_.begin();
+         it != directories_.end(); ++it) {
+      if (it->second->last_used < oldest->second->last_used) oldest = it;
+    }
+    delete oldest->second;
+    directories_.erase(oldest);
+  }
+}
+
+bool DirectoryCache::GetEntries(const std::string &dir,
+                                std::vector<Entry> *entries) {
+  // Same key as Lstat() uses for the directory of its files.
+  std::string::size_type end = dir.find_last_not_of('/');
+  const std::string key = (end == std::string::npos)
+    ? dir : dir.substr(0, end + 1);
+  folve::MutexLock l(&mutex_);
+  Directory *d = GetDirectory_Locked(key);
+  if (d == NULL)
+    return false;
+  *entries = d->entries;
+  return true;
+}
+
+int DirectoryCache::Lstat(const std::string &path, struct stat *st) {
+  const std::string::size_type slash_pos = path.find_last_of('/');
+  if (slash_pos == std::string::npos || slash_pos + 1 == path.length())
+    return lstat(path.c_str(), st);
+  const std::string dir = path.substr(0, slash_pos);
+  const std::string name = path.substr(slash_pos + 1);
+  {
+    folve::MutexLock l(&mutex_);
+    DirectoryMap::iterator found = directories_.find(dir);
+    // Only if we know the directory already; it is typically listed before
+    // its files are looked at.
+    if (found == directories_.end())
+      return lstat(path.c_str(), st);
+    Directory *d = GetDirectory_Locked(dir);
+    if (d != NULL) {
+      Directory::StatMap::const_iterator cached = d->stats.find(name);
+      if (cached != d->stats.end()) {
+        *st = cached->second.st;
+        errno = cached->second.error;
+        return cached->second.error == 0 ? 0 : -1;
+      }
+    }
+  }
+  Directory::StatResult result;
+  result.error = (lstat(path.c_str(), &result.st) == 0) ? 0 : errno;
+  *st = result.st;
+  {
+    folve::MutexLock l(&mutex_);
+    DirectoryMap::iterator found = directories_.find(dir);
+    if (found != directories_.end()) {
+      found->second->stats[name] = result;
+    }
+  }
+  errno = result.error;
+  return result.error == 0 ? 0 : -1;
+}
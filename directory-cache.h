@@ -0,0 +1,75 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_DIRECTORY_CACHE_H
+#define FOLVE_DIRECTORY_CACHE_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+// Cache of directory listings and lstat() results of the underlying
+// filesystem.
+//
+// Media servers indexing large libraries list directories and stat files
+// in tight loops, and gapless processing looks up the next file in the
+// directory for every track. Listings are kept as long as the modification
+// time of the directory stays the same, which we check at most once per
+// second; lstat() results are kept for at most that long.
+// This class is thread-safe.
+class DirectoryCache {
+public:
+  struct Entry {
+    std::string name;
+    ino_t inode;
+    unsigned char type;    // DT_* value as in struct dirent.
+  };
+
+  // Keep at most "max_directories" directories.
+  explicit DirectoryCache(size_t max_directories);
+  ~DirectoryCache();
+
+  // Get the entries of "dir", sorted by name. Returns 'false' and sets errno
+  // if the directory can't be read.
+  bool GetEntries(const std::string &dir, std::vector<Entry> *entries);
+
+  // Like lstat(), but possibly from the cache. Returns 0 on success,
+  // otherwise -1 and sets errno.
+  int Lstat(const std::string &path, struct stat *st);
+
+private:
+  struct Directory;
+  typedef std::map<std::string, Directory*> DirectoryMap;
+
+  // Get directory, loading or re-validating it if needed. NULL if it can't
+  // be read (errno set).
+  Directory *GetDirectory_Locked(const std::string &dir);
+  static Directory *ReadDirectory(const std::string &dir);
+  void Evict_Locked();
+
+  const size_t max_directories_;
+  folve::Mutex mutex_;
+  DirectoryMap directories_;
+};
+
+#endif  // FOLVE_DIRECTORY_CACHE_H
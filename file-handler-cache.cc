@@ -20,40 +20,107 @@
 
 #include <map>
 #include <vector>
-#include <algorithm>
 
 #include "file-handler.h"
 #include "file-handler-cache.h"
 #include "util.h"
 
 struct FileHandlerCache::Entry {
-  Entry(FileHandler *h) : handler(h), references(0), last_access(0) {}
+  Entry(const std::string &k, Shard *s, FileHandler *h)
+    : key(k), shard(s), handler(h), references(0), last_access(0), bytes(0),
+      lru_prev(NULL), lru_next(NULL), idle(false) {}
+  const std::string key;
+  Shard *const shard;
   FileHandler *const handler;
   int references;
   double last_access;  // seconds since epoch, sub-second resolution.
+  off_t bytes;         // Last known buffer size; accounted in total_bytes_.
+
+  // In the idle list of the cache; protected by lru_mutex_.
+  Entry *lru_prev;
+  Entry *lru_next;
+  bool idle;
 };
 
+FileHandlerCache::FileHandlerCache(size_t max_handlers, off_t max_bytes)
+  : max_handlers_(max_handlers), max_bytes_(max_bytes), observer_(NULL),
+    lru_head_(NULL), lru_tail_(NULL), total_handlers_(0), total_bytes_(0) {
+}
+
+FileHandlerCache::~FileHandlerCache() {
+  for (int i = 0; i < kShards; ++i) {
+    CacheMap &map = shards_[i].map;
+    for (CacheMap::iterator it = map.begin(); it != map.end(); ++it) {
+      delete it->second->handler;
+      delete it->second;
+    }
+  }
+}
+
+FileHandlerCache::Shard *FileHandlerCache::ShardFor(const std::string &key) {
+  uint32_t hash = 2166136261u;  // FNV-1a
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+    hash = (hash ^ (unsigned char) *it) * 16777619u;
+  }
+  return &shards_[hash % kShards];
+}
+
+void FileHandlerCache::UpdateBytes_Locked(Entry *entry) {
+  const off_t bytes = entry->handler->BufferBytes();
+  folve::MutexLock l(&lru_mutex_);
+  total_bytes_ += bytes - entry->bytes;
+  entry->bytes = bytes;
+}
+
+void FileHandlerCache::MakeIdle_Locked(Entry *entry) {
+  folve::MutexLock l(&lru_mutex_);
+  assert(!entry->idle);
+  entry->idle = true;
+  entry->lru_prev = lru_tail_;
+  entry->lru_next = NULL;
+  if (lru_tail_) lru_tail_->lru_next = entry; else lru_head_ = entry;
+  lru_tail_ = entry;
+}
+
+void FileHandlerCache::MakeBusy_Locked(Entry *entry) {
+  folve::MutexLock l(&lru_mutex_);
+  if (!entry->idle)
+    return;  // Not in the list, e.g. just taken out by EvictIdle().
+  entry->idle = false;
+  if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+  else lru_head_ = entry->lru_next;
+  if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+  else lru_tail_ = entry->lru_prev;
+  entry->lru_prev = entry->lru_next = NULL;
+}
+
 FileHandler *FileHandlerCache::InsertPinned(const std::string &key,
                                             FileHandler *handler) {
   std::vector<FileHandler *> to_delete;
   FileHandler *result = NULL;
+  Shard *const shard = ShardFor(key);
   {
-    folve::MutexLock l(&mutex_);
+    folve::MutexLock l(&shard->mutex);
     CacheMap::iterator ins
-      = cache_.insert(std::make_pair(key, (Entry*)NULL)).first;
-    if (ins->second == NULL) {
-      ins->second = new Entry(handler);
+      = shard->map.insert(std::make_pair(key, (Entry*)NULL)).first;
+    Entry *entry = ins->second;
+    if (entry == NULL) {
+      entry = ins->second = new Entry(key, shard, handler);
+      {
+        folve::MutexLock ll(&lru_mutex_);
+        ++total_handlers_;
+      }
+      UpdateBytes_Locked(entry);
     } else {
-      delete handler;
+      to_delete.push_back(handler);
+      if (entry->references == 0) MakeBusy_Locked(entry);
     }
-    ++ins->second->references;
-    if (cache_.size() > max_size_) {
-      CleanupOldestUnreferenced_Locked(&to_delete);
-    }
-    ins->second->last_access = folve::CurrentTime();
-    if (observer_) observer_->InsertHandlerEvent(ins->second->handler);
-    result = ins->second->handler;
+    ++entry->references;
+    entry->last_access = folve::CurrentTime();
+    if (observer_) observer_->InsertHandlerEvent(entry->handler);
+    result = entry->handler;
   }
+  EvictIdle(&to_delete);
   // Items that are to be deleted need to be deleted ouside of the lock,
   // otherwise there is a chance of a deadlock in the gapless case.
   // t1: open new file -> need to retire old file
@@ -71,28 +138,37 @@ FileHandler *FileHandlerCache::InsertPinned(const std::string &key,
 }
 
 FileHandler *FileHandlerCache::FindAndPin(const std::string &key) {
-  folve::MutexLock l(&mutex_);
-  CacheMap::iterator found = cache_.find(key);
-  if (found == cache_.end())
+  Shard *const shard = ShardFor(key);
+  folve::MutexLock l(&shard->mutex);
+  CacheMap::iterator found = shard->map.find(key);
+  if (found == shard->map.end())
     return NULL;
-  ++found->second->references;
-  found->second->last_access = folve::CurrentTime();
-  return found->second->handler;
+  Entry *entry = found->second;
+  if (entry->references == 0) MakeBusy_Locked(entry);
+  ++entry->references;
+  entry->last_access = folve::CurrentTime();
+  return entry->handler;
 }
 
 void FileHandlerCache::Unpin(const std::string &key) {
-  FileHandler *to_delete = NULL;
+  std::vector<FileHandler *> to_delete;
+  Shard *const shard = ShardFor(key);
   {
-    folve::MutexLock l(&mutex_);
-    CacheMap::iterator found = cache_.find(key);
-    assert(found != cache_.end());
-    --found->second->references;
-    // If we are already beyond cache size, clean up as soon as we get idle.
-    if (found->second->references == 0 && cache_.size() > max_size_) {
-      to_delete = Erase_Locked(found);
+    folve::MutexLock l(&shard->mutex);
+    CacheMap::iterator found = shard->map.find(key);
+    assert(found != shard->map.end());
+    Entry *entry = found->second;
+    --entry->references;
+    if (entry->references == 0) {
+      UpdateBytes_Locked(entry);  // Doesn't change much while idle.
+      MakeIdle_Locked(entry);
     }
   }
-  delete to_delete;
+  // If we are already beyond our limits, clean up as soon as we get idle.
+  EvictIdle(&to_delete);
+  for (size_t i = 0; i < to_delete.size(); ++i) {
+    delete to_delete[i];
+  }
 }
 
 void FileHandlerCache::SetObserver(Observer *observer) {
@@ -102,48 +178,67 @@ void FileHandlerCache::SetObserver(Observer *observer) {
 
 void FileHandlerCache::GetStats(std::vector<HandlerStats> *stats) {
   HandlerStats s;
-  folve::MutexLock l(&mutex_);
-  for (CacheMap::iterator it = cache_.begin(); it != cache_.end(); ++it) {
-    it->second->handler->GetHandlerStatus(&s);
-    s.status = ((it->second->references == 0)
-                ? HandlerStats::IDLE
-                : HandlerStats::OPEN);
-    s.last_access = it->second->last_access;
-    stats->push_back(s);
+  for (int i = 0; i < kShards; ++i) {
+    folve::MutexLock l(&shards_[i].mutex);
+    const CacheMap &map = shards_[i].map;
+    for (CacheMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+      it->second->handler->GetHandlerStatus(&s);
+      s.status = ((it->second->references == 0)
+                  ? HandlerStats::IDLE
+                  : HandlerStats::OPEN);
+      s.last_access = it->second->last_access;
+      stats->push_back(s);
+    }
   }
 }
 
-FileHandler *FileHandlerCache::Erase_Locked(CacheMap::iterator &cache_it) {
-  if (observer_) observer_->RetireHandlerEvent(cache_it->second->handler);
-  FileHandler *result = cache_it->second->handler;  // don't delete in mutex.
-  delete cache_it->second;           // Entry
-  cache_.erase(cache_it);
-  return result;
+void FileHandlerCache::EvictAllIdle() {
+  std::vector<FileHandler *> to_delete;
+  EvictIdle(&to_delete, true);
+  for (size_t i = 0; i < to_delete.size(); ++i) {
+    delete to_delete[i];
+  }
 }
 
-struct FileHandlerCache::CompareAge {
-  bool operator() (const CacheMap::iterator &a, const CacheMap::iterator &b) {
-    return a->second->last_access < b->second->last_access;
-  }
-};
-void FileHandlerCache::CleanupOldestUnreferenced_Locked(
-         std::vector<FileHandler*> *to_delete) {
-  assert(cache_.size() > max_size_);  // otherwise we shouldn't have been called
-  // While this iterating through the whole cache might look expensive,
-  // in practice we're talking about 3 elements here.
-  // If we had significantly more, e.g. broken clients that don't close files,
-  // we need to keep better track of age.
-  std::vector<CacheMap::iterator> for_removal;
-  for (CacheMap::iterator it = cache_.begin(); it != cache_.end(); ++it) {
-    if (it->second->references == 0) for_removal.push_back(it);
+FileHandler *FileHandlerCache::Erase_Locked(Shard *shard,
+                                            CacheMap::iterator cache_it) {
+  Entry *entry = cache_it->second;
+  if (observer_) observer_->RetireHandlerEvent(entry->handler);
+  MakeBusy_Locked(entry);  // Out of the idle list.
+  {
+    folve::MutexLock l(&lru_mutex_);
+    --total_handlers_;
+    total_bytes_ -= entry->bytes;
   }
+  FileHandler *result = entry->handler;  // don't delete in mutex.
+  delete entry;
+  shard->map.erase(cache_it);
+  return result;
+}
 
-  const size_t to_erase_count = std::min(cache_.size() - max_size_,
-                                         for_removal.size());
-  CompareAge comparator;
-  std::sort(for_removal.begin(), for_removal.end(), comparator);
-  for (size_t i = 0; i < to_erase_count; ++i) {
-    to_delete->push_back(Erase_Locked(for_removal[i]));
+void FileHandlerCache::EvictIdle(std::vector<FileHandler*> *to_delete,
+                                 bool all) {
+  for (;;) {
+    Entry *victim;
+    std::string key;
+    {
+      folve::MutexLock l(&lru_mutex_);
+      const bool over_limit = (all || total_handlers_ > max_handlers_
+                               || (max_bytes_ > 0
+                                   && total_bytes_ > max_bytes_));
+      if (!over_limit || lru_head_ == NULL)
+        return;
+      victim = lru_head_;
+      key = victim->key;
+    }
+    // We can only look at the victim again while holding its shard lock;
+    // it might've been pinned or evicted by someone else in the meantime.
+    Shard *const shard = ShardFor(key);
+    folve::MutexLock l(&shard->mutex);
+    CacheMap::iterator found = shard->map.find(key);
+    if (found != shard->map.end() && found->second == victim
+        && victim->references == 0) {
+      to_delete->push_back(Erase_Locked(shard, found));
+    }
   }
 }
-
@@ -36,7 +36,11 @@ class FileHandler;
 //
 // This Cache manages the lifecycle of a FileHandler object; the user creates
 // it, but this Cache handles deletion.
-// This container is thread-safe.
+// Handlers not referenced anymore are kept in least-recently-used order and
+// evicted once there are more than max_handlers or their conversion buffers
+// take more than max_bytes together.
+// This container is thread-safe; the keys are distributed over shards with
+// their own lock, so that opening different files doesn't contend.
 class FileHandlerCache {
 public:
   class Observer {
@@ -46,11 +50,18 @@ public:
     virtual void RetireHandlerEvent(FileHandler *handler) = 0;
   };
 
-  FileHandlerCache(int size) : max_size_(size), observer_(NULL) {}
+  FileHandlerCache(size_t max_handlers, off_t max_bytes);
+  ~FileHandlerCache();
 
   // Set an observer.
   void SetObserver(Observer *observer);
 
+  // Change limits. Only to be called before the cache is in use.
+  void set_max_handlers(size_t n) { max_handlers_ = n; }
+  void set_max_bytes(off_t bytes) { max_bytes_ = bytes; }
+  size_t max_handlers() const { return max_handlers_; }
+  off_t max_bytes() const { return max_bytes_; }
+
   // Insert a new object under the given key.
   // Ownership is handed over to this map.
   // If there was already an object stored under that key, the existing one
@@ -68,23 +79,51 @@ public:
   // Get a vector of the current status of handlers kept in this cache.
   void GetStats(std::vector<HandlerStats> *stats);
 
+  // Delete all handlers not in use right now, e.g. at the end of a batch
+  // conversion so that they end up in the render cache.
+  void EvictAllIdle();
+
  private:
+  static const int kShards = 16;
   struct Entry;
-  struct CompareAge;
   typedef std::map<std::string, Entry*> CacheMap;
+  struct Shard {
+    folve::Mutex mutex;
+    CacheMap map;
+  };
+
+  Shard *ShardFor(const std::string &key);
+
+  // Update the byte count of the entry from its handler. Called with
+  // the shard mutex held.
+  void UpdateBytes_Locked(Entry *entry);
 
-  // -- methods called while holding the mutex.
+  // Put entry at the recent end of the idle list or remove it from there.
+  // Called with the shard mutex held.
+  void MakeIdle_Locked(Entry *entry);
+  void MakeBusy_Locked(Entry *entry);
 
-  // Inform observer, delete FileFilter and erase element from cache.
-  FileHandler *Erase_Locked(CacheMap::iterator &cache_it);
+  // Inform observer, delete Entry and erase element from shard. Returns the
+  // handler that is to be deleted outside of any lock.
+  FileHandler *Erase_Locked(Shard *shard, CacheMap::iterator cache_it);
 
-  // Find oldes element and get rid of it.
-  void CleanupOldestUnreferenced_Locked(std::vector<FileHandler *> *to_delete);
+  // Evict least recently used idle handlers while we are above the limits
+  // (or all of them with "all" set).
+  // Must be called without holding any of our locks; the handlers are to be
+  // deleted by the caller.
+  void EvictIdle(std::vector<FileHandler *> *to_delete, bool all = false);
 
-  const size_t max_size_;
+  size_t max_handlers_;
+  off_t max_bytes_;
   Observer *observer_;
-  folve::Mutex mutex_;
-  CacheMap cache_;
+  Shard shards_[kShards];
+
+  // Lock order: shard mutex first, then lru_mutex_.
+  folve::Mutex lru_mutex_;   // Protects the following.
+  Entry *lru_head_;          // Idle entries; oldest first.
+  Entry *lru_tail_;
+  size_t total_handlers_;
+  off_t total_bytes_;
 };
 
 #endif  // FOLVE_FILE_HANDLER_CACHE_H
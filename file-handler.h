@@ -67,9 +67,21 @@ public:
   virtual int Read(char *buf, size_t size, off_t offset) = 0;
   virtual int Stat(struct stat *st) = 0;
 
+  // Zero-copy alternative to Read(): if the data at "offset" can be read
+  // from a file, returns 'true' and sets "fd" and "fd_offset" to where it
+  // is stored and "available" to the number of bytes (<= size) there.
+  // Returns 'false' if Read() has to be used instead.
+  virtual bool GetFileRegion(size_t size, off_t offset,
+                             int *fd, off_t *fd_offset, size_t *available) {
+    return false;
+  }
+
   // Get handler status.
   virtual void GetHandlerStatus(HandlerStats *s) = 0;
 
+  // Bytes this handler keeps in buffers; used to limit the handler cache.
+  virtual off_t BufferBytes() { return 0; }
+
   // Accept processor passed on from the previous file. Can return false
   // if this FileHandler cannot use it (e.g. it alrady started convolving).
   // The Receiver must not use this processor until
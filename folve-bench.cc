@@ -0,0 +1,340 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Benchmark of the convolving pipeline without FUSE. Synthetic input files
+// are read through a ConvolveFileHandler the same way the filesystem would
+// serve them; we measure how fast the output is produced.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "convolve-file-handler.h"
+#include "folve-filesystem.h"
+#include "sound-processor.h"
+#include "util.h"
+
+using folve::StringPrintf;
+using folve::CurrentTime;
+
+namespace {
+struct InputFormat {
+  const char *name;
+  int format;
+};
+
+// Input formats; the output format follows from what ConvolveFileHandler
+// chooses for them.
+const InputFormat kInputFormats[] = {
+  { "wav16",  SF_FORMAT_WAV  | SF_FORMAT_PCM_16 },
+  { "flac16", SF_FORMAT_FLAC | SF_FORMAT_PCM_16 },
+  { "flac24", SF_FORMAT_FLAC | SF_FORMAT_PCM_24 },
+};
+const int kInputFormatCount = sizeof(kInputFormats) / sizeof(kInputFormats[0]);
+
+const size_t kReadSize = 128 << 10;   // Typical large FUSE read.
+
+struct Result {
+  double setup_ms;        // Creating the processor from scratch.
+  double ttfab_ms;        // Open until first byte of audio data.
+  double total_s;         // Open until last byte read.
+  off_t output_bytes;
+  int filter_length;
+  int fragment;
+};
+
+std::vector<int> ParseIntList(const char *list) {
+  std::vector<int> result;
+  while (*list) {
+    char *end;
+    const long value = strtol(list, &end, 10);
+    if (end == list) break;
+    result.push_back(value);
+    list = (*end == ',') ? end + 1 : end;
+  }
+  return result;
+}
+
+// Sample rates for which there is a configuration in the given directory.
+std::set<int> AvailableRates(const std::string &dir) {
+  std::set<int> result;
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) return result;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    int rate;
+    if (folve::HasSuffix(entry->d_name, ".conf")
+        && sscanf(entry->d_name, "filter-%d", &rate) == 1) {
+      result.insert(rate);
+    }
+  }
+  closedir(d);
+  return result;
+}
+
+// Write a file with a few seconds of a sweep mixed with some noise, so
+// that the encoder has something realistic to chew on.
+bool CreateInputFile(const std::string &path, int format, int rate,
+                     int channels, int seconds) {
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.samplerate = rate;
+  info.channels = channels;
+  info.format = format;
+  SNDFILE *out = sf_open(path.c_str(), SFM_WRITE, &info);
+  if (out == NULL) {
+    fprintf(stderr, "%s: %s\n", path.c_str(), sf_strerror(NULL));
+    return false;
+  }
+  const int kBlock = 4096;
+  float *buffer = new float[kBlock * channels];
+  const long total = (long) rate * seconds;
+  double phase = 0;
+  unsigned int noise = 1;
+  for (long pos = 0; pos < total; pos += kBlock) {
+    const int frames = std::min((long) kBlock, total - pos);
+    for (int i = 0; i < frames; ++i) {
+      const double freq = 20.0 + 10000.0 * (pos + i) / total;
+      phase += 2 * M_PI * freq / rate;
+      for (int c = 0; c < channels; ++c) {
+        noise = noise * 1103515245 + 12345;
+        const float n = ((noise >> 16) & 0x7fff) / 32768.0f - 0.5f;
+        buffer[i * channels + c] = 0.4 * sin(phase + c) + 0.05 * n;
+      }
+    }
+    sf_writef_float(out, buffer, frames);
+  }
+  delete [] buffer;
+  sf_close(out);
+  return true;
+}
+
+bool RunOne(FolveFilesystem *fs, const std::string &filter_subdir,
+            const std::string &input, int rate, int channels, int bits,
+            Result *result, std::string *error) {
+  const std::string config_dir = fs->base_config_dir() + "/" + filter_subdir;
+
+  // Measure creation of a processor separately; it goes back to the pool
+  // so that the handler below picks it up again.
+  std::string config_file;
+  if (!fs->processor_pool()->FindConfigFile(config_dir, rate, channels, bits,
+                                            &config_file, error)) {
+    return false;
+  }
+  double start = CurrentTime();
+  SoundProcessor *processor
+    = SoundProcessor::Create(config_file, rate, channels,
+                             fs->processor_pool()->convolver_threads(),
+                             fs->processor_pool()->default_profile());
+  if (processor == NULL) {
+    *error = "Problem parsing " + config_file;
+    return false;
+  }
+  result->setup_ms = (CurrentTime() - start) * 1000.0;
+  result->filter_length = processor->filter_length();
+  result->fragment = processor->fragment_size();
+  fs->processor_pool()->Return(processor);
+
+  start = CurrentTime();
+  const int filedes = open(input.c_str(), O_RDONLY);
+  if (filedes < 0) {
+    *error = "Can't open " + input;
+    return false;
+  }
+  HandlerStats stats;
+  stats.filename = input;
+  FileHandler *handler = ConvolveFileHandler::Create(fs, filedes,
+                                                     input.c_str(), input,
+                                                     filter_subdir, config_dir,
+                                                     &stats);
+  if (handler == NULL) {
+    close(filedes);
+    *error = stats.message;
+    return false;
+  }
+  char *buffer = new char[kReadSize];
+  off_t pos = 0;
+  int r;
+  result->ttfab_ms = -1;
+  while ((r = handler->Read(buffer, kReadSize, pos)) > 0) {
+    pos += r;
+    if (result->ttfab_ms < 0) {
+      // Reads only return header until audio data is produced.
+      handler->GetHandlerStatus(&stats);
+      if (stats.buffer_progress > 0) {
+        result->ttfab_ms = (CurrentTime() - start) * 1000.0;
+      }
+    }
+  }
+  result->total_s = CurrentTime() - start;
+  result->output_bytes = pos;
+  delete [] buffer;
+  delete handler;
+  if (r < 0) {
+    *error = "Read error";
+    return false;
+  }
+  return true;
+}
+
+int usage(const char *prg) {
+  printf("usage: %s [options] [<filter-subdir> ...]\n", prg);
+  printf("Runs each filter in the configuration directory with synthetic\n"
+         "input files of all available sample rates.\n"
+         "Options:\n"
+         "\t-C <cfg-dir> : Convolver base configuration directory.\n"
+         "\t               Default: demo-filters\n"
+         "\t-s <seconds> : Length of the input files. Default 30.\n"
+         "\t-r <rates>   : Comma separated list of sample rates. Default:\n"
+         "\t               all rates a filter has a configuration for.\n"
+         "\t-c <chans>   : Comma separated list of channel counts. "
+         "Default 2.\n"
+         "\t-f <formats> : Comma separated input formats; any of "
+         "wav16,flac16,flac24.\n"
+         "\t               Default: all.\n"
+         "\t-J <threads> : Number of threads convolving each file. "
+         "Default 1.\n"
+         "\t-L           : Use the latency profile for filters that don't "
+         "choose one.\n");
+  return 1;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string config_dir = "demo-filters";
+  int seconds = 30;
+  int convolver_threads = 1;
+  std::vector<int> rates;
+  std::vector<int> channel_list(1, 2);
+  std::string formats;
+  int profile = PROFILE_THROUGHPUT;
+  int opt;
+  while ((opt = getopt(argc, argv, "C:s:r:c:f:J:L")) != -1) {
+    switch (opt) {
+    case 'C': config_dir = optarg; break;
+    case 's': seconds = atoi(optarg); break;
+    case 'r': rates = ParseIntList(optarg); break;
+    case 'c': channel_list = ParseIntList(optarg); break;
+    case 'f': formats = "," + std::string(optarg) + ","; break;
+    case 'J': convolver_threads = atoi(optarg); break;
+    case 'L': profile = PROFILE_LATENCY; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (seconds <= 0 || convolver_threads < 1 || channel_list.empty())
+    return usage(argv[0]);
+
+  std::vector<std::string> filters;
+  for (int i = optind; i < argc; ++i) filters.push_back(argv[i]);
+
+  FolveFilesystem fs;
+  fs.SetBaseConfigDir(config_dir);
+  fs.set_pre_buffer_size(-1);  // We're only interested in the reading path.
+  fs.processor_pool()->set_convolver_threads(convolver_threads);
+  fs.processor_pool()->set_default_profile(profile);
+  if (filters.empty()) {
+    const std::set<std::string> dirs = fs.GetAvailableConfigDirs();
+    for (std::set<std::string>::const_iterator it = dirs.begin();
+         it != dirs.end(); ++it) {
+      if (!it->empty()) filters.push_back(*it);
+    }
+  }
+  if (filters.empty()) {
+    fprintf(stderr, "No filters found in %s\n", config_dir.c_str());
+    return 1;
+  }
+
+  const char *tmp = getenv("TMPDIR");
+  std::string work_dir = StringPrintf("%s/folve-bench.XXXXXX",
+                                      tmp ? tmp : "/tmp");
+  if (mkdtemp(&work_dir[0]) == NULL) {
+    perror("Creating temp directory");
+    return 1;
+  }
+
+  printf("%-12s %7s %3s %-7s %8s %6s %9s %9s %8s %8s %10s\n",
+         "filter", "rate", "ch", "input", "filt-len", "fragm",
+         "setup-ms", "ttfab-ms", "realtime", "ms/frag", "KiB/s");
+  bool any_error = false;
+  for (size_t f = 0; f < filters.size(); ++f) {
+    std::vector<int> filter_rates = rates;
+    if (filter_rates.empty()) {
+      const std::set<int> available = AvailableRates(config_dir + "/"
+                                                     + filters[f]);
+      filter_rates.assign(available.begin(), available.end());
+    }
+    for (size_t r = 0; r < filter_rates.size(); ++r) {
+      for (size_t c = 0; c < channel_list.size(); ++c) {
+        for (int i = 0; i < kInputFormatCount; ++i) {
+          const InputFormat &in = kInputFormats[i];
+          if (!formats.empty()
+              && formats.find(StringPrintf(",%s,", in.name))
+              == std::string::npos)
+            continue;
+          const int rate = filter_rates[r];
+          const int channels = channel_list[c];
+          const int bits = ((in.format & SF_FORMAT_SUBMASK)
+                            == SF_FORMAT_PCM_24) ? 24 : 16;
+          const std::string input = StringPrintf(
+               "%s/in-%d-%d.%s", work_dir.c_str(), rate, channels,
+               (in.format & SF_FORMAT_TYPEMASK) == SF_FORMAT_WAV
+               ? "wav" : "flac");
+          printf("%-12s %7d %3d %-7s ", filters[f].c_str(), rate, channels,
+                 in.name);
+          fflush(stdout);
+          Result result;
+          std::string error;
+          bool success = CreateInputFile(input, in.format, rate, channels,
+                                         seconds);
+          if (!success) {
+            error = "Couldn't create input";
+          } else {
+            success = RunOne(&fs, filters[f], input, rate, channels, bits,
+                             &result, &error);
+          }
+          unlink(input.c_str());
+          if (!success) {
+            printf("-- %s\n", error.c_str());
+            any_error = true;
+            continue;
+          }
+          const double fragments = 1.0 * rate * seconds / result.fragment;
+          printf("%8d %6d %9.1f %9.1f %7.1fx %8.3f %10.0f\n",
+                 result.filter_length, result.fragment,
+                 result.setup_ms, result.ttfab_ms,
+                 seconds / result.total_s,
+                 result.total_s * 1000.0 / fragments,
+                 result.output_bytes / result.total_s / 1024);
+        }
+      }
+    }
+  }
+  rmdir(work_dir.c_str());
+  return any_error ? 1 : 0;
+}
@@ -32,39 +32,207 @@
 #include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <zita-convolver.h>
 
 #include "buffer-thread.h"
+#include "conversion-buffer.h"
 #include "convolve-file-handler.h"
 #include "file-handler-cache.h"
 #include "file-handler.h"
 #include "pass-through-handler.h"
+#include "render-ahead.h"
+#include "render-cache.h"
 #include "util.h"
 
+class FolveFilesystem::LookAheadThread : public folve::Thread {
+public:
+  // Not a background thread: the end of the file might wait for us.
+  LookAheadThread(FolveFilesystem *fs) : folve::Thread(false), fs_(fs) {}
+  virtual void Run() { fs_->ProcessLookAheadQueue(); }
+
+private:
+  FolveFilesystem *const fs_;
+};
+
 FolveFilesystem::FolveFilesystem()
   : gapless_processing_(false), toplevel_dir_is_filter_(false),
-    pre_buffer_size_(128 << 10),
-    open_file_cache_(4),
-    processor_pool_(3), buffer_thread_(NULL),
+    warm_up_filters_(false), pre_buffer_size_(128 << 10),
+    pre_buffer_budget_((off_t) 256 << 20),
+    open_file_cache_(16, (off_t) 256 << 20), directory_cache_(1024),
+    processor_pool_(3), prebuffer_threads_(1), buffer_pool_(NULL),
+    render_cache_(NULL), render_ahead_(new RenderAhead(this)),
     total_file_openings_(0), total_file_reopen_(0),
     // oversize factor of 1.25 seems to be a good initial size.
-    file_oversize_factor_(1.25),
+    file_oversize_factor_(1.25), estimate_output_size_(false),
+    flac_compression_level_(-1), uncompressed_output_(false),
+    look_ahead_thread_(NULL),
     workaround_flac_header_issue_(false) {
+  pthread_cond_init(&look_ahead_event_, NULL);
+}
+
+std::string FolveFilesystem::EncoderProfileName() const {
+  if (uncompressed_output_)
+    return "WAV";
+  if (flac_compression_level_ >= 0)
+    return folve::StringPrintf("FLAC level %d", flac_compression_level_);
+  return "";
+}
+
+void FolveFilesystem::SetRenderCache(const std::string &dir, off_t max_bytes) {
+  delete render_cache_;
+  render_cache_ = new RenderCache(dir, max_bytes);
+}
+
+off_t FolveFilesystem::PrebufferLead(const ConversionBuffer *buffer) const {
+  // Stay this many seconds ahead of what the reader will consume at its
+  // current rate. Slow readers (e.g. a player reading in real time) get
+  // little, readers burst-reading the file a lot.
+  static const double kPrebufferSeconds = 10.0;
+  const off_t by_rate = (off_t) (buffer->ReadRate() * kPrebufferSeconds);
+  return std::max((off_t) pre_buffer_size_, by_rate);
 }
 
 void FolveFilesystem::RequestPrebuffer(ConversionBuffer *buffer) {
   if (pre_buffer_size_ <= 0) return;
-  if (buffer_thread_ == NULL) {
-    buffer_thread_ = new BufferThread(pre_buffer_size_);
-    buffer_thread_->Start();
+  {
+    folve::MutexLock l(&buffer_pool_mutex_);
+    if (buffer_pool_ == NULL) {
+      buffer_pool_ = new BufferThreadPool(pre_buffer_size_, pre_buffer_budget_,
+                                          prebuffer_threads_);
+      buffer_pool_->Start();
+    }
   }
-  buffer_thread_->EnqueueWork(buffer);
+  buffer_pool_->EnqueueWork(buffer,
+                            buffer->MaxAccessed() + PrebufferLead(buffer));
 }
 
 void FolveFilesystem::QuitBuffering(ConversionBuffer *buffer) {
-  if (buffer_thread_ != NULL) buffer_thread_->Forget(buffer);
+  BufferThreadPool *pool;
+  {
+    folve::MutexLock l(&buffer_pool_mutex_);
+    pool = buffer_pool_;
+  }
+  if (pool != NULL) pool->Forget(buffer);
+}
+
+static bool ExtractDirAndSuffix(const std::string &filename,
+                                std::string *dir, std::string *suffix) {
+  const std::string::size_type slash_pos = filename.find_last_of('/');
+  if (slash_pos == std::string::npos) return false;
+  *dir = filename.substr(0, slash_pos + 1);
+  const std::string::size_type dot_pos = filename.find_last_of('.');
+  if (dot_pos != std::string::npos && dot_pos > slash_pos) {
+    *suffix = filename.substr(dot_pos);
+  }
+  return true;
+}
+
+FileHandler *FolveFilesystem::OpenNextFile(const std::string &fs_path,
+                                           std::string *next_path) {
+  typedef std::set<std::string> DirSet;
+  DirSet dirset;
+  std::string fs_dir, file_suffix;
+  DirSet::const_iterator found;
+  if (!ExtractDirAndSuffix(fs_path, &fs_dir, &file_suffix)
+      || !ListDirectory(fs_dir, file_suffix, &dirset)
+      || (found = dirset.upper_bound(fs_path)) == dirset.end())
+    return NULL;
+  *next_path = *found;
+  return GetOrCreateHandler(found->c_str());
+}
+
+void FolveFilesystem::PrepareNextFile(const std::string &fs_path) {
+  folve::MutexLock l(&next_file_mutex_);
+  if (!next_files_.insert(std::make_pair(fs_path, NextFile())).second)
+    return;  // Already requested.
+  look_ahead_queue_.push_back(fs_path);
+  if (look_ahead_thread_ == NULL) {
+    look_ahead_thread_ = new LookAheadThread(this);
+    look_ahead_thread_->Start();
+  }
+  pthread_cond_broadcast(&look_ahead_event_);
+}
+
+void FolveFilesystem::ProcessLookAheadQueue() {
+  for (;;) {
+    std::string fs_path;
+    {
+      folve::MutexLock l(&next_file_mutex_);
+      while (look_ahead_queue_.empty()) {
+        next_file_mutex_.WaitOn(&look_ahead_event_);
+      }
+      fs_path = look_ahead_queue_.front();
+      look_ahead_queue_.pop_front();
+      if (next_files_.find(fs_path) == next_files_.end())
+        continue;  // Forgotten in the meantime.
+    }
+    const double start_time = folve::CurrentTime();
+    std::string next_path;
+    FileHandler *handler = OpenNextFile(fs_path, &next_path);
+    bool still_needed;
+    {
+      folve::MutexLock l(&next_file_mutex_);
+      NextFileMap::iterator found = next_files_.find(fs_path);
+      still_needed = (found != next_files_.end());
+      if (still_needed) {
+        found->second.path = next_path;
+        found->second.handler = handler;
+        found->second.done = true;
+      }
+    }
+    if (!still_needed && handler != NULL) {
+      Close(next_path.c_str(), handler);
+    }
+    folve::DLogf("Gapless look-ahead: '%s' -> '%s' (%.1fms)",
+                 fs_path.c_str(), handler ? next_path.c_str() : "-",
+                 (folve::CurrentTime() - start_time) * 1000.0);
+  }
+}
+
+FileHandler *FolveFilesystem::TakeNextFile(const std::string &fs_path,
+                                           std::string *next_path) {
+  {
+    folve::MutexLock l(&next_file_mutex_);
+    NextFileMap::iterator found = next_files_.find(fs_path);
+    if (found != next_files_.end()) {
+      const NextFile next = found->second;
+      next_files_.erase(found);
+      if (next.done) {
+        *next_path = next.path;
+        return next.handler;
+      }
+      // Still in progress. Don't wait for it, the look-ahead thread
+      // closes its handler once done. The handler cache makes sure
+      // we end up with the same handler.
+    }
+  }
+  return OpenNextFile(fs_path, next_path);  // Not prepared (yet).
+}
+
+void FolveFilesystem::ForgetNextFile(const std::string &fs_path) {
+  FileHandler *handler = NULL;
+  std::string next_path;
+  {
+    folve::MutexLock l(&next_file_mutex_);
+    NextFileMap::iterator found = next_files_.find(fs_path);
+    if (found == next_files_.end())
+      return;
+    // If not done yet, the look-ahead thread closes it once done.
+    if (found->second.done) {
+      handler = found->second.handler;
+      next_path = found->second.path;
+    }
+    next_files_.erase(found);
+  }
+  if (handler != NULL) Close(next_path.c_str(), handler);
+}
+
+int FolveFilesystem::prebuffer_queue_depth() {
+  folve::MutexLock l(&buffer_pool_mutex_);
+  return buffer_pool_ != NULL ? buffer_pool_->QueueSize() : 0;
 }
 
 FileHandler *FolveFilesystem::CreateFromDescriptor(
@@ -85,6 +253,7 @@ FileHandler *FolveFilesystem::CreateFromDescriptor(
     if (handler != NULL) return handler;
   }
   // Every other file-type is just passed through as is.
+  file_info.filter_dir = "";
   return new PassThroughHandler(filedes, config_dir, file_info);
 }
 
@@ -170,15 +339,13 @@ bool FolveFilesystem::ListDirectory(const std::string &fs_dir,
                                     const std::string &suffix,
                                     std::set<std::string> *files) {
   const std::string real_dir = GetUnderlyingFile(fs_dir.c_str());
-  DIR *dp = opendir(real_dir.c_str());
-  if (dp == NULL) return false;
-  struct dirent *dent;
-  while ((dent = readdir(dp)) != NULL) {
-    if (!folve::HasSuffix(dent->d_name, suffix))
+  std::vector<DirectoryCache::Entry> entries;
+  if (!directory_cache_.GetEntries(real_dir, &entries)) return false;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (!folve::HasSuffix(entries[i].name, suffix))
       continue;
-    files->insert(fs_dir + dent->d_name);
+    files->insert(fs_dir + entries[i].name);
   }
-  closedir(dp);
   return true;
 }
 
@@ -223,6 +390,9 @@ bool FolveFilesystem::SwitchCurrentConfigDir(const std::string &subdir_in) {
       syslog(LOG_INFO, "Switching to pass-through mode.");
     } else {
       syslog(LOG_INFO, "Switching config directory to '%s'", subdir.c_str());
+      if (warm_up_filters_) {
+        processor_pool_.WarmUp(base_config_dir_ + "/" + subdir);
+      }
     }
     return true;
   }
@@ -247,6 +417,10 @@ bool FolveFilesystem::CheckInitialized() {
     return false;
   }
 
+  if (render_cache_ != NULL && !render_cache_->CheckInitialized()) {
+    return false;
+  }
+
   return true;
 }
 
@@ -261,6 +435,14 @@ void FolveFilesystem::SetupInitialConfig() {
     // By default, lets set the index to the first filter the user provided.
     SwitchCurrentConfigDir(*++available_dirs.begin());
   }
+  if (warm_up_filters_ && toplevel_directory_is_filter()) {
+    // All filters are in use simultaneously.
+    for (std::set<std::string>::const_iterator it = available_dirs.begin();
+         it != available_dirs.end(); ++it) {
+      if (it->empty()) continue;
+      processor_pool_.WarmUp(base_config_dir_ + "/" + *it);
+    }
+  }
 }
 
 const std::set<std::string> FolveFilesystem::GetAvailableConfigDirs() const {
@@ -21,20 +21,26 @@
 
 #include <unistd.h>
 
+#include <deque>
+#include <map>
 #include <string>
 #include <vector>
 #include <set>
 
+#include "directory-cache.h"
 #include "file-handler-cache.h"
 #include "file-handler.h"
 #include "processor-pool.h"
+#include "shared-decoder.h"
 
 #ifndef FOLVE_VERSION
 #  define FOLVE_VERSION "[unknown version - compile from git]"
 #endif
 
 class ConversionBuffer;
-class BufferThread;
+class BufferThreadPool;
+class RenderAhead;
+class RenderCache;
 class FolveFilesystem {
 public:
   // Create a new filesystem. At least SetBasedir() needs to be called
@@ -97,8 +103,20 @@ public:
   bool ListDirectory(const std::string &fs_dir, const std::string &suffix,
                      std::set<std::string> *files);
 
+  // Keep fully convolved files in the given directory, using at most
+  // "max_bytes" of space; see render-cache.h
+  void SetRenderCache(const std::string &dir, off_t max_bytes);
+
+  // Returns the render cache or NULL if not enabled.
+  RenderCache *render_cache() { return render_cache_; }
+
+  // Background conversion of files into the render cache.
+  RenderAhead *render_ahead() { return render_ahead_; }
+
   FileHandlerCache *handler_cache() { return &open_file_cache_; }
+  DirectoryCache *directory_cache() { return &directory_cache_; }
   ProcessorPool *processor_pool() { return &processor_pool_; }
+  SharedDecoder *shared_decoder() { return &shared_decoder_; }
 
   void set_gapless_processing(bool b) { gapless_processing_ = b; }
   bool gapless_processing() const { return gapless_processing_; }
@@ -106,10 +124,28 @@ public:
   void set_toplevel_directory_is_filter(bool b) { toplevel_dir_is_filter_ = b; }
   bool toplevel_directory_is_filter() const { return toplevel_dir_is_filter_; }
 
-  // Should we attempt to pre-buffer files ?
+  // Should we attempt to pre-buffer files ? This is the minimum we
+  // convert ahead of a reader; faster readers get more, see PrebufferLead().
   void set_pre_buffer_size(int b) { pre_buffer_size_ = b; }
   int pre_buffer_size() const { return pre_buffer_size_; }
 
+  // Maximum bytes all pre-buffering together converts beyond the minimum.
+  void set_pre_buffer_budget(off_t b) { pre_buffer_budget_ = b; }
+  off_t pre_buffer_budget() const { return pre_buffer_budget_; }
+
+  // Bytes to convert ahead of the reader of "buffer", depending on how
+  // fast it reads.
+  off_t PrebufferLead(const ConversionBuffer *buffer) const;
+
+  // Pre-create filters of the current configuration in the background
+  // after startup and after each switch; see ProcessorPool::WarmUp().
+  void set_warm_up_filters(bool b) { warm_up_filters_ = b; }
+  bool warm_up_filters() const { return warm_up_filters_; }
+
+  // Number of threads working on pre-buffering in parallel.
+  void set_prebuffer_threads(int n) { prebuffer_threads_ = n; }
+  int prebuffer_threads() const { return prebuffer_threads_; }
+
   // Some media servers look at the file size initially to decide which is
   // the file-size they need to serve. However, the final file-size after
   // convolving might be different (compression not really predictable) and
@@ -121,15 +157,70 @@ public:
   float file_oversize_factor() { return file_oversize_factor_; }
   void set_file_oversize_factor(float v) { file_oversize_factor_ = v; }
 
+  // Instead of the oversize factor, estimate the size of compressed
+  // output files by encoding a few samples of the convolved output when
+  // opening them. (Sizes of uncompressed outputs are always known exactly).
+  void set_estimate_output_size(bool b) { estimate_output_size_ = b; }
+  bool estimate_output_size() const { return estimate_output_size_; }
+
+  // Encoder profile for convolved output. FLAC compression level 0 (fast)
+  // to 8 (small); -1 uses the libsndfile default.
+  void set_flac_compression_level(int l) { flac_compression_level_ = l; }
+  int flac_compression_level() const { return flac_compression_level_; }
+
+  // Output uncompressed WAV instead, for all input formats.
+  void set_uncompressed_output(bool b) { uncompressed_output_ = b; }
+  bool uncompressed_output() const { return uncompressed_output_; }
+
+  // Short description of the encoder profile, e.g. "FLAC level 0". Empty
+  // with the default settings.
+  std::string EncoderProfileName() const;
+
   // Some stats.
   int total_file_openings() { return total_file_openings_; }
   int total_file_reopen() { return total_file_reopen_; }
 
-  // Allows sound conversions to use the pre-buffer thread.
+  // Number of buffers waiting for or in pre-buffering.
+  int prebuffer_queue_depth();
+
+  // Allows sound conversions to use the pre-buffer threads.
   void RequestPrebuffer(ConversionBuffer *buffer);
   void QuitBuffering(ConversionBuffer *buffer);
 
+  // Gapless: find and open the file alphabetically following "fs_path" in
+  // a background thread, so that it is ready once we get to the end of
+  // "fs_path".
+  void PrepareNextFile(const std::string &fs_path);
+
+  // Get the pinned handler of the file following "fs_path" and its path
+  // in "next_path"; to be released with Close(). If PrepareNextFile() wasn't
+  // called or is not finished yet, the file is opened right away.
+  // Returns NULL if there is no next file.
+  FileHandler *TakeNextFile(const std::string &fs_path,
+                            std::string *next_path);
+
+  // We don't need the file prepared for "fs_path" anymore.
+  void ForgetNextFile(const std::string &fs_path);
+
 private:
+  class LookAheadThread;
+  friend class LookAheadThread;
+
+  struct NextFile {
+    NextFile() : handler(NULL), done(false) {}
+    std::string path;
+    FileHandler *handler;   // Pinned. NULL if there is no next file.
+    bool done;
+  };
+  typedef std::map<std::string, NextFile> NextFileMap;
+
+  // Find and open the file following "fs_path".
+  FileHandler *OpenNextFile(const std::string &fs_path,
+                            std::string *next_path);
+
+  // Work on look-ahead queue. Called in look-ahead thread; never returns.
+  void ProcessLookAheadQueue();
+
   // Get cache key, depending on the given configuration.
   std::string CacheKey(const std::string &config_path, const char *fs_path);
 
@@ -157,13 +248,30 @@ private:
   std::string current_config_subdir_;
   bool gapless_processing_;
   bool toplevel_dir_is_filter_;
+  bool warm_up_filters_;
   int pre_buffer_size_;
+  off_t pre_buffer_budget_;
   FileHandlerCache open_file_cache_;
+  DirectoryCache directory_cache_;
   ProcessorPool processor_pool_;
-  BufferThread *buffer_thread_;
+  SharedDecoder shared_decoder_;
+  int prebuffer_threads_;
+  folve::Mutex buffer_pool_mutex_;
+  BufferThreadPool *buffer_pool_;  // Lazily created.
+  RenderCache *render_cache_;
+  RenderAhead *render_ahead_;
   int total_file_openings_;
   int total_file_reopen_;
   float file_oversize_factor_;
+  bool estimate_output_size_;
+  int flac_compression_level_;
+  bool uncompressed_output_;
+
+  folve::Mutex next_file_mutex_;
+  NextFileMap next_files_;              // Keyed by the file before.
+  std::deque<std::string> look_ahead_queue_;
+  pthread_cond_t look_ahead_event_;     // Something queued.
+  LookAheadThread *look_ahead_thread_;  // Lazily created.
 
   // Work around a range of versions of libsndfile/libflac that can't deal with
   // flushing headers first.
@@ -25,80 +25,63 @@
 #include <fcntl.h>
 #include <limits.h>
 #include <sndfile.h>  // for sf_version_string
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
-#include <sys/syscall.h>   // need to call gettid syscall.
 #include <sys/time.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include "access-trace.h"
+#include "channel-ops.h"
+#include "chunk-pool.h"
 #include "folve-filesystem.h"
+#include "metrics.h"
 #include "status-server.h"
 #include "util.h"
+#include "zita-config.h"
 
 static const char kStatusFileName[] = "/folve-status.html";
 static const int kUsefulMinBuf = 64;
 static const int kUsefulMaxBuf = 16384;
+static const int kDefaultRenderCacheMiB = 4096;
 
 // Compilation unit variables to communicate with the fuse callbacks.
 static struct FolveRuntime {
   FolveRuntime() : fs(NULL), mount_point(NULL), pid_file(NULL),
                    status_port(-1), refresh_time(10), parameter_error(false),
-                   readdir_dump_file(NULL), status_server(NULL) {}
+                   access_trace(NULL), status_server(NULL),
+                   render_cache_mb(kDefaultRenderCacheMiB) {}
   FolveFilesystem *fs;
   const char *mount_point;
   const char *pid_file;
   int status_port;
   int refresh_time;
   bool parameter_error;
-  FILE *readdir_dump_file;
+  AccessTrace *access_trace;
   StatusServer *status_server;
+  std::string render_cache_dir;
+  int render_cache_mb;
 } folve_rt;
 
-// Logger that only prints to stderr; used for
-class ReaddirLogger {
-public:
-  ReaddirLogger() : start_time_(folve::CurrentTime()) {}
-
-  void WriteInit() {
-    if (!folve_rt.readdir_dump_file) return;
-    fprintf (folve_rt.readdir_dump_file, "%-11s %-8s: <log>\n",
-             "#  time", "  tid");
-    fflush(folve_rt.readdir_dump_file);
-  }
-
-  ReaddirLogger &Log(const char *fmt, ...)
-  __attribute__ ((format (printf, 2, 3))) {
-    if (!folve_rt.readdir_dump_file) return *this;
-    fprintf (folve_rt.readdir_dump_file, "%011.6f %08lx: ",
-             folve::CurrentTime() - start_time_, syscall(SYS_gettid));
-    va_list ap;
-    va_start(ap, fmt);
-    folve::MutexLock l(&io_mutex_);
-    vfprintf(folve_rt.readdir_dump_file, fmt, ap);
-    va_end(ap);
-    return *this;
-  }
-
-  void Flush() {
-    if (folve_rt.readdir_dump_file) {
-      folve::MutexLock l(&io_mutex_);
-      fflush(folve_rt.readdir_dump_file);
-    }
-  }
+// With -R, calls are recorded to the access trace.
+static double TraceStart() {
+  return folve_rt.access_trace ? folve::CurrentTime() : 0;
+}
 
-private:
-  const double start_time_;
-  folve::Mutex io_mutex_;
-} rlog;
+static void Trace(AccessTrace::Op op, const char *path, uint64_t handle,
+                  off_t offset, size_t size, int result, double start_time) {
+  if (folve_rt.access_trace && strcmp(path, kStatusFileName) != 0) {
+    folve_rt.access_trace->Record(op, path, handle, offset, size, result,
+                                  start_time);
+  }
+}
 
 // Essentially lstat(). Just forward to the original filesystem (this
 // will by lying: our convolved files are of different size...)
-static int folve_getattr(const char *path, struct stat *stbuf) {
+static int GetAttr(const char *path, struct stat *stbuf) {
   if (strcmp(path, kStatusFileName) == 0) {
     FileHandler *status = folve_rt.status_server->CreateStatusFileHandler();
     status->Stat(stbuf);
@@ -109,25 +92,27 @@ static int folve_getattr(const char *path, struct stat *stbuf) {
   // estimate.
   int result = folve_rt.fs->StatByFilename(path, stbuf);
   if (result != 0) {
-    result = lstat(folve_rt.fs->GetUnderlyingFile(path).c_str(), stbuf);
-    rlog.Log("STAT %s mode=%03o %s %s %s", path,
-             stbuf->st_mode & 0777, S_ISDIR(stbuf->st_mode) ? "DIR" : "",
-             (result == -1) ? strerror(errno) : "",
-             ctime(&stbuf->st_mtime));  // ctime ends with \n, so put that last
+    result = folve_rt.fs->directory_cache()
+      ->Lstat(folve_rt.fs->GetUnderlyingFile(path), stbuf);
     stbuf->st_size *= folve_rt.fs->file_oversize_factor();
     if (result == -1)
       return -errno;
-  } else {
-    rlog.Log("FOLVE-Stat %s\n", path);
   }
   // Whatever write mode was there before: now things are readonly.
   stbuf->st_mode &= ~(S_IWUSR | S_IWGRP | S_IWOTH);
   return 0;
 }
 
-// readdir(). Just forward to original filesystem.
-static int folve_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                         off_t offset, struct fuse_file_info *fi) {
+static int folve_getattr(const char *path, struct stat *stbuf) {
+  const double start = TraceStart();
+  const int result = GetAttr(path, stbuf);
+  Trace(AccessTrace::GETATTR, path, 0, 0, 0, result, start);
+  return result;
+}
+
+// readdir(). Just forward to original filesystem. Returns number of
+// entries or -errno.
+static int ReadDir(const char *path, void *buf, fuse_fill_dir_t filler) {
   if (strcmp(path, "/") == 0) {
     struct stat st;
     memset(&st, 0, sizeof(st));
@@ -143,33 +128,34 @@ static int folve_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         memset(&st, 0, sizeof(st));
         filler(buf, pathname, &st, 0);
       }
-      return 0;
+      return dirs.size();
     }
   }
 
-  DIR *dp;
-  dp = opendir(folve_rt.fs->GetUnderlyingFile(path).c_str());
-  if (dp == NULL)
+  std::vector<DirectoryCache::Entry> entries;
+  if (!folve_rt.fs->directory_cache()
+      ->GetEntries(folve_rt.fs->GetUnderlyingFile(path), &entries))
     return -errno;
 
-  rlog.Log("LIST %s\n", path);
-  struct dirent *de;
-  while ((de = readdir(dp)) != NULL) {
+  size_t i;
+  for (i = 0; i < entries.size(); ++i) {
+    const DirectoryCache::Entry &entry = entries[i];
     struct stat st;
     memset(&st, 0, sizeof(st));
-    st.st_ino = de->d_ino;
-    st.st_mode = de->d_type << 12;
-    const char *entry_name = de->d_name;
-    rlog.Log("ITEM %s%s%s\n", path, strlen(path) > 1 ? "/" : "", de->d_name);
-    if (filler(buf, entry_name, &st, 0)) {
-      rlog.Log("DONE (%s)\n", de->d_name);
+    st.st_ino = entry.inode;
+    st.st_mode = entry.type << 12;
+    if (filler(buf, entry.name.c_str(), &st, 0))
       break;
-    }
   }
+  return i;
+}
 
-  rlog.Log("DONE %s\n", path).Flush();
-  closedir(dp);
-  return 0;
+static int folve_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                         off_t offset, struct fuse_file_info *fi) {
+  const double start = TraceStart();
+  const int result = ReadDir(path, buf, filler);
+  Trace(AccessTrace::READDIR, path, 0, 0, 0, result, start);
+  return result < 0 ? result : 0;
 }
 
 // readlink(): forward to original filesystem.
@@ -198,33 +184,92 @@ static int folve_open(const char *path, struct fuse_file_info *fi) {
   // The file-handle has the neat property to be 64 bit - so we can actually
   // stuff a pointer to our file handler object in there :)
   // (Yay, someone was thinking while developing that API).
+  const double start = TraceStart();
   FileHandler *handler = folve_rt.fs->GetOrCreateHandler(path);
   fi->fh = (uint64_t) handler;
-  if (handler == NULL)
-    return -errno;
-  return 0;
+  const int result = (handler == NULL) ? -errno : 0;
+  Trace(AccessTrace::OPEN, path, fi->fh, 0, 0, result, start);
+  return result;
 }
 
 static int folve_read(const char *path, char *buf, size_t size, off_t offset,
                       struct fuse_file_info *fi) {
-  return reinterpret_cast<FileHandler *>(fi->fh)->Read(buf, size, offset);
+  folve::ScopedTimer timer(&folve::metrics::fuse_read_time);
+  folve::PlaybackRead playback;  // Somebody is listening; see -q
+  const double start = TraceStart();
+  const int result
+    = reinterpret_cast<FileHandler *>(fi->fh)->Read(buf, size, offset);
+  Trace(AccessTrace::READ, path, fi->fh, offset, size, result, start);
+  return result;
 }
 
+#if FUSE_VERSION >= 29
+// Like folve_read(), but if the data is in a file, let FUSE splice it from
+// there into the kernel instead of copying it through our buffers.
+static int folve_read_buf(const char *path, struct fuse_bufvec **bufp,
+                          size_t size, off_t offset,
+                          struct fuse_file_info *fi) {
+  folve::ScopedTimer timer(&folve::metrics::fuse_read_time);
+  folve::PlaybackRead playback;
+  const double start = TraceStart();
+  FileHandler *handler = reinterpret_cast<FileHandler *>(fi->fh);
+  struct fuse_bufvec *result
+    = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+  *result = FUSE_BUFVEC_INIT(size);
+  int fd;
+  off_t fd_offset;
+  size_t available;
+  if (handler->GetFileRegion(size, offset, &fd, &fd_offset, &available)) {
+    result->buf[0].size = available;
+    result->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD
+                                                  | FUSE_BUF_FD_SEEK);
+    result->buf[0].fd = fd;
+    result->buf[0].pos = fd_offset;
+  } else {
+    char *buf = (char*) malloc(size);  // FUSE frees it after replying.
+    const int read_result = handler->Read(buf, size, offset);
+    if (read_result < 0) {
+      Trace(AccessTrace::READ, path, fi->fh, offset, size, read_result, start);
+      free(buf);
+      free(result);
+      return read_result;
+    }
+    result->buf[0].size = read_result;
+    result->buf[0].mem = buf;
+  }
+  Trace(AccessTrace::READ, path, fi->fh, offset, size, result->buf[0].size,
+        start);
+  *bufp = result;
+  return 0;
+}
+#endif
+
 static int folve_release(const char *path, struct fuse_file_info *fi) {
   if (strcmp(path, kStatusFileName) == 0) {
     delete reinterpret_cast<FileHandler *>(fi->fh);
   } else {
+    const double start = TraceStart();
     folve_rt.fs->Close(path, reinterpret_cast<FileHandler *>(fi->fh));
+    Trace(AccessTrace::RELEASE, path, fi->fh, 0, 0, 0, start);
   }
   return 0;
 }
 
 static int folve_fgetattr(const char *path, struct stat *result,
                           struct fuse_file_info *fi) {
-  return reinterpret_cast<FileHandler *>(fi->fh)->Stat(result);
+  const double start = TraceStart();
+  const int r = reinterpret_cast<FileHandler *>(fi->fh)->Stat(result);
+  Trace(AccessTrace::FGETATTR, path, fi->fh, 0, 0, r, start);
+  return r;
 }
 
 static void *folve_init(struct fuse_conn_info *conn) {
+#ifdef FUSE_CAP_SPLICE_WRITE
+  // Replies from file regions (see folve_read_buf()) can then be spliced.
+  if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+    conn->want |= FUSE_CAP_SPLICE_WRITE;
+  }
+#endif
   if (folve_rt.pid_file) {
     FILE *p = fopen(folve_rt.pid_file, "w+");
     if (p) {
@@ -270,9 +315,7 @@ static void *folve_init(struct fuse_conn_info *conn) {
 }
 
 static void folve_destroy(void *) {
-  if (folve_rt.readdir_dump_file) {
-    fclose(folve_rt.readdir_dump_file);
-  }
+  delete folve_rt.access_trace;
   syslog(LOG_INFO, "Exiting.");
 }
 
@@ -288,18 +331,65 @@ static int usage(const char *prg) {
          "\t-r <refresh> : Seconds between refresh of status page;\n"
          "\t               Default is %d seconds; switch off with -1.\n"
          "\t-g           : Gapless convolving alphabetically adjacent files.\n"
+         "\t-w           : Warm-up: create filters in the background after "
+         "startup\n"
+         "\t               and filter switch, so that first open is fast.\n"
          "\t-b <KibiByte>: Predictive pre-buffer by given KiB (%d...%d). "
          "Disable with -1. Default 128.\n"
+         "\t               Fast readers get up to 10 seconds of their "
+         "read rate.\n"
+         "\t-B <MebiByte>: Budget for all pre-buffering beyond the -b "
+         "minimum.\n"
+         "\t               Default 256.\n"
+         "\t-j <threads> : Number of threads pre-buffering files in "
+         "parallel. Default 1.\n"
+         "\t-J <threads> : Number of threads convolving each file, "
+         "splitting\n"
+         "\t               the filter outputs among them. Default 1.\n"
+         "\t-a <cpus>    : Run conversion and pre-buffering on these cpus, "
+         "e.g. 2,3\n"
+         "\t               or 1-3.\n"
+         "\t-q <policy>  : Scheduling of conversion a reader is waiting "
+         "for:\n"
+         "\t               nice:<n>, fifo:<prio> or rr:<prio>.\n"
+         "\t-L           : Latency profile: filters without "
+         "/convolver/profile\n"
+         "\t               convolve in small fragments for a faster start.\n"
+         "\t-M <MebiByte>: Memory to keep conversion buffers in; beyond "
+         "that,\n"
+         "\t               temp files are used. Default 0: temp files only.\n"
+         "\t-k <count>   : Keep up to this many recently used files "
+         "converted.\n"
+         "\t               Default 16.\n"
+         "\t-K <MebiByte>: ... as long as their conversion buffers stay "
+         "below this.\n"
+         "\t               Default 256; 0 for no limit.\n"
          "\t-O <factor>  : Oversize: Multiply orig. file sizes with this. "
          "Default 1.25.\n"
+         "\t-E <level>   : FLAC compression level of the output: 0 (fast) to "
+         "8 (small).\n"
+         "\t               'wav' for uncompressed WAV output.\n"
+         "\t-T           : Add TPDF dither when reducing to the output "
+         "bit depth.\n"
+         "\t-l           : Soft-clip: bend peaks above -0.9dB smoothly "
+         "instead\n"
+         "\t               of clipping them.\n"
+         "\t-e           : Estimate size of compressed output by encoding "
+         "a few\n"
+         "\t               samples on the first stat() of an open file.\n"
+         "\t-c <dir>     : Keep fully convolved files in this render cache "
+         "directory.\n"
+         "\t-S <MebiByte>: Maximum size of the render cache. Default %d.\n"
          "\t-o <mnt-opt> : other generic mount parameters passed to FUSE.\n"
          "\t-P <pid-file>: Write PID to this file.\n"
          "\t-D           : Moderate volume Folve debug messages to syslog,\n"
          "\t               and some more detailed configuration info in UI\n"
          "\t-f           : Operate in foreground; useful for debugging.\n"
          "\t-d           : High volume FUSE debug log. Implies -f.\n"
-         "\t-R <file>    : Debug readdir() & stat() calls. Output to file.\n",
-         folve_rt.refresh_time, kUsefulMinBuf, kUsefulMaxBuf);
+         "\t-R <file>    : Record a trace of file accesses to this file;\n"
+         "\t               replay with folve-replay.\n",
+         folve_rt.refresh_time, kUsefulMinBuf, kUsefulMaxBuf,
+         kDefaultRenderCacheMiB);
   return 1;
 }
 
@@ -311,9 +401,25 @@ enum {
   FOLVE_OPT_OVERSIZE_PREDICT,
   FOLVE_OPT_PID_FILE,
   FOLVE_OPT_DEBUG,
-  FOLVE_OPT_DEBUG_READDIR,
+  FOLVE_OPT_ACCESS_TRACE,
   FOLVE_OPT_GAPLESS,
   FOLVE_OPT_TOPLEVEL_DIR_FILTER,
+  FOLVE_OPT_RENDER_CACHE_DIR,
+  FOLVE_OPT_RENDER_CACHE_SIZE,
+  FOLVE_OPT_PREBUFFER_THREADS,
+  FOLVE_OPT_CONVOLVER_THREADS,
+  FOLVE_OPT_WARM_UP,
+  FOLVE_OPT_BUFFER_MEMORY,
+  FOLVE_OPT_ESTIMATE_SIZE,
+  FOLVE_OPT_PREBUFFER_BUDGET,
+  FOLVE_OPT_LATENCY_PROFILE,
+  FOLVE_OPT_OPEN_FILES,
+  FOLVE_OPT_OPEN_FILES_BYTES,
+  FOLVE_OPT_ENCODER_PROFILE,
+  FOLVE_OPT_DITHER,
+  FOLVE_OPT_SOFT_CLIP,
+  FOLVE_OPT_CPUS,
+  FOLVE_OPT_PLAYBACK_SCHEDULING,
 };
 
 int FolveOptionHandling(void *data, const char *arg, int key,
@@ -391,6 +497,54 @@ int FolveOptionHandling(void *data, const char *arg, int key,
     return 0;
   }
 
+  case FOLVE_OPT_PREBUFFER_THREADS: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-j: Need at least one thread; got %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->set_prebuffer_threads(value);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_CONVOLVER_THREADS: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-J: Need at least one thread; got %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->processor_pool()->set_convolver_threads(value);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_BUFFER_MEMORY: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 0) {
+      fprintf(stderr, "-M: Invalid size %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      ChunkPool::instance()->set_max_bytes((size_t) value << 20);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_PREBUFFER_BUDGET: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 0) {
+      fprintf(stderr, "-B: Invalid size %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->set_pre_buffer_budget((off_t) value << 20);
+    }
+    return 0;
+  }
+
   case FOLVE_OPT_REFRESH_TIME:
     rt->refresh_time = atoi(arg + 2);  // strip "-r"
     return 0;
@@ -406,14 +560,44 @@ int FolveOptionHandling(void *data, const char *arg, int key,
     return 0;
   }
 
+  case FOLVE_OPT_RENDER_CACHE_DIR: {
+    const char *cache_dir = realpath(arg + 2, realpath_buf);  // strip "-c"
+    if (cache_dir != NULL) {
+      rt->render_cache_dir = cache_dir;
+    } else {
+      fprintf(stderr, "Invalid cache dir '%s': %s\n", arg + 2, strerror(errno));
+      rt->parameter_error = true;
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_RENDER_CACHE_SIZE: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value <= 0) {
+      fprintf(stderr, "-S: Invalid size %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->render_cache_mb = value;
+    }
+    return 0;
+  }
+
   case FOLVE_OPT_DEBUG:
     folve::EnableDebugLog(true);
     return 0;
 
-  case FOLVE_OPT_DEBUG_READDIR:
-    rt->readdir_dump_file = fopen(arg + 2, "w");
-    rlog.WriteInit();
+  case FOLVE_OPT_ACCESS_TRACE: {
+    FILE *out = fopen(arg + 2, "w");
+    if (out == NULL) {
+      fprintf(stderr, "-R: Can't write trace to %s: %s\n", arg + 2,
+              strerror(errno));
+      rt->parameter_error = true;
+    } else {
+      rt->access_trace = new AccessTrace(out);
+    }
     return 0;
+  }
 
   case FOLVE_OPT_GAPLESS:
     rt->fs->set_gapless_processing(true);
@@ -422,6 +606,86 @@ int FolveOptionHandling(void *data, const char *arg, int key,
   case FOLVE_OPT_TOPLEVEL_DIR_FILTER:
     rt->fs->set_toplevel_directory_is_filter(true);
     return 0;
+
+  case FOLVE_OPT_WARM_UP:
+    rt->fs->set_warm_up_filters(true);
+    return 0;
+
+  case FOLVE_OPT_ESTIMATE_SIZE:
+    rt->fs->set_estimate_output_size(true);
+    return 0;
+
+  case FOLVE_OPT_LATENCY_PROFILE:
+    rt->fs->processor_pool()->set_default_profile(PROFILE_LATENCY);
+    return 0;
+
+  case FOLVE_OPT_DITHER: {
+    ProcessorPool *pool = rt->fs->processor_pool();
+    pool->set_output_options(pool->output_options() | folve::PCM_DITHER);
+    return 0;
+  }
+
+  case FOLVE_OPT_SOFT_CLIP: {
+    ProcessorPool *pool = rt->fs->processor_pool();
+    pool->set_output_options(pool->output_options() | folve::PCM_SOFT_CLIP);
+    return 0;
+  }
+
+  case FOLVE_OPT_CPUS:
+    if (!folve::SetConversionCpus(arg + 2)) {
+      fprintf(stderr, "-a: Invalid list of cpus %s\n", arg + 2);
+      rt->parameter_error = true;
+    }
+    return 0;
+
+  case FOLVE_OPT_PLAYBACK_SCHEDULING: {
+    std::string error;
+    if (!folve::SetPlaybackScheduling(arg + 2, &error)) {
+      fprintf(stderr, "-q %s: %s\n", arg + 2, error.c_str());
+      rt->parameter_error = true;
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_OPEN_FILES: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 1) {
+      fprintf(stderr, "-k: Invalid number of files %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->handler_cache()->set_max_handlers(value);
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_ENCODER_PROFILE: {
+    const char *profile = arg + 2;
+    char *end;
+    const long level = strtol(profile, &end, 10);
+    if (strcmp(profile, "wav") == 0) {
+      rt->fs->set_uncompressed_output(true);
+    } else if (*profile != '\0' && *end == '\0' && level >= 0 && level <= 8) {
+      rt->fs->set_flac_compression_level(level);
+    } else {
+      fprintf(stderr, "-E: Expected FLAC level 0..8 or 'wav'; got %s\n",
+              profile);
+      rt->parameter_error = true;
+    }
+    return 0;
+  }
+
+  case FOLVE_OPT_OPEN_FILES_BYTES: {
+    char *end;
+    const long value = strtol(arg + 2, &end, 10);
+    if (*end != '\0' || value < 0) {
+      fprintf(stderr, "-K: Invalid size %s\n", arg + 2);
+      rt->parameter_error = true;
+    } else {
+      rt->fs->handler_cache()->set_max_bytes((off_t) value << 20);
+    }
+    return 0;
+  }
   }
   return 1;
 }
@@ -437,19 +701,40 @@ int main(int argc, char *argv[]) {
   static struct fuse_opt folve_options[] = {
     FUSE_OPT_KEY("-p ", FOLVE_OPT_PORT),
     FUSE_OPT_KEY("-b ", FOLVE_OPT_PREBUFFER),
+    FUSE_OPT_KEY("-j ", FOLVE_OPT_PREBUFFER_THREADS),
+    FUSE_OPT_KEY("-J ", FOLVE_OPT_CONVOLVER_THREADS),
     FUSE_OPT_KEY("-r ", FOLVE_OPT_REFRESH_TIME),
     FUSE_OPT_KEY("-C ", FOLVE_OPT_CONFIG),
     FUSE_OPT_KEY("-D",  FOLVE_OPT_DEBUG),
-    FUSE_OPT_KEY("-R ",  FOLVE_OPT_DEBUG_READDIR),
+    FUSE_OPT_KEY("-R ",  FOLVE_OPT_ACCESS_TRACE),
     FUSE_OPT_KEY("-O ",  FOLVE_OPT_OVERSIZE_PREDICT),
     FUSE_OPT_KEY("-P ",  FOLVE_OPT_PID_FILE),
     FUSE_OPT_KEY("-g",  FOLVE_OPT_GAPLESS),
     FUSE_OPT_KEY("-t",  FOLVE_OPT_TOPLEVEL_DIR_FILTER),
+    FUSE_OPT_KEY("-c ",  FOLVE_OPT_RENDER_CACHE_DIR),
+    FUSE_OPT_KEY("-S ",  FOLVE_OPT_RENDER_CACHE_SIZE),
+    FUSE_OPT_KEY("-w",  FOLVE_OPT_WARM_UP),
+    FUSE_OPT_KEY("-M ",  FOLVE_OPT_BUFFER_MEMORY),
+    FUSE_OPT_KEY("-e",  FOLVE_OPT_ESTIMATE_SIZE),
+    FUSE_OPT_KEY("-B ",  FOLVE_OPT_PREBUFFER_BUDGET),
+    FUSE_OPT_KEY("-L",  FOLVE_OPT_LATENCY_PROFILE),
+    FUSE_OPT_KEY("-k ",  FOLVE_OPT_OPEN_FILES),
+    FUSE_OPT_KEY("-K ",  FOLVE_OPT_OPEN_FILES_BYTES),
+    FUSE_OPT_KEY("-E ",  FOLVE_OPT_ENCODER_PROFILE),
+    FUSE_OPT_KEY("-T",  FOLVE_OPT_DITHER),
+    FUSE_OPT_KEY("-l",  FOLVE_OPT_SOFT_CLIP),
+    FUSE_OPT_KEY("-a ",  FOLVE_OPT_CPUS),
+    FUSE_OPT_KEY("-q ",  FOLVE_OPT_PLAYBACK_SCHEDULING),
     FUSE_OPT_END   // This fails to compile for fuse <= 2.8.1; get >= 2.8.4
   };
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   fuse_opt_parse(&args, &folve_rt, folve_options, FolveOptionHandling);
 
+  if (!folve_rt.render_cache_dir.empty()) {
+    folve_rt.fs->SetRenderCache(folve_rt.render_cache_dir,
+                                (off_t) folve_rt.render_cache_mb << 20);
+  }
+
   if (folve_rt.parameter_error || !folve_rt.fs->CheckInitialized()) {
     return usage(progname);
   }
@@ -471,6 +756,9 @@ int main(int argc, char *argv[]) {
 
   // Actual workhorse: reading a file and returning predicted file-size
   folve_operations.read      = folve_read;
+#if FUSE_VERSION >= 29
+  folve_operations.read_buf  = folve_read_buf;
+#endif
   folve_operations.fgetattr  = folve_fgetattr;
   folve_operations.getattr   = folve_getattr;
 
@@ -0,0 +1,463 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Converts a whole music library in one go, using all cores: the files are
+// read through a FolveFilesystem the same way the mounted filesystem would
+// serve them, and written to an output directory and/or the render cache
+// the filesystem serves from.
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "channel-ops.h"
+#include "convolve-file-handler.h"
+#include "file-handler-cache.h"
+#include "folve-filesystem.h"
+#include "render-cache.h"
+#include "util.h"
+
+using folve::CurrentTime;
+
+namespace {
+const size_t kReadSize = 128 << 10;
+const int kDefaultRenderCacheMiB = 4096;
+
+// Files converted one after another by the same worker. With gapless
+// processing, that is a whole directory, so that the filter can be handed
+// from one file to the next; otherwise single files.
+typedef std::vector<std::string> WorkUnit;   // Filesystem paths.
+
+// Each worker takes units from the front of its own queue; once that is
+// empty, it steals from the back of the others. Units of the same directory
+// start out in the same queue.
+class WorkQueues {
+public:
+  WorkQueues(const std::vector<WorkUnit> &units, int workers)
+    : count_(workers), queues_(new Queue[workers]) {
+    for (size_t i = 0; i < units.size(); ++i) {
+      queues_[i * workers / units.size()].units.push_back(&units[i]);
+    }
+  }
+  ~WorkQueues() { delete [] queues_; }
+
+  // Get the next unit for the given worker; NULL if all is done.
+  const WorkUnit *Next(int worker) {
+    for (int i = 0; i < count_; ++i) {
+      Queue &queue = queues_[(worker + i) % count_];
+      folve::MutexLock l(&queue.mutex);
+      if (queue.units.empty())
+        continue;
+      const WorkUnit *result;
+      if (i == 0) {
+        result = queue.units.front();
+        queue.units.pop_front();
+      } else {
+        result = queue.units.back();
+        queue.units.pop_back();
+      }
+      return result;
+    }
+    return NULL;  // Nothing queued anywhere; units are never added later.
+  }
+
+private:
+  struct Queue {
+    folve::Mutex mutex;
+    std::deque<const WorkUnit*> units;
+  };
+  const int count_;
+  Queue *const queues_;
+};
+
+struct Totals {
+  Totals() : converted(0), skipped(0), failed(0), bytes(0) {}
+  int converted;
+  int skipped;   // Not a sound file or already in the render cache.
+  int failed;
+  off_t bytes;
+};
+
+class Renderer {
+public:
+  Renderer(FolveFilesystem *fs, const std::string &output_dir,
+           WorkQueues *queues, int total_files)
+    : fs_(fs), output_dir_(output_dir), queues_(queues),
+      total_files_(total_files), done_files_(0) {}
+
+  // Work on the queue as the given worker until everything is done.
+  void Work(int worker);
+
+  const Totals &totals() const { return totals_; }
+
+private:
+  enum Result { CONVERTED, SKIPPED, FAILED };
+
+  // Read the file once from start to end, writing it to the output
+  // directory if we have one.
+  Result Render(const std::string &fs_path, off_t *bytes,
+                std::string *error);
+
+  FolveFilesystem *const fs_;
+  const std::string output_dir_;
+  WorkQueues *const queues_;
+  const int total_files_;
+
+  folve::Mutex mutex_;    // Protects the following.
+  int done_files_;
+  Totals totals_;
+};
+
+class WorkerThread : public folve::Thread {
+public:
+  // Low priority, so that the machine is still usable (or can still play
+  // music from the mounted filesystem) while converting all night.
+  WorkerThread(Renderer *renderer, int worker)
+    : folve::Thread(true), renderer_(renderer), worker_(worker) {}
+  virtual void Run() { renderer_->Work(worker_); }
+
+private:
+  Renderer *const renderer_;
+  const int worker_;
+};
+
+bool MakeDirectories(const std::string &path) {
+  for (std::string::size_type pos = path.find('/', 1);
+       ; pos = path.find('/', pos + 1)) {
+    const std::string dir = path.substr(0, pos);
+    if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+      return false;
+    if (pos == std::string::npos)
+      return true;
+  }
+}
+
+bool WriteAll(int fd, const char *buffer, size_t size) {
+  while (size > 0) {
+    const ssize_t w = write(fd, buffer, size);
+    if (w < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    buffer += w;
+    size -= w;
+  }
+  return true;
+}
+
+Renderer::Result Renderer::Render(const std::string &fs_path, off_t *bytes,
+                                  std::string *error) {
+  *bytes = 0;
+  FileHandler *handler = fs_->GetOrCreateHandler(fs_path.c_str());
+  if (handler == NULL) {
+    *error = strerror(errno);
+    return FAILED;
+  }
+  const bool converting = (dynamic_cast<ConvolveFileHandler*>(handler)
+                           != NULL);
+  // Without output directory, we're only here to fill the render cache.
+  if (output_dir_.empty() && !converting) {
+    fs_->Close(fs_path.c_str(), handler);
+    return SKIPPED;
+  }
+  int out = -1;
+  const std::string out_path = output_dir_ + fs_path;
+  if (!output_dir_.empty()) {
+    if (MakeDirectories(out_path.substr(0, out_path.find_last_of('/')))) {
+      out = open(out_path.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    }
+    if (out < 0) {
+      *error = out_path + ": " + strerror(errno);
+      fs_->Close(fs_path.c_str(), handler);
+      return FAILED;
+    }
+  }
+  char *buffer = new char[kReadSize];
+  int r;
+  bool success = true;
+  while ((r = handler->Read(buffer, kReadSize, *bytes)) > 0) {
+    if (out >= 0 && !WriteAll(out, buffer, r)) {
+      *error = out_path + ": " + strerror(errno);
+      success = false;
+      break;
+    }
+    *bytes += r;
+  }
+  delete [] buffer;
+  if (r < 0) {
+    *error = "Read error";
+    success = false;
+  }
+  if (out >= 0 && close(out) != 0 && success) {
+    *error = out_path + ": " + strerror(errno);
+    success = false;
+  }
+  if (!success && out >= 0) unlink(out_path.c_str());
+  // Once the handler retires from the recently used files, it goes
+  // to the render cache.
+  fs_->Close(fs_path.c_str(), handler);
+  if (!success) return FAILED;
+  return converting ? CONVERTED : SKIPPED;
+}
+
+void Renderer::Work(int worker) {
+  const WorkUnit *unit;
+  while ((unit = queues_->Next(worker)) != NULL) {
+    for (size_t i = 0; i < unit->size(); ++i) {
+      const std::string &fs_path = (*unit)[i];
+      const double start = CurrentTime();
+      off_t bytes;
+      std::string error;
+      const Result result = Render(fs_path, &bytes, &error);
+      folve::MutexLock l(&mutex_);
+      ++done_files_;
+      switch (result) {
+      case CONVERTED: ++totals_.converted; totals_.bytes += bytes; break;
+      case SKIPPED:   ++totals_.skipped; break;
+      case FAILED:    ++totals_.failed; break;
+      }
+      if (result == FAILED) {
+        fprintf(stderr, "[%d/%d] %s: %s\n", done_files_, total_files_,
+                fs_path.c_str(), error.c_str());
+      } else if (result == CONVERTED) {
+        printf("[%d/%d] %s (%.1fs)\n", done_files_, total_files_,
+               fs_path.c_str(), CurrentTime() - start);
+        fflush(stdout);
+      }
+    }
+  }
+}
+
+// Collect the files below "fs_dir" (a directory in the filesystem, "" for
+// the root) as work units. Skips hidden files and the "skip" directory.
+void CollectWork(const std::string &underlying_dir, const std::string &fs_dir,
+                 bool gapless, const std::string &skip,
+                 std::vector<WorkUnit> *units, int *file_count) {
+  const std::string dir = underlying_dir + fs_dir;
+  DIR *d = opendir(dir.c_str());
+  if (d == NULL) {
+    fprintf(stderr, "%s: %s\n", dir.c_str(), strerror(errno));
+    return;
+  }
+  std::vector<std::string> names;
+  struct dirent *entry;
+  while ((entry = readdir(d)) != NULL) {
+    if (entry->d_name[0] != '.') names.push_back(entry->d_name);
+  }
+  closedir(d);
+  std::sort(names.begin(), names.end());  // Gapless order.
+
+  WorkUnit files;
+  std::vector<std::string> subdirs;
+  for (size_t i = 0; i < names.size(); ++i) {
+    const std::string fs_path = fs_dir + "/" + names[i];
+    struct stat st;
+    if (stat((underlying_dir + fs_path).c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode)) {
+      if (underlying_dir + fs_path != skip) subdirs.push_back(fs_path);
+    } else if (S_ISREG(st.st_mode)) {
+      files.push_back(fs_path);
+    }
+  }
+  *file_count += files.size();
+  if (gapless && !files.empty()) {
+    units->push_back(files);
+  } else {
+    for (size_t i = 0; i < files.size(); ++i) {
+      units->push_back(WorkUnit(1, files[i]));
+    }
+  }
+  for (size_t i = 0; i < subdirs.size(); ++i) {
+    CollectWork(underlying_dir, subdirs[i], gapless, skip, units, file_count);
+  }
+}
+
+int usage(const char *prg) {
+  printf("usage: %s [options] <underlying-dir>\n", prg);
+  printf("Converts all files in the directory as folve would serve them.\n"
+         "Options (at least one of -o or -c is needed):\n"
+         "\t-C <cfg-dir> : Convolver base configuration directory.\n"
+         "\t               Default: demo-filters\n"
+         "\t-F <filter>  : Filter subdirectory to use. Default: the first "
+         "one.\n"
+         "\t-o <dir>     : Write converted files to this directory, "
+         "keeping the\n"
+         "\t               directory structure; other files are copied.\n"
+         "\t-c <dir>     : Store converted files in this render cache "
+         "directory,\n"
+         "\t               as given to folve -c.\n"
+         "\t-S <MebiByte>: Maximum size of the render cache. Default %d.\n"
+         "\t-j <threads> : Number of files converted in parallel. "
+         "Default: number of\n"
+         "\t               cpus.\n"
+         "\t-J <threads> : Number of threads convolving each file. "
+         "Default 1.\n"
+         "\t-g           : Gapless convolving alphabetically adjacent "
+         "files.\n"
+         "\t               Needs -o; such files don't go into the render "
+         "cache.\n"
+         "\t-E <level>   : FLAC compression level 0..8 or 'wav', as with "
+         "folve -E.\n"
+         "\t-T           : Add TPDF dither, as with folve -T.\n"
+         "\t-l           : Soft-clip, as with folve -l.\n",
+         kDefaultRenderCacheMiB);
+  return 1;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string config_dir = "demo-filters";
+  const char *filter = NULL;
+  std::string output_dir;
+  std::string cache_dir;
+  int cache_mb = kDefaultRenderCacheMiB;
+  int workers = sysconf(_SC_NPROCESSORS_ONLN);
+  int convolver_threads = 1;
+  bool gapless = false;
+  const char *encoder_profile = NULL;
+  int output_options = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "C:F:o:c:S:j:J:gE:Tl")) != -1) {
+    switch (opt) {
+    case 'C': config_dir = optarg; break;
+    case 'F': filter = optarg; break;
+    case 'o': output_dir = optarg; break;
+    case 'c': cache_dir = optarg; break;
+    case 'S': cache_mb = atoi(optarg); break;
+    case 'j': workers = atoi(optarg); break;
+    case 'J': convolver_threads = atoi(optarg); break;
+    case 'g': gapless = true; break;
+    case 'E': encoder_profile = optarg; break;
+    case 'T': output_options |= folve::PCM_DITHER; break;
+    case 'l': output_options |= folve::PCM_SOFT_CLIP; break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (argc - optind != 1 || (output_dir.empty() && cache_dir.empty())
+      || workers < 1 || convolver_threads < 1 || cache_mb <= 0)
+    return usage(argv[0]);
+  if (gapless && output_dir.empty()) {
+    fprintf(stderr, "-g: Gapless joined files are not stored in the render "
+            "cache; use it with -o.\n");
+    return 1;
+  }
+
+  char realpath_buf[PATH_MAX];
+  if (realpath(argv[optind], realpath_buf) == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  const std::string underlying_dir = realpath_buf;
+  if (!output_dir.empty()) {
+    if (!MakeDirectories(output_dir)
+        || realpath(output_dir.c_str(), realpath_buf) == NULL) {
+      perror(output_dir.c_str());
+      return 1;
+    }
+    output_dir = realpath_buf;
+  }
+
+  FolveFilesystem fs;
+  fs.set_underlying_dir(underlying_dir);
+  fs.SetBaseConfigDir(config_dir);
+  fs.set_gapless_processing(gapless);
+  fs.set_pre_buffer_size(-1);  // We read as fast as we can anyway.
+  fs.processor_pool()->set_convolver_threads(convolver_threads);
+  fs.processor_pool()->set_output_options(output_options);
+  // Room for everyone's open file and the next one prepared for gapless.
+  if (fs.handler_cache()->max_handlers() < (size_t) 2 * workers + 2) {
+    fs.handler_cache()->set_max_handlers(2 * workers + 2);
+  }
+  if (encoder_profile != NULL) {
+    char *end;
+    const long level = strtol(encoder_profile, &end, 10);
+    if (strcmp(encoder_profile, "wav") == 0) {
+      fs.set_uncompressed_output(true);
+    } else if (*encoder_profile != '\0' && *end == '\0'
+               && level >= 0 && level <= 8) {
+      fs.set_flac_compression_level(level);
+    } else {
+      fprintf(stderr, "-E: Expected FLAC level 0..8 or 'wav'; got %s\n",
+              encoder_profile);
+      return 1;
+    }
+  }
+  if (!cache_dir.empty()) {
+    fs.SetRenderCache(cache_dir, (off_t) cache_mb << 20);
+  }
+  if (!fs.CheckInitialized())
+    return 1;
+  fs.SetupInitialConfig();
+  if (filter != NULL && !fs.SwitchCurrentConfigDir(filter)
+      && fs.current_config_subdir() != filter) {
+    fprintf(stderr, "Invalid filter '%s'\n", filter);
+    return 1;
+  }
+  if (fs.current_config_subdir().empty()) {
+    fprintf(stderr, "No filter in %s\n", config_dir.c_str());
+    return 1;
+  }
+
+  std::vector<WorkUnit> units;
+  int file_count = 0;
+  CollectWork(underlying_dir, "", gapless, output_dir, &units, &file_count);
+  if (units.empty()) {
+    fprintf(stderr, "No files in %s\n", underlying_dir.c_str());
+    return 1;
+  }
+  workers = std::min(workers, (int) units.size());
+  printf("Converting %d files with filter '%s' in %d threads.\n",
+         file_count, fs.current_config_subdir().c_str(), workers);
+
+  const double start = CurrentTime();
+  WorkQueues queues(units, workers);
+  Renderer renderer(&fs, output_dir, &queues, file_count);
+  std::vector<WorkerThread*> threads;
+  for (int i = 0; i < workers; ++i) {
+    threads.push_back(new WorkerThread(&renderer, i));
+    threads.back()->Start();
+  }
+  for (int i = 0; i < workers; ++i) {
+    threads[i]->Join();
+    delete threads[i];
+  }
+  // Retired handlers store their result in the render cache.
+  fs.handler_cache()->EvictAllIdle();
+  if (fs.render_cache() != NULL) {
+    fs.render_cache()->WaitForPendingStores();
+  }
+
+  const Totals &totals = renderer.totals();
+  const double duration = CurrentTime() - start;
+  printf("Converted %d files (%.1f MiB) in %.1fs; %d skipped, %d failed.\n",
+         totals.converted, totals.bytes / 1048576.0, duration,
+         totals.skipped, totals.failed);
+  return totals.failed > 0 ? 1 : 0;
+}
@@ -0,0 +1,307 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Replays an access trace recorded with 'folve -R <file>' against a
+// FolveFilesystem without FUSE and reports the latency of the calls; so
+// that the access patterns of a particular client can be reproduced.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "access-trace.h"
+#include "directory-cache.h"
+#include "file-handler.h"
+#include "folve-filesystem.h"
+#include "util.h"
+
+using folve::CurrentTime;
+
+namespace {
+struct OpStats {
+  OpStats() : errors(0) {}
+  std::vector<double> replay_micros;
+  std::vector<double> recorded_micros;
+  int errors;   // Calls that failed in the replay, but not in the trace.
+};
+
+double Percentile(std::vector<double> *values, double p) {
+  if (values->empty()) return 0;
+  const size_t index = std::min(values->size() - 1,
+                                (size_t) (p * values->size()));
+  std::nth_element(values->begin(), values->begin() + index, values->end());
+  return (*values)[index];
+}
+
+// Does the same as the corresponding callback in folve-main.cc
+class Replayer {
+public:
+  Replayer(FolveFilesystem *fs) : fs_(fs), unknown_handles_(0) {
+    buffer_size_ = 128 << 10;
+    buffer_ = new char[buffer_size_];
+  }
+  ~Replayer() {
+    for (HandleMap::iterator it = handles_.begin(); it != handles_.end(); ++it)
+      fs_->Close(it->second.path.c_str(), it->second.handler);
+    delete [] buffer_;
+  }
+
+  // Execute the call. Returns the result as the FUSE callback would.
+  int Run(const AccessTrace::Event &event);
+
+  // Number of calls referring to files we couldn't open.
+  int unknown_handles() const { return unknown_handles_; }
+
+private:
+  struct OpenFile {
+    OpenFile() : handler(NULL) {}
+    std::string path;
+    FileHandler *handler;
+  };
+  // The handle recorded is the FileHandler, which concurrent opens of the
+  // same file share; so there is an entry for each open.
+  typedef std::multimap<uint64_t, OpenFile> HandleMap;
+
+  int GetAttr(const char *path);
+  int ReadDir(const char *path);
+
+  FolveFilesystem *const fs_;
+  HandleMap handles_;   // Handle in the trace -> our open file.
+  char *buffer_;
+  size_t buffer_size_;
+  int unknown_handles_;
+};
+
+int Replayer::GetAttr(const char *path) {
+  struct stat st;
+  if (fs_->StatByFilename(path, &st) == 0)
+    return 0;
+  if (fs_->directory_cache()->Lstat(fs_->GetUnderlyingFile(path), &st) != 0)
+    return -errno;
+  return 0;
+}
+
+int Replayer::ReadDir(const char *path) {
+  if (strcmp(path, "/") == 0 && fs_->toplevel_directory_is_filter()) {
+    return fs_->GetAvailableConfigDirs().size();
+  }
+  std::vector<DirectoryCache::Entry> entries;
+  if (!fs_->directory_cache()->GetEntries(fs_->GetUnderlyingFile(path),
+                                          &entries))
+    return -errno;
+  return entries.size();
+}
+
+int Replayer::Run(const AccessTrace::Event &event) {
+  const char *path = event.path.c_str();
+  switch (event.op) {
+  case AccessTrace::GETATTR:
+    return GetAttr(path);
+
+  case AccessTrace::READDIR:
+    return ReadDir(path);
+
+  case AccessTrace::OPEN: {
+    FileHandler *handler = fs_->GetOrCreateHandler(path);
+    if (handler == NULL)
+      return -errno;
+    OpenFile file;
+    file.path = event.path;
+    file.handler = handler;
+    handles_.insert(std::make_pair(event.handle, file));
+    return 0;
+  }
+
+  default:
+    break;
+  }
+
+  // Calls on open files.
+  HandleMap::iterator found = handles_.find(event.handle);
+  if (found == handles_.end()) {
+    ++unknown_handles_;
+    return -EBADF;
+  }
+  FileHandler *handler = found->second.handler;
+  switch (event.op) {
+  case AccessTrace::READ:
+    if (event.size > buffer_size_) {
+      delete [] buffer_;
+      buffer_size_ = event.size;
+      buffer_ = new char[buffer_size_];
+    }
+    {
+      folve::PlaybackRead playback;  // As the FUSE read would be.
+      return handler->Read(buffer_, event.size, event.offset);
+    }
+
+  case AccessTrace::FGETATTR: {
+    struct stat st;
+    return handler->Stat(&st);
+  }
+
+  case AccessTrace::RELEASE:   // Only one of the opens.
+    fs_->Close(found->second.path.c_str(), handler);
+    handles_.erase(found);
+    return 0;
+
+  default:
+    return -ENOSYS;
+  }
+}
+
+bool ReadTrace(const char *filename, std::vector<AccessTrace::Event> *events) {
+  FILE *in = fopen(filename, "r");
+  if (in == NULL) {
+    perror(filename);
+    return false;
+  }
+  char line[PATH_MAX + 256];
+  AccessTrace::Event event;
+  while (fgets(line, sizeof(line), in) != NULL) {
+    if (AccessTrace::ParseLine(line, &event)) events->push_back(event);
+  }
+  fclose(in);
+  return true;
+}
+
+int usage(const char *prg) {
+  printf("usage: %s [options] <underlying-dir> <trace-file>\n", prg);
+  printf("Replays a trace of file accesses recorded with 'folve -R' "
+         "and reports\nthe latency of each kind of call.\n"
+         "Options:\n"
+         "\t-C <cfg-dir> : Convolver base configuration directory.\n"
+         "\t               Default: demo-filters\n"
+         "\t-F <filter>  : Filter subdirectory to use. Default: the first "
+         "one.\n"
+         "\t-t           : Toplevel directories are filters, as with "
+         "'folve -t'.\n"
+         "\t-g           : Gapless processing, as with 'folve -g'.\n"
+         "\t-b <KibiByte>: Predictive pre-buffer. Default 128; -1 is off.\n"
+         "\t-s <speed>   : Replay speed relative to the recording; 0 means\n"
+         "\t               as fast as possible. Default 1.\n");
+  return 1;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  std::string config_dir = "demo-filters";
+  const char *filter = NULL;
+  bool toplevel_filter = false;
+  bool gapless = false;
+  int pre_buffer_kb = 128;
+  double speed = 1.0;
+  int opt;
+  while ((opt = getopt(argc, argv, "C:F:tgb:s:")) != -1) {
+    switch (opt) {
+    case 'C': config_dir = optarg; break;
+    case 'F': filter = optarg; break;
+    case 't': toplevel_filter = true; break;
+    case 'g': gapless = true; break;
+    case 'b': pre_buffer_kb = atoi(optarg); break;
+    case 's': speed = atof(optarg); break;
+    default: return usage(argv[0]);
+    }
+  }
+  if (argc - optind != 2 || speed < 0)
+    return usage(argv[0]);
+
+  char realpath_buf[PATH_MAX];
+  if (realpath(argv[optind], realpath_buf) == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  std::vector<AccessTrace::Event> events;
+  if (!ReadTrace(argv[optind + 1], &events))
+    return 1;
+  if (events.empty()) {
+    fprintf(stderr, "No events in %s\n", argv[optind + 1]);
+    return 1;
+  }
+
+  FolveFilesystem fs;
+  fs.set_underlying_dir(realpath_buf);
+  fs.SetBaseConfigDir(config_dir);
+  fs.set_toplevel_directory_is_filter(toplevel_filter);
+  fs.set_gapless_processing(gapless);
+  fs.set_pre_buffer_size(pre_buffer_kb < 0 ? -1 : pre_buffer_kb * (1 << 10));
+  if (!fs.CheckInitialized())
+    return 1;
+  fs.SetupInitialConfig();
+  if (filter != NULL && !fs.SwitchCurrentConfigDir(filter)
+      && fs.current_config_subdir() != filter) {
+    fprintf(stderr, "Invalid filter '%s'\n", filter);
+    return 1;
+  }
+
+  // Calls are replayed one after another in the order of the trace,
+  // starting at the recorded time if we're not already late.
+  OpStats stats[AccessTrace::NUM_OPS];
+  Replayer replayer(&fs);
+  const double start = CurrentTime();
+  const double trace_start = events[0].time;
+  for (size_t i = 0; i < events.size(); ++i) {
+    const AccessTrace::Event &event = events[i];
+    if (speed > 0) {
+      const double wait = start + (event.time - trace_start) / speed
+        - CurrentTime();
+      if (wait > 0) usleep(wait * 1e6);
+    }
+    const double call_start = CurrentTime();
+    const int result = replayer.Run(event);
+    OpStats &op_stats = stats[event.op];
+    op_stats.replay_micros.push_back((CurrentTime() - call_start) * 1e6);
+    op_stats.recorded_micros.push_back(event.micros);
+    if (result < 0 && event.result >= 0) ++op_stats.errors;
+  }
+  const double total = CurrentTime() - start;
+
+  printf("%-9s %7s %6s %10s %10s %10s %10s %12s %12s\n",
+         "op", "calls", "errors", "p50-us", "p90-us", "p99-us", "max-us",
+         "rec-p50-us", "rec-p99-us");
+  for (int op = 0; op < AccessTrace::NUM_OPS; ++op) {
+    OpStats &s = stats[op];
+    if (s.replay_micros.empty()) continue;
+    printf("%-9s %7d %6d %10.0f %10.0f %10.0f %10.0f %12.0f %12.0f\n",
+           AccessTrace::OpName((AccessTrace::Op) op),
+           (int) s.replay_micros.size(), s.errors,
+           Percentile(&s.replay_micros, 0.5),
+           Percentile(&s.replay_micros, 0.9),
+           Percentile(&s.replay_micros, 0.99),
+           Percentile(&s.replay_micros, 1.0),
+           Percentile(&s.recorded_micros, 0.5),
+           Percentile(&s.recorded_micros, 0.99));
+  }
+  printf("%zu calls in %.3fs (recorded: %.3fs)\n", events.size(), total,
+         events.back().time - trace_start);
+  if (replayer.unknown_handles() > 0) {
+    printf("%d calls on files that couldn't be opened.\n",
+           replayer.unknown_handles());
+  }
+  return 0;
+}
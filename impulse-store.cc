@@ -0,0 +1,157 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "impulse-store.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <algorithm>
+
+#include "zita-audiofile.h"
+
+using folve::DLogf;
+
+struct ImpulseStore::Entry {
+  time_t mtime;
+  off_t size;
+  int rate;
+  int channels;
+  int frames;
+  std::vector<float> samples;  // Interleaved.
+  int refcount;
+};
+
+ImpulseStore::Holder::Holder() {}
+
+ImpulseStore::Holder::~Holder() {
+  for (size_t i = 0; i < used_.size(); ++i) {
+    ImpulseStore::instance()->Release(used_[i]);
+  }
+}
+
+const float *ImpulseStore::Holder::GetFile(const char *path,
+                                           int *rate, int *channels,
+                                           int *frames) {
+  const Entry *entry = ImpulseStore::instance()->Acquire(path);
+  if (entry == NULL) return NULL;
+  used_.push_back(entry);
+  if (std::find(files_.begin(), files_.end(), path) == files_.end()) {
+    files_.push_back(path);  // Each convolver thread asks for its own.
+  }
+  *rate = entry->rate;
+  *channels = entry->channels;
+  *frames = entry->frames;
+  return &entry->samples[0];
+}
+
+ImpulseStore *ImpulseStore::instance() {
+  static ImpulseStore *store = new ImpulseStore();
+  return store;
+}
+
+ImpulseStore::Entry *ImpulseStore::ReadFile(const std::string &path) {
+  Audiofile audio;
+  if (audio.open_read(path.c_str()) != 0)
+    return NULL;
+  Entry *result = new Entry();
+  result->rate = audio.rate();
+  result->channels = audio.chan();
+  result->frames = audio.size();
+  result->refcount = 0;
+  result->samples.resize((size_t) result->frames * result->channels);
+  int pos = 0;
+  while (pos < result->frames) {
+    const int r = audio.read(&result->samples[pos * result->channels],
+                             result->frames - pos);
+    if (r <= 0) break;
+    pos += r;
+  }
+  audio.close();
+  if (pos == 0) {
+    delete result;
+    return NULL;
+  }
+  result->frames = pos;
+  return result;
+}
+
+const ImpulseStore::Entry *ImpulseStore::Acquire(const std::string &path) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0)
+    return NULL;
+  {
+    folve::MutexLock l(&mutex_);
+    FileMap::iterator found = files_.find(path);
+    if (found != files_.end()) {
+      Entry *entry = found->second;
+      if (entry->mtime == st.st_mtime && entry->size == st.st_size) {
+        ++entry->refcount;
+        return entry;
+      }
+      // Outdated. Processors still using it keep it alive.
+      files_.erase(found);
+      if (entry->refcount == 0) delete entry;
+    }
+  }
+
+  // Don't hold the lock while reading; this is the slow part.
+  Entry *entry = ReadFile(path);
+  if (entry == NULL)
+    return NULL;
+  entry->mtime = st.st_mtime;
+  entry->size = st.st_size;
+  entry->refcount = 1;
+  DLogf("Impulse store: read %s (%d frames, %d channels)", path.c_str(),
+        entry->frames, entry->channels);
+
+  folve::MutexLock l(&mutex_);
+  std::pair<FileMap::iterator, bool> ins
+    = files_.insert(std::make_pair(path, entry));
+  if (!ins.second) {
+    Entry *other = ins.first->second;
+    if (other->mtime == entry->mtime && other->size == entry->size) {
+      // Someone else was faster reading the same file. Use theirs.
+      delete entry;
+      ++other->refcount;
+      return other;
+    }
+    if (other->refcount == 0) delete other;
+    ins.first->second = entry;
+  }
+  return entry;
+}
+
+void ImpulseStore::Release(const Entry *const_entry) {
+  Entry *entry = const_cast<Entry*>(const_entry);
+  folve::MutexLock l(&mutex_);
+  if (--entry->refcount > 0)
+    return;
+  // Nobody is configuring with it anymore. The processors keep their
+  // impulses in their own convolvers, so there is no need to hold on to the
+  // samples.
+  FileMap::iterator found = files_.begin();
+  for (/**/; found != files_.end(); ++found) {
+    if (found->second == entry) {
+      files_.erase(found);
+      break;
+    }
+  }
+  delete entry;
+}
@@ -0,0 +1,81 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_IMPULSE_STORE_H
+#define FOLVE_IMPULSE_STORE_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "util.h"
+#include "zita-config.h"
+
+// Decoded impulse response files, shared between all SoundProcessors.
+//
+// Every processor of a filter configuration (each convolver thread, warm-up
+// of several at once...) needs the same impulse responses. Instead of
+// reading and decoding the files for each of them, they are read once
+// and kept as long as processors set up with them are being configured;
+// the convolvers make their own copy, so the decoded data is dropped right
+// after. Files are identified by their path; if modification time or size
+// change, they are read again.
+// This class is thread-safe.
+class ImpulseStore {
+private:
+  struct Entry;
+
+public:
+  // All impulse files used while configuring one SoundProcessor. Hands out
+  // the shared data to the configuration parser and releases it again when
+  // deleted, which should be as soon as the configuration is done.
+  class Holder : public ImpulseSource {
+  public:
+    Holder();
+    virtual ~Holder();
+
+    virtual const float *GetFile(const char *path,
+                                 int *rate, int *channels, int *frames);
+
+    // Paths of the files handed out.
+    const std::vector<std::string> &files() const { return files_; }
+
+  private:
+    std::vector<const Entry*> used_;
+    std::vector<std::string> files_;
+  };
+
+  static ImpulseStore *instance();
+
+private:
+  ImpulseStore() {}
+
+  // Read and decode the given audio file. Returns NULL on failure.
+  static Entry *ReadFile(const std::string &path);
+
+  // Get the entry for the given file, reading it if needed.
+  // Returns NULL if the file can't be read.
+  const Entry *Acquire(const std::string &path);
+  void Release(const Entry *entry);
+
+  folve::Mutex mutex_;
+  typedef std::map<std::string, Entry*> FileMap;
+  FileMap files_;
+};
+
+#endif  // FOLVE_IMPULSE_STORE_H
@@ -0,0 +1,190 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "metrics.h"
+
+#include <string.h>
+#include <time.h>
+
+#include "util.h"
+
+using folve::Appendf;
+
+// Linked list of all metrics. Plain pointer, so that it is initialized
+// before any of the static metric objects register themselves.
+static folve::Metric *metric_list = NULL;
+
+namespace folve {
+namespace metrics {
+Counter bytes_produced("bytes_produced_total",
+                       "Bytes written to conversion buffers.");
+Counter processor_pool_hits("processor_pool_hits_total",
+                            "Sound processors taken from the pool.");
+Counter processor_pool_misses("processor_pool_misses_total",
+                              "Sound processors that had to be created.");
+Counter processor_pool_outdated("processor_pool_outdated_total",
+                                "Pooled sound processors discarded because "
+                                "their configuration changed.");
+Counter processor_pool_rebuilds("processor_pool_rebuilds_total",
+                                "Sound processors created in the background "
+                                "after their configuration changed.");
+Counter shared_decode_frames("shared_decode_frames_total",
+                             "Input frames taken from another conversion's "
+                             "decoding of the same file.");
+Counter status_pages_rendered("status_pages_rendered_total",
+                              "HTML status pages created; browsers "
+                              "refreshing within the refresh interval get "
+                              "a cached one.");
+Histogram process_time("process_seconds",
+                       "Convolving one fragment in SoundProcessor.");
+Histogram encode_time("encode_seconds",
+                      "Encoding output with one sf_writef_*() call.");
+Histogram fill_wait_time("fill_wait_seconds",
+                         "Time waiting in ConversionBuffer::FillUntil() for "
+                         "data to be produced.");
+Histogram fuse_read_time("fuse_read_seconds",
+                         "Service time of FUSE read() calls.");
+Histogram input_read_time("input_read_seconds",
+                          "Reading one chunk of an original sound file.");
+}  // namespace metrics
+}  // namespace folve
+
+int64_t folve::MonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+folve::Metric::Metric(const char *name, const char *help)
+  : name_(name), help_(help), next_(NULL) {
+  // Keep in order of definition. Only a handful, so just walk the list.
+  Metric **pos = &metric_list;
+  while (*pos) pos = &(*pos)->next_;
+  *pos = this;
+}
+
+int folve::Metric::ThreadShard() {
+  // Threads get their shard round-robin the first time they come by.
+  static int next_shard = 0;
+  static __thread int thread_shard = -1;
+  if (thread_shard < 0) {
+    thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED)
+      % kShards;
+  }
+  return thread_shard;
+}
+
+int64_t folve::Counter::Value() const {
+  int64_t result = 0;
+  for (int i = 0; i < kShards; ++i) {
+    result += __atomic_load_n(&shards_[i].value, __ATOMIC_RELAXED);
+  }
+  return result;
+}
+
+void folve::Counter::AppendPrometheus(std::string *out) const {
+  Appendf(out, "folve_%s %lld\n", name(), (long long) Value());
+}
+
+void folve::Counter::AppendJson(std::string *out) const {
+  Appendf(out, "%lld", (long long) Value());
+}
+
+folve::Histogram::Histogram(const char *name, const char *help)
+  : Metric(name, help) {
+  memset(shards_, 0, sizeof(shards_));
+}
+
+void folve::Histogram::Record(int64_t micros) {
+  if (micros < 0) micros = 0;
+  // Smallest i with micros <= 2^i.
+  int bucket = (micros <= 1) ? 0 : 64 - __builtin_clzll(micros - 1);
+  if (bucket >= kBuckets) bucket = kBuckets - 1;
+  Shard *const shard = &shards_[ThreadShard()];
+  __atomic_add_fetch(&shard->count, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shard->sum_micros, micros, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shard->buckets[bucket], 1, __ATOMIC_RELAXED);
+}
+
+void folve::Histogram::GetTotal(Shard *total) const {
+  memset(total, 0, sizeof(*total));
+  for (int i = 0; i < kShards; ++i) {
+    const Shard &s = shards_[i];
+    total->count += __atomic_load_n(&s.count, __ATOMIC_RELAXED);
+    total->sum_micros += __atomic_load_n(&s.sum_micros, __ATOMIC_RELAXED);
+    for (int b = 0; b < kBuckets; ++b) {
+      total->buckets[b] += __atomic_load_n(&s.buckets[b], __ATOMIC_RELAXED);
+    }
+  }
+}
+
+void folve::Histogram::AppendPrometheus(std::string *out) const {
+  Shard total;
+  GetTotal(&total);
+  int64_t cumulative = 0;
+  for (int b = 0; b < kBuckets - 1; ++b) {
+    cumulative += total.buckets[b];
+    Appendf(out, "folve_%s_bucket{le=\"%.7g\"} %lld\n", name(),
+            (1LL << b) / 1e6, (long long) cumulative);
+  }
+  // Samples might have been recorded while we were looking; make sure
+  // the total is at least the sum of the buckets.
+  cumulative += total.buckets[kBuckets - 1];
+  const int64_t count = cumulative > total.count ? cumulative : total.count;
+  Appendf(out, "folve_%s_bucket{le=\"+Inf\"} %lld\n", name(),
+          (long long) count);
+  Appendf(out, "folve_%s_sum %.6f\n", name(), total.sum_micros / 1e6);
+  Appendf(out, "folve_%s_count %lld\n", name(), (long long) count);
+}
+
+void folve::Histogram::AppendJson(std::string *out) const {
+  Shard total;
+  GetTotal(&total);
+  Appendf(out, "{\"count\":%lld,\"sum_seconds\":%.6f,\"buckets\":[",
+          (long long) total.count, total.sum_micros / 1e6);
+  // Only up to the last non-empty bucket to keep it compact.
+  int last = kBuckets - 1;
+  while (last >= 0 && total.buckets[last] == 0) --last;
+  for (int b = 0; b <= last; ++b) {
+    if (b == kBuckets - 1) {
+      Appendf(out, "%s{\"le\":null,\"count\":%lld}", b > 0 ? "," : "",
+              (long long) total.buckets[b]);
+    } else {
+      Appendf(out, "%s{\"le\":%.7g,\"count\":%lld}", b > 0 ? "," : "",
+              (1LL << b) / 1e6, (long long) total.buckets[b]);
+    }
+  }
+  out->append("]}");
+}
+
+void folve::AppendMetricsPrometheus(std::string *out) {
+  for (const Metric *m = metric_list; m != NULL; m = m->next_) {
+    Appendf(out, "# HELP folve_%s %s\n", m->name_, m->help_);
+    Appendf(out, "# TYPE folve_%s %s\n", m->name_, m->type());
+    m->AppendPrometheus(out);
+  }
+}
+
+void folve::AppendMetricsJson(std::string *out) {
+  out->append("{");
+  for (const Metric *m = metric_list; m != NULL; m = m->next_) {
+    Appendf(out, "%s\"%s\":", m == metric_list ? "" : ",", m->name_);
+    m->AppendJson(out);
+  }
+  out->append("}");
+}
@@ -0,0 +1,143 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_METRICS_H
+#define FOLVE_METRICS_H
+
+#include <stdint.h>
+#include <string>
+
+// Counters and latency histograms that are cheap enough to be updated on the
+// hot path. Each thread updates its own shard, so there is no contention;
+// values are summed up when exported.
+namespace folve {
+  // Microseconds of a monotonic clock.
+  int64_t MonotonicMicros();
+
+  class Metric {
+  public:
+    // "name" and "help" need to be static strings.
+    Metric(const char *name, const char *help);
+    virtual ~Metric() {}
+
+    const char *name() const { return name_; }
+
+    // Prometheus type of this metric.
+    virtual const char *type() const = 0;
+
+    // Append in Prometheus text format, prefixed with folve_.
+    virtual void AppendPrometheus(std::string *out) const = 0;
+
+    // Append as JSON value.
+    virtual void AppendJson(std::string *out) const = 0;
+
+  protected:
+    static const int kShards = 16;
+    static int ThreadShard();
+
+  private:
+    friend void AppendMetricsPrometheus(std::string *out);
+    friend void AppendMetricsJson(std::string *out);
+    const char *const name_;
+    const char *const help_;
+    Metric *next_;   // All metrics in a list.
+  };
+
+  class Counter : public Metric {
+  public:
+    Counter(const char *name, const char *help) : Metric(name, help) {
+      for (int i = 0; i < kShards; ++i) shards_[i].value = 0;
+    }
+
+    void Add(int64_t n) {
+      __atomic_add_fetch(&shards_[ThreadShard()].value, n, __ATOMIC_RELAXED);
+    }
+    int64_t Value() const;
+
+    virtual const char *type() const { return "counter"; }
+    virtual void AppendPrometheus(std::string *out) const;
+    virtual void AppendJson(std::string *out) const;
+
+  private:
+    struct Shard {
+      int64_t value;
+    } __attribute__((aligned(64)));
+    Shard shards_[kShards];
+  };
+
+  // Histogram of durations in buckets of powers of two microseconds.
+  class Histogram : public Metric {
+  public:
+    Histogram(const char *name, const char *help);
+
+    void Record(int64_t micros);
+
+    virtual const char *type() const { return "histogram"; }
+    virtual void AppendPrometheus(std::string *out) const;
+    virtual void AppendJson(std::string *out) const;
+
+  private:
+    // Bucket i counts values <= 2^i usec; the last one everything beyond.
+    static const int kBuckets = 28;
+    struct Shard {
+      int64_t count;
+      int64_t sum_micros;
+      int64_t buckets[kBuckets];
+    } __attribute__((aligned(64)));
+
+    // Sum up all shards.
+    void GetTotal(Shard *total) const;
+
+    Shard shards_[kShards];
+  };
+
+  // Records the time of its lifetime in the given histogram.
+  class ScopedTimer {
+  public:
+    explicit ScopedTimer(Histogram *h) : histogram_(h),
+                                         start_(MonotonicMicros()) {}
+    ~ScopedTimer() { histogram_->Record(MonotonicMicros() - start_); }
+  private:
+    Histogram *const histogram_;
+    const int64_t start_;
+  };
+
+  // Append all metrics in Prometheus text format.
+  void AppendMetricsPrometheus(std::string *out);
+
+  // Append all metrics as JSON object with the metric names as keys.
+  void AppendMetricsJson(std::string *out);
+
+  // The metrics we're collecting.
+  namespace metrics {
+    extern Counter bytes_produced;
+    extern Counter processor_pool_hits;
+    extern Counter processor_pool_misses;
+    extern Counter processor_pool_outdated;
+    extern Counter processor_pool_rebuilds;
+    extern Counter shared_decode_frames;
+    extern Counter status_pages_rendered;
+    extern Histogram process_time;
+    extern Histogram encode_time;
+    extern Histogram fill_wait_time;
+    extern Histogram fuse_read_time;
+    extern Histogram input_read_time;
+  }
+}  // namespace folve
+
+#endif  // FOLVE_METRICS_H
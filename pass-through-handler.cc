@@ -36,7 +36,6 @@ PassThroughHandler::PassThroughHandler(int filedes, const std::string &filter_id
   DLogf("Creating PassThrough filter for '%s'", known_stats.filename.c_str());
   struct stat st;
   file_size_ = (Stat(&st) == 0) ? st.st_size : -1;
-  info_stats_.filter_dir = "";  // pass through.
 }
 
 PassThroughHandler::~PassThroughHandler() { close(filedes_); }
@@ -49,6 +48,19 @@ int PassThroughHandler::Read(char *buf, size_t size, off_t offset) {
   return result;
 }
 
+bool PassThroughHandler::GetFileRegion(size_t size, off_t offset,
+                                       int *fd, off_t *fd_offset,
+                                       size_t *available) {
+  if (file_size_ >= 0) {
+    size = std::max<off_t>(0, std::min<off_t>(size, file_size_ - offset));
+  }
+  *fd = filedes_;
+  *fd_offset = offset;
+  *available = size;
+  max_accessed_ = std::max<off_t>(max_accessed_, offset + size);
+  return true;
+}
+
 int PassThroughHandler::Stat(struct stat *st) {
   return fstat(filedes_, st);
 }
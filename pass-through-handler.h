@@ -22,7 +22,8 @@
 
 // Very simple file handler that just passes through the original file.
 // Used for everything that is not a sound-file or for which no filter
-// configuration could be found.
+// configuration could be found. Also used to serve already convolved files
+// from the render cache.
 class PassThroughHandler : public FileHandler {
 public:
   PassThroughHandler(int filedes, const std::string &filter_id,
@@ -30,6 +31,8 @@ public:
   ~PassThroughHandler();
 
   virtual int Read(char *buf, size_t size, off_t offset);
+  virtual bool GetFileRegion(size_t size, off_t offset,
+                             int *fd, off_t *fd_offset, size_t *available);
   virtual int Stat(struct stat *st);
   virtual void GetHandlerStatus(HandlerStats *stats);
 
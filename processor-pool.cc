@@ -16,22 +16,47 @@
 
 #include "processor-pool.h"
 
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <vector>
 
+#include "metrics.h"
 #include "sound-processor.h"
 #include "util.h"
+#include "zita-config.h"
 
 using folve::StringPrintf;
 using folve::DLogf;
 
+// Seconds to wait after a configuration change before rebuilding
+// processors for it.
+static const double kRebuildDelay = 1.0;
+
+class ProcessorPool::WarmUpThread : public folve::Thread {
+public:
+  WarmUpThread(ProcessorPool *pool) : pool_(pool) {}
+  virtual void Run() {
+    folve::PinToConversionCpus();  // Convolver threads inherit this.
+    pool_->ProcessWarmUpQueue();
+  }
+
+private:
+  ProcessorPool *const pool_;
+};
+
 ProcessorPool::ProcessorPool(int max_available)
-  : max_per_config_(max_available) {
+  : max_per_config_(max_available), convolver_threads_(1),
+    default_profile_(PROFILE_THROUGHPUT), output_options_(0), watcher_(this),
+    warm_up_thread_(NULL) {
+  pthread_cond_init(&warm_up_event_, NULL);
 }
 
 static bool FindFirstAccessiblePath(const std::vector<std::string> &path,
@@ -45,9 +70,10 @@ for (size_t i = 0; i < path.size(); ++i) {
   return false;
 }
 
-SoundProcessor *ProcessorPool::GetOrCreate(const std::string &base_dir,
-                                           int sampling_rate, int channels,
-                                           int bits, std::string *errmsg) {
+bool ProcessorPool::FindConfigFile(const std::string &base_dir,
+                                   int sampling_rate, int channels, int bits,
+                                   std::string *config_path,
+                                   std::string *errmsg) {
   std::vector<std::string> path_choices;
   // From specific to non-specific.
   path_choices.push_back(StringPrintf("%s/filter-%d-%d-%d.conf",
@@ -60,41 +86,198 @@ SoundProcessor *ProcessorPool::GetOrCreate(const std::string &base_dir,
                                       base_dir.c_str(),
                                       sampling_rate));
 
-  std::string config_path;
-  if (!FindFirstAccessiblePath(path_choices, &config_path)) {
+  if (!FindFirstAccessiblePath(path_choices, config_path)) {
     const char *short_dir = strrchr(base_dir.c_str(), '/') + 1;
     *errmsg = StringPrintf("No filter in %s for %.1fkHz/%d ch/%d bits",
                            short_dir, sampling_rate / 1000.0, channels, bits);
+    return false;
+  }
+  return true;
+}
+
+SoundProcessor *ProcessorPool::GetOrCreate(const std::string &base_dir,
+                                           int sampling_rate, int channels,
+                                           int bits, std::string *errmsg) {
+  std::string config_path;
+  if (!FindConfigFile(base_dir, sampling_rate, channels, bits,
+                      &config_path, errmsg)) {
     return NULL;
   }
+  return GetOrCreateForConfig(config_path, sampling_rate, channels, errmsg);
+}
+
+SoundProcessor *ProcessorPool::GetOrCreateForConfig(
+     const std::string &config_path, int sampling_rate, int channels,
+     std::string *errmsg) {
   SoundProcessor *result;
   while ((result = CheckOutOfPool(config_path)) != NULL) {
-    if (result->ConfigStillUpToDate())
+    if (IsUpToDate(result))
       break;
     DLogf("Processor %p: outdated; Good riddance after config file change %s",
           result, config_path.c_str());
+    folve::metrics::processor_pool_outdated.Add(1);
     delete result;
   }
   if (result != NULL) {
+    folve::metrics::processor_pool_hits.Add(1);
     DLogf("Processor %p: Got from pool [%s]", result, config_path.c_str());
     return result;
   }
 
-  result = SoundProcessor::Create(config_path, sampling_rate, channels);
+  folve::metrics::processor_pool_misses.Add(1);
+  result = CreateProcessor(config_path, sampling_rate, channels);
   if (result == NULL) {
     *errmsg = "Problem parsing " + config_path;
-    syslog(LOG_ERR, "filter-config %s is broken.", config_path.c_str());
   } else {
     DLogf("Processor %p: Newly created [%s]", result, config_path.c_str());
   }
   return result;
 }
 
+SoundProcessor *ProcessorPool::CreateProcessor(const std::string &config_path,
+                                               int sampling_rate,
+                                               int channels) {
+  // Makes sure the files are watched before they are read.
+  ConfigInfo info;
+  std::string ignored;
+  const bool known = GetConfigInfo(config_path, &info, &ignored);
+  const bool watched = known && info.watch_generation >= 0;
+  const int64_t generation = watcher_.generation();
+  SoundProcessor *result
+    = SoundProcessor::Create(config_path, sampling_rate, channels,
+                             convolver_threads_, default_profile_);
+  if (result == NULL) {
+    syslog(LOG_ERR, "filter-config %s is broken.", config_path.c_str());
+    return NULL;
+  }
+  result->set_output_options(output_options_);
+  if (known) {
+    // The processor knows better than our quick look at the configuration,
+    // as long as that describes the same files.
+    folve::MutexLock l(&pool_mutex_);
+    ConfigInfoMap::iterator found = config_info_.find(config_path);
+    if (found != config_info_.end()
+        && found->second.timestamp == info.timestamp
+        && found->second.channels != result->output_channels()) {
+      DLogf("%s: %d outputs, not %d as the /convolver/new line suggests",
+            config_path.c_str(), result->output_channels(),
+            found->second.channels);
+      found->second.channels = result->output_channels();
+    }
+  }
+  // Usually, these are the files we just started to watch.
+  if (watched && watcher_.Watch(result->dependencies())) {
+    result->set_watch_generation(generation);
+  }
+  return result;
+}
+
+bool ProcessorPool::IsUpToDate(const SoundProcessor *processor) {
+  if (processor->watch_generation() < 0)
+    return processor->ConfigStillUpToDate();  // Need to look at the files.
+  return !watcher_.ChangedSince(processor->dependencies(),
+                                processor->watch_generation());
+}
+
+// Read the number of outputs from the "/convolver/new <in> <out> ..." line.
+// Only used until a processor is created, which then tells the real number.
+static int ReadConfigOutputs(const std::string &config_path) {
+  FILE *f = fopen(config_path.c_str(), "r");
+  if (f == NULL)
+    return -1;
+  int outputs = -1;
+  char line[1024];
+  while (outputs < 0 && fgets(line, sizeof(line), f) != NULL) {
+    const char *start = line + strspn(line, " \t");
+    int inputs;
+    if (sscanf(start, "/convolver/new %d %d", &inputs, &outputs) != 2)
+      outputs = -1;
+  }
+  fclose(f);
+  return outputs;
+}
+
+// Newest modification time of the files; -1 if the first can't be accessed.
+static time_t NewestModificationTime(const std::vector<std::string> &files) {
+  time_t result = -1;
+  for (size_t i = 0; i < files.size(); ++i) {
+    struct stat st;
+    if (stat(files[i].c_str(), &st) != 0) {
+      if (i == 0) return -1;
+      continue;  // Missing impulse file; creating a processor will tell.
+    }
+    result = std::max(result, st.st_mtime);
+  }
+  return result;
+}
+
+bool ProcessorPool::GetConfigInfo(const std::string &config_path,
+                                  ConfigInfo *info, std::string *errmsg) {
+  bool known;
+  {
+    folve::MutexLock l(&pool_mutex_);
+    ConfigInfoMap::const_iterator found = config_info_.find(config_path);
+    known = (found != config_info_.end());
+    if (known) *info = found->second;
+  }
+  if (known) {
+    const bool up_to_date = (info->watch_generation >= 0)
+      ? !watcher_.ChangedSince(info->files, info->watch_generation)
+      : info->timestamp == NewestModificationTime(info->files);
+    if (up_to_date)
+      return true;
+  }
+
+  ConfigInfo fresh;
+  fresh.files.push_back(config_path);
+  if (impulse_files(config_path.c_str(), &fresh.files) != 0) {
+    *errmsg = "Can't access " + config_path;
+    return false;
+  }
+  // Watch before reading, so that we get to know about changes after that.
+  fresh.watch_generation = watcher_.Watch(fresh.files)
+    ? watcher_.generation() : -1;
+  fresh.timestamp = NewestModificationTime(fresh.files);
+  fresh.channels = ReadConfigOutputs(config_path);
+  if (fresh.timestamp < 0) {
+    *errmsg = "Can't access " + config_path;
+    return false;
+  }
+  folve::MutexLock l(&pool_mutex_);
+  config_info_[config_path] = fresh;
+  *info = fresh;
+  return true;
+}
+
+bool ProcessorPool::GetOutputChannels(const std::string &config_path,
+                                      int *channels, std::string *errmsg) {
+  ConfigInfo info;
+  if (!GetConfigInfo(config_path, &info, errmsg))
+    return false;
+  if (info.channels <= 0) {
+    *errmsg = "No /convolver/new in " + config_path;
+    return false;
+  }
+  *channels = info.channels;
+  return true;
+}
+
+bool ProcessorPool::GetConfigTimestamp(const std::string &config_path,
+                                       time_t *timestamp,
+                                       std::string *errmsg) {
+  ConfigInfo info;
+  if (!GetConfigInfo(config_path, &info, errmsg))
+    return false;
+  *timestamp = info.timestamp;
+  return true;
+}
+
 void ProcessorPool::Return(SoundProcessor *processor) {
   if (processor == NULL) return;
-  if (!processor->ConfigStillUpToDate()) {
+  if (!IsUpToDate(processor)) {
     DLogf("Processor %p: outdated. Not returning back in pool [%s]", processor,
           processor->config_file().c_str());
+    RequestRebuild(processor, 1);
     delete processor;
     return;
   }
@@ -129,3 +312,192 @@ SoundProcessor *ProcessorPool::CheckOutOfPool(const std::string &config_path) {
   list->pop_front();
   return result;
 }
+
+size_t ProcessorPool::PooledCount(const std::string &config_path) {
+  folve::MutexLock l(&pool_mutex_);
+  PoolMap::const_iterator found = pool_.find(config_path);
+  return (found == pool_.end()) ? 0 : found->second->size();
+}
+
+void ProcessorPool::FilesChanged(const std::vector<std::string> &files) {
+  std::vector<SoundProcessor*> outdated;
+  {
+    folve::MutexLock l(&pool_mutex_);
+    for (PoolMap::iterator it = pool_.begin(); it != pool_.end(); ++it) {
+      ProcessorList *list = it->second;
+      for (ProcessorList::iterator p = list->begin(); p != list->end(); ) {
+        if (IsUpToDate(*p)) {
+          ++p;
+        } else {
+          outdated.push_back(*p);
+          p = list->erase(p);
+        }
+      }
+    }
+  }
+  // Processors in use will be noticed when returned.
+  for (size_t i = 0; i < outdated.size(); ++i) {
+    DLogf("Processor %p: outdated after change of %s; removed from pool",
+          outdated[i], files[0].c_str());
+    folve::metrics::processor_pool_outdated.Add(1);
+    RequestRebuild(outdated[i], 1);
+    delete outdated[i];
+  }
+}
+
+void ProcessorPool::RequestRebuild(const SoundProcessor *outdated, int count) {
+  folve::MutexLock l(&warm_up_mutex_);
+  const double due = folve::CurrentTime() + kRebuildDelay;
+  for (size_t i = 0; i < rebuild_queue_.size(); ++i) {
+    RebuildRequest &pending = rebuild_queue_[i];
+    if (pending.config_path == outdated->config_file()
+        && pending.sampling_rate == outdated->sample_rate()
+        && pending.channels == outdated->input_channels()) {
+      pending.count = std::min((int) max_per_config_, pending.count + count);
+      pending.due = due;   // Wait until things settle.
+      return;
+    }
+  }
+  RebuildRequest request;
+  request.config_path = outdated->config_file();
+  request.sampling_rate = outdated->sample_rate();
+  request.channels = outdated->input_channels();
+  request.count = count;
+  request.due = due;
+  rebuild_queue_.push_back(request);
+  if (warm_up_thread_ == NULL) {
+    warm_up_thread_ = new WarmUpThread(this);
+    warm_up_thread_->Start();
+  }
+  pthread_cond_signal(&warm_up_event_);
+}
+
+void ProcessorPool::WarmUp(const std::string &config_dir) {
+  folve::MutexLock l(&warm_up_mutex_);
+  if (std::find(warm_up_queue_.begin(), warm_up_queue_.end(), config_dir)
+      != warm_up_queue_.end()) {
+    return;  // Already pending.
+  }
+  warm_up_queue_.push_back(config_dir);
+  if (warm_up_thread_ == NULL) {
+    warm_up_thread_ = new WarmUpThread(this);
+    warm_up_thread_->Start();
+  }
+  pthread_cond_signal(&warm_up_event_);
+}
+
+void ProcessorPool::ProcessWarmUpQueue() {
+  for (;;) {
+    std::string config_dir;
+    RebuildRequest rebuild;
+    double wait = 0;
+    {
+      folve::MutexLock l(&warm_up_mutex_);
+      while (warm_up_queue_.empty() && rebuild_queue_.empty()) {
+        warm_up_mutex_.WaitOn(&warm_up_event_);
+      }
+      if (!warm_up_queue_.empty()) {
+        config_dir = warm_up_queue_.front();
+        warm_up_queue_.pop_front();
+      } else {
+        wait = rebuild_queue_.front().due - folve::CurrentTime();
+        if (wait <= 0) {
+          rebuild = rebuild_queue_.front();
+          rebuild_queue_.pop_front();
+        }
+      }
+    }
+    if (!config_dir.empty()) {
+      WarmUpDirectory(config_dir);
+    } else if (wait > 0) {
+      usleep(wait * 1e6);
+    } else {
+      Rebuild(rebuild);
+    }
+  }
+}
+
+void ProcessorPool::Rebuild(const RebuildRequest &request) {
+  const double start_time = folve::CurrentTime();
+  int created = 0;
+  for (int i = 0; i < request.count
+         && PooledCount(request.config_path) < max_per_config_; ++i) {
+    SoundProcessor *processor = CreateProcessor(request.config_path,
+                                                request.sampling_rate,
+                                                request.channels);
+    if (processor == NULL)
+      break;
+    DLogf("Processor %p: Rebuilt [%s]", processor,
+          request.config_path.c_str());
+    folve::metrics::processor_pool_rebuilds.Add(1);
+    ++created;
+    Return(processor);
+  }
+  if (created > 0) {
+    syslog(LOG_INFO, "Rebuilt %d filter(s) for changed %s in %.1f seconds",
+           created, request.config_path.c_str(),
+           folve::CurrentTime() - start_time);
+  }
+}
+
+// Parse the sound parameters from a filter-<rate>[-<ch>[-<bits>]].conf
+// filename. Returns 'false' if this is not a filter configuration.
+static bool ParseFilterFilename(const char *name,
+                                int *sampling_rate, int *channels) {
+  static const char kPrefix[] = "filter-";
+  static const char kSuffix[] = ".conf";
+  if (strncmp(name, kPrefix, strlen(kPrefix)) != 0
+      || !folve::HasSuffix(name, kSuffix))
+    return false;
+  int values[3] = { 0, 2, 0 };  // Unspecified channels: assume stereo.
+  const char *pos = name + strlen(kPrefix);
+  for (int i = 0; i < 3; ++i) {
+    char *end;
+    values[i] = strtol(pos, &end, 10);
+    if (end == pos || values[i] <= 0)
+      return false;
+    if (strcmp(end, kSuffix) == 0)
+      break;
+    if (*end != '-' || i == 2)
+      return false;
+    pos = end + 1;
+  }
+  *sampling_rate = values[0];
+  *channels = values[1];
+  return true;
+}
+
+void ProcessorPool::WarmUpDirectory(const std::string &config_dir) {
+  DIR *dp = opendir(config_dir.c_str());
+  if (dp == NULL) return;
+  std::vector<std::string> names;
+  struct dirent *dent;
+  while ((dent = readdir(dp)) != NULL) {
+    names.push_back(dent->d_name);
+  }
+  closedir(dp);
+
+  const double start_time = folve::CurrentTime();
+  int created = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    int sampling_rate, channels;
+    if (!ParseFilterFilename(names[i].c_str(), &sampling_rate, &channels))
+      continue;
+    const std::string config_path = config_dir + "/" + names[i];
+    for (size_t n = PooledCount(config_path); n < max_per_config_; ++n) {
+      SoundProcessor *processor
+        = CreateProcessor(config_path, sampling_rate, channels);
+      if (processor == NULL)
+        break;
+      DLogf("Processor %p: Warm-up created [%s]", processor,
+            config_path.c_str());
+      ++created;
+      Return(processor);
+    }
+  }
+  if (created > 0) {
+    syslog(LOG_INFO, "Warm-up: created %d filter(s) for %s in %.1f seconds",
+           created, config_dir.c_str(),
+           folve::CurrentTime() - start_time);
+  }
+}
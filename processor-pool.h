@@ -16,23 +16,52 @@
 #ifndef FOLVE_PROCESSOR_POOL_
 #define FOLVE_PROCESSOR_POOL_
 
+#include <pthread.h>
+#include <time.h>
+
 #include <map>
 #include <deque>
 #include <string>
+#include <vector>
 
+#include "config-watcher.h"
 #include "util.h"
 
 class SoundProcessor;
 
 // An object pool for SoundProcessors. They are expensive to create, in
 // particular on slow machines, but they only change if the configuration
-// file is touched. Good candidates for re-use.
-class ProcessorPool {
+// file or its impulse files are touched. Good candidates for re-use.
+//
+// These files are watched; if they change, pooled processors are thrown
+// away and replacements are created in the background.
+class ProcessorPool : private ConfigWatcher::Listener {
 public:
   // Create a processor pool. Stores at most "max_per_config" processors in
   // pool per configuration file.
   ProcessorPool(int max_per_config);
 
+  // Number of threads each newly created processor may use to convolve
+  // in parallel. Default 1.
+  void set_convolver_threads(int n) { convolver_threads_ = n; }
+  int convolver_threads() const { return convolver_threads_; }
+
+  // Partition layout of newly created processors unless the configuration
+  // chooses one; PROFILE_THROUGHPUT (default) or PROFILE_LATENCY.
+  void set_default_profile(int profile) { default_profile_ = profile; }
+  int default_profile() const { return default_profile_; }
+
+  // folve::PCM_* options of newly created processors for integer outputs.
+  void set_output_options(int options) { output_options_ = options; }
+  int output_options() const { return output_options_; }
+
+  // Find the most specific filter configuration in "base_dir" for the given
+  // sound parameters. Returns 'true' and stores the path in "config_path" if
+  // found; otherwise returns 'false' with an error message in "errmsg".
+  bool FindConfigFile(const std::string &base_dir,
+                      int sampling_rate, int channels, int bits,
+                      std::string *config_path, std::string *errmsg);
+
   // Get a new SoundProcesor from this pool with the given configuration.
   // If this isn't possible, NULL is returned an an error message stored in
   // "errmsg".
@@ -40,18 +69,97 @@ public:
                               int sampling_rate, int channels, int bits,
                               std::string *errmsg);
 
+  // Like GetOrCreate(), with the configuration file already found by
+  // FindConfigFile().
+  SoundProcessor *GetOrCreateForConfig(const std::string &config_path,
+                                       int sampling_rate, int channels,
+                                       std::string *errmsg);
+
+  // Get the number of output channels processors with the given
+  // configuration file produce, without creating one. Returns 'false' with
+  // a message in "errmsg" if the configuration doesn't tell.
+  bool GetOutputChannels(const std::string &config_path, int *channels,
+                         std::string *errmsg);
+
+  // Get the newest modification time of the configuration file and the
+  // impulse files it reads. Returns 'false' with a message in "errmsg" if
+  // the configuration can't be read.
+  bool GetConfigTimestamp(const std::string &config_path, time_t *timestamp,
+                          std::string *errmsg);
+
+  // Returns if the processor still reflects its configuration and impulse
+  // files. Usually doesn't need to look at the files.
+  bool IsUpToDate(const SoundProcessor *processor);
+
   // Return a processor pack to the pool.
   void Return(SoundProcessor *processor);
 
+  // Fill the pool with processors for all filter-<rate>[-<ch>[-<bits>]].conf
+  // files in "config_dir", so that the first file opened with them doesn't
+  // have to wait for the expensive setup. This happens in a background
+  // thread; returns immediately.
+  void WarmUp(const std::string &config_dir);
+
 private:
+  class WarmUpThread;
+  friend class WarmUpThread;
   typedef std::deque<SoundProcessor*> ProcessorList;
   typedef std::map<std::string, ProcessorList*> PoolMap;
+  // What we know about a configuration without creating a processor.
+  struct ConfigInfo {
+    std::vector<std::string> files;  // Configuration and impulse files.
+    int64_t watch_generation;        // -1 if files are not watched.
+    time_t timestamp;                // Newest modification time of files.
+    int channels;                    // Outputs.
+  };
+  typedef std::map<std::string, ConfigInfo> ConfigInfoMap;
+  struct RebuildRequest {
+    RebuildRequest() : sampling_rate(0), channels(0), count(0), due(0) {}
+    std::string config_path;
+    int sampling_rate;
+    int channels;
+    int count;
+    double due;                      // folve::CurrentTime() to start.
+  };
+
+  // Get the up-to-date information about the configuration file.
+  bool GetConfigInfo(const std::string &config_path, ConfigInfo *info,
+                     std::string *errmsg);
+
+  // Create a new processor, watching its files.
+  SoundProcessor *CreateProcessor(const std::string &config_path,
+                                  int sampling_rate, int channels);
 
   SoundProcessor *CheckOutOfPool(const std::string &config_path);
+  size_t PooledCount(const std::string &config_path);
+
+  // -- ConfigWatcher::Listener interface
+  virtual void FilesChanged(const std::vector<std::string> &files);
+
+  // Create "count" processors like the given, outdated one in the
+  // background, after a little wait; edits often come in bursts.
+  void RequestRebuild(const SoundProcessor *outdated, int count);
+
+  // Work on the warm-up and rebuild queue; called in the warm-up thread.
+  // Never returns.
+  void ProcessWarmUpQueue();
+  void WarmUpDirectory(const std::string &config_dir);
+  void Rebuild(const RebuildRequest &request);
 
   const size_t max_per_config_;
+  int convolver_threads_;
+  int default_profile_;
+  int output_options_;
+  ConfigWatcher watcher_;
   folve::Mutex pool_mutex_;
   PoolMap pool_;
+  ConfigInfoMap config_info_;
+
+  folve::Mutex warm_up_mutex_;
+  std::deque<std::string> warm_up_queue_;
+  std::deque<RebuildRequest> rebuild_queue_;
+  pthread_cond_t warm_up_event_;
+  WarmUpThread *warm_up_thread_;  // Lazily created.
 };
 
 #endif  // FOLVE_PROCESSOR_POOL_
@@ -0,0 +1,140 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "read-ahead-file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "metrics.h"
+#include "util.h"
+
+// Size of the reads from the underlying file.
+static const size_t kChunkSize = 256 << 10;
+// How far beyond the read position we want the kernel to read ahead.
+static const off_t kReadAheadBytes = 2 << 20;
+
+ReadAheadFile::ReadAheadFile(int filedes)
+  : filedes_(filedes), file_size_(0), pos_(0), chunk_(new char[kChunkSize]),
+    chunk_start_(0), chunk_len_(0), advised_end_(0) {
+  struct stat st;
+  if (fstat(filedes_, &st) == 0) file_size_ = st.st_size;
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(filedes_, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+}
+
+ReadAheadFile::~ReadAheadFile() {
+  delete [] chunk_;
+}
+
+SNDFILE *ReadAheadFile::Open(SF_INFO *info) {
+  SF_VIRTUAL_IO virtual_io;
+  memset(&virtual_io, 0, sizeof(virtual_io));
+  virtual_io.get_filelen = &ReadAheadFile::SndFileLen;
+  virtual_io.seek = &ReadAheadFile::SndSeek;
+  virtual_io.read = &ReadAheadFile::SndRead;
+  virtual_io.write = &ReadAheadFile::SndWrite;
+  virtual_io.tell = &ReadAheadFile::SndTell;
+  return sf_open_virtual(&virtual_io, SFM_READ, info, this);
+}
+
+void ReadAheadFile::AdviseReadAhead(off_t pos) {
+#ifdef POSIX_FADV_WILLNEED
+  // Only every now and then; each call is a system call.
+  if (advised_end_ - pos > kReadAheadBytes / 2 || advised_end_ >= file_size_)
+    return;
+  const off_t start = std::max(advised_end_, pos);
+  advised_end_ = std::min(file_size_, pos + kReadAheadBytes);
+  // Starts reading in the background; doesn't wait for it.
+  posix_fadvise(filedes_, start, advised_end_ - start, POSIX_FADV_WILLNEED);
+#endif
+}
+
+bool ReadAheadFile::FillChunk() {
+  // Fetch the data beyond the chunk while libsndfile decodes this one.
+  AdviseReadAhead(pos_ + kChunkSize);
+  folve::ScopedTimer timer(&folve::metrics::input_read_time);
+  ssize_t r;
+  do {
+    r = pread(filedes_, chunk_, kChunkSize, pos_);
+  } while (r < 0 && errno == EINTR);
+  if (r <= 0) {
+    chunk_len_ = 0;
+    return false;
+  }
+  chunk_start_ = pos_;
+  chunk_len_ = r;
+  return true;
+}
+
+sf_count_t ReadAheadFile::SndRead(void *ptr, sf_count_t count,
+                                  void *userdata) {
+  ReadAheadFile *file = static_cast<ReadAheadFile*>(userdata);
+  char *out = static_cast<char*>(ptr);
+  sf_count_t done = 0;
+  while (done < count) {
+    if (file->pos_ < file->chunk_start_
+        || file->pos_ >= file->chunk_start_ + (off_t) file->chunk_len_) {
+      if (!file->FillChunk())
+        break;
+    }
+    const size_t offset = file->pos_ - file->chunk_start_;
+    const size_t n = std::min((size_t) (count - done),
+                              file->chunk_len_ - offset);
+    memcpy(out + done, file->chunk_ + offset, n);
+    done += n;
+    file->pos_ += n;
+  }
+  return done;
+}
+
+sf_count_t ReadAheadFile::SndSeek(sf_count_t offset, int whence,
+                                  void *userdata) {
+  ReadAheadFile *file = static_cast<ReadAheadFile*>(userdata);
+  switch (whence) {
+  case SEEK_SET: file->pos_ = offset; break;
+  case SEEK_CUR: file->pos_ += offset; break;
+  case SEEK_END: file->pos_ = file->file_size_ + offset; break;
+  }
+  // Far jumps: whatever we asked to read ahead is not needed anymore.
+  if (file->pos_ < file->advised_end_ - kReadAheadBytes - (off_t) kChunkSize
+      || file->pos_ > file->advised_end_) {
+    file->advised_end_ = file->pos_;
+  }
+  return file->pos_;
+}
+
+sf_count_t ReadAheadFile::SndWrite(const void *ptr, sf_count_t count,
+                                   void *userdata) {
+  return 0;  // Read only.
+}
+
+sf_count_t ReadAheadFile::SndFileLen(void *userdata) {
+  return static_cast<ReadAheadFile*>(userdata)->file_size_;
+}
+
+sf_count_t ReadAheadFile::SndTell(void *userdata) {
+  return static_cast<ReadAheadFile*>(userdata)->pos_;
+}
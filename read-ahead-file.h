@@ -0,0 +1,67 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_READ_AHEAD_FILE_H
+#define FOLVE_READ_AHEAD_FILE_H
+
+#include <sndfile.h>
+#include <sys/types.h>
+
+// Input of a sound file for libsndfile, optimized for underlying
+// directories on network filesystems.
+//
+// libsndfile reads the input in many small pieces, each a round-trip to the
+// server if not in the page cache. Here, the file is read in large chunks,
+// and the kernel is asked to fetch the data beyond that in the background
+// (posix_fadvise()), so that it is there by the time we're done convolving
+// the current chunk.
+// Not thread-safe; to be used by one reader at a time.
+class ReadAheadFile {
+public:
+  // Does not take over ownership of the file descriptor.
+  explicit ReadAheadFile(int filedes);
+  ~ReadAheadFile();
+
+  // Open the sound file. The returned SNDFILE needs to be sf_close()d
+  // before this object is deleted. Returns NULL on failure.
+  SNDFILE *Open(SF_INFO *info);
+
+private:
+  // Read data at pos_ into the chunk buffer.
+  bool FillChunk();
+
+  // Ask the kernel to read ahead of "pos".
+  void AdviseReadAhead(off_t pos);
+
+  static sf_count_t SndFileLen(void *userdata);
+  static sf_count_t SndSeek(sf_count_t offset, int whence, void *userdata);
+  static sf_count_t SndRead(void *ptr, sf_count_t count, void *userdata);
+  static sf_count_t SndWrite(const void *ptr, sf_count_t count,
+                             void *userdata);
+  static sf_count_t SndTell(void *userdata);
+
+  const int filedes_;
+  off_t file_size_;
+  off_t pos_;             // Read position of libsndfile.
+  char *const chunk_;
+  off_t chunk_start_;     // File position of chunk_ content.
+  size_t chunk_len_;
+  off_t advised_end_;     // Read-ahead requested up to here.
+};
+
+#endif  // FOLVE_READ_AHEAD_FILE_H
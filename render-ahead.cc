@@ -0,0 +1,247 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "render-ahead.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "convolve-file-handler.h"
+#include "directory-cache.h"
+#include "folve-filesystem.h"
+
+using folve::DLogf;
+
+static const size_t kReadChunk = 64 << 10;
+
+class RenderAhead::WorkerThread : public folve::Thread {
+public:
+  WorkerThread(RenderAhead *render_ahead) : render_ahead_(render_ahead) {}
+  virtual void Run() {
+#ifdef SYS_ioprio_set
+    // Idle I/O class, so that we don't slow down reading of files that are
+    // played right now. (IOPRIO_WHO_PROCESS, this thread, IOPRIO_CLASS_IDLE)
+    syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+    folve::PinToConversionCpus();
+    render_ahead_->ProcessQueue();
+  }
+
+private:
+  RenderAhead *const render_ahead_;
+};
+
+// Playlists might as well refer to anything on the internet or to files
+// outside our directory.
+static bool IsAcceptablePath(const std::string &path) {
+  if (path.empty() || path.find("://") != std::string::npos)
+    return false;
+  return (path != ".." && path.compare(0, 3, "../") != 0
+          && path.find("/../") == std::string::npos
+          && !folve::HasSuffix(path, "/.."));
+}
+
+static void StripLine(std::string *line) {
+  const std::string::size_type end = line->find_last_not_of(" \t\r\n");
+  line->erase(end == std::string::npos ? 0 : end + 1);
+  const std::string::size_type start = line->find_first_not_of(" \t");
+  line->erase(0, start == std::string::npos ? line->length() : start);
+}
+
+RenderAhead::RenderAhead(FolveFilesystem *fs)
+  : fs_(fs), current_progress_(0), done_(0), failed_(0), worker_(NULL) {
+  pthread_cond_init(&queue_event_, NULL);
+}
+
+bool RenderAhead::ReadPlaylist(const std::string &fs_path,
+                               std::vector<std::string> *files,
+                               std::string *error) {
+  const std::string underlying_file = fs_->GetUnderlyingFile(fs_path.c_str());
+  FILE *f = fopen(underlying_file.c_str(), "r");
+  if (f == NULL) {
+    *error = strerror(errno);
+    return false;
+  }
+  // Relative entries are relative to the playlist; absolute ones that point
+  // into the underlying directory are mapped to the same filter.
+  const std::string fs_dir = fs_path.substr(0, fs_path.find_last_of('/') + 1);
+  std::string filter_prefix;
+  if (fs_->toplevel_directory_is_filter()) {
+    filter_prefix = fs_path.substr(0, fs_path.find('/', 1));
+  }
+  const std::string &base = fs_->underlying_dir();
+  const bool is_pls = folve::HasSuffix(fs_path, ".pls");
+  char buffer[4096];
+  while (fgets(buffer, sizeof(buffer), f) != NULL) {
+    std::string entry = buffer;
+    StripLine(&entry);
+    if (is_pls) {
+      // File1=some/path.flac
+      const std::string::size_type eq = entry.find('=');
+      if (entry.compare(0, 4, "File") != 0 || eq == std::string::npos)
+        continue;
+      entry.erase(0, eq + 1);
+    } else if (!entry.empty() && entry[0] == '#') {
+      continue;
+    }
+    if (!IsAcceptablePath(entry))
+      continue;
+    if (entry[0] != '/') {
+      files->push_back(fs_dir + entry);
+    } else if (entry.compare(0, base.length() + 1, base + "/") == 0) {
+      files->push_back(filter_prefix + entry.substr(base.length()));
+    } else {
+      files->push_back(entry);  // Hopefully a path as seen in the mount.
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+bool RenderAhead::ListFiles(const std::string &fs_path,
+                            std::vector<std::string> *files,
+                            std::string *error) {
+  if (fs_path.empty() || fs_path[0] != '/' || !IsAcceptablePath(fs_path)) {
+    *error = "Invalid path";
+    return false;
+  }
+  if (folve::HasSuffix(fs_path, ".m3u") || folve::HasSuffix(fs_path, ".m3u8")
+      || folve::HasSuffix(fs_path, ".pls")) {
+    return ReadPlaylist(fs_path, files, error);
+  }
+  const std::string underlying = fs_->GetUnderlyingFile(fs_path.c_str());
+  struct stat st;
+  if (stat(underlying.c_str(), &st) != 0) {
+    *error = strerror(errno);
+    return false;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    files->push_back(fs_path);
+    return true;
+  }
+  std::vector<DirectoryCache::Entry> entries;
+  if (!fs_->directory_cache()->GetEntries(underlying, &entries)) {
+    *error = strerror(errno);
+    return false;
+  }
+  const std::string fs_dir = folve::HasSuffix(fs_path, "/")
+    ? fs_path : fs_path + "/";
+  for (size_t i = 0; i < entries.size(); ++i) {  // sorted by name.
+    const DirectoryCache::Entry &entry = entries[i];
+    if (entry.type == DT_DIR || entry.name[0] == '.')
+      continue;
+    files->push_back(fs_dir + entry.name);
+  }
+  return true;
+}
+
+int RenderAhead::Enqueue(const std::string &fs_path, std::string *error) {
+  if (fs_->render_cache() == NULL) {
+    *error = "Render ahead needs a render cache (-c)";
+    return -1;
+  }
+  std::vector<std::string> files;
+  if (!ListFiles(fs_path, &files, error)) {
+    syslog(LOG_INFO, "Render ahead '%s': %s", fs_path.c_str(), error->c_str());
+    return -1;
+  }
+  folve::MutexLock l(&mutex_);
+  int queued = 0;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (files[i] == current_
+        || std::find(queue_.begin(), queue_.end(), files[i]) != queue_.end())
+      continue;  // Already pending.
+    queue_.push_back(files[i]);
+    ++queued;
+  }
+  DLogf("Render ahead '%s': %d files queued", fs_path.c_str(), queued);
+  if (worker_ == NULL) {
+    worker_ = new WorkerThread(this);
+    worker_->Start();
+  }
+  pthread_cond_signal(&queue_event_);
+  return queued;
+}
+
+void RenderAhead::GetStatus(Status *status) {
+  folve::MutexLock l(&mutex_);
+  status->queued.assign(queue_.begin(), queue_.end());
+  status->current = current_;
+  status->current_progress = current_progress_;
+  status->done = done_;
+  status->failed = failed_;
+}
+
+void RenderAhead::ProcessQueue() {
+  for (;;) {
+    std::string fs_path;
+    {
+      folve::MutexLock l(&mutex_);
+      while (queue_.empty()) {
+        mutex_.WaitOn(&queue_event_);
+      }
+      fs_path = queue_.front();
+      queue_.pop_front();
+      current_ = fs_path;
+      current_progress_ = 0;
+    }
+    const bool success = Render(fs_path);
+    folve::MutexLock l(&mutex_);
+    current_.clear();
+    if (success) ++done_; else ++failed_;
+  }
+}
+
+bool RenderAhead::Render(const std::string &fs_path) {
+  FileHandler *handler = fs_->GetOrCreateHandler(fs_path.c_str());
+  if (handler == NULL) {
+    DLogf("Render ahead %s: %s", fs_path.c_str(), strerror(errno));
+    return false;
+  }
+  // Files we don't convert, or that are already in the render cache,
+  // are passed through; nothing to do.
+  if (dynamic_cast<ConvolveFileHandler*>(handler) == NULL) {
+    fs_->Close(fs_path.c_str(), handler);
+    return true;
+  }
+  char *buffer = new char[kReadChunk];
+  off_t pos = 0;
+  int result;
+  while ((result = handler->Read(buffer, kReadChunk, pos)) > 0) {
+    pos += result;
+    struct stat st;
+    if (handler->Stat(&st) == 0 && st.st_size > 0) {
+      folve::MutexLock l(&mutex_);
+      current_progress_ = std::min(1.0, 1.0 * pos / st.st_size);
+    }
+  }
+  delete [] buffer;
+  // Once the handler retires from the recently used files, it goes
+  // to the render cache.
+  fs_->Close(fs_path.c_str(), handler);
+  DLogf("Render ahead %s: %lld bytes", fs_path.c_str(), (long long) pos);
+  return result == 0;
+}
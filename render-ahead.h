@@ -0,0 +1,87 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_RENDER_AHEAD_H
+#define FOLVE_RENDER_AHEAD_H
+
+#include <pthread.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "util.h"
+
+class FolveFilesystem;
+
+// Converts files in the background before anyone asks for them, so that
+// they end up in the render cache; e.g. the tracks of a playlist for a party.
+// Files are converted one at a time in a low priority thread (idle CPU
+// scheduling and I/O class), by reading them through the filesystem like a
+// client would.
+// This class is thread-safe.
+class RenderAhead {
+public:
+  struct Status {
+    Status() : current_progress(0), done(0), failed(0) {}
+    std::vector<std::string> queued;   // Filesystem paths.
+    std::string current;               // Empty if idle.
+    float current_progress;            // 0..1
+    int done;
+    int failed;
+  };
+
+  // Does not take over ownership of the filesystem.
+  RenderAhead(FolveFilesystem *fs);
+
+  // Queue files for conversion: "fs_path" is a path in the filesystem,
+  // naming a single file, a directory (all files in it) or a playlist
+  // (.m3u, .m3u8 or .pls). Returns the number of files queued or -1 with
+  // a message in "error".
+  int Enqueue(const std::string &fs_path, std::string *error);
+
+  void GetStatus(Status *status);
+
+private:
+  class WorkerThread;
+  friend class WorkerThread;
+
+  // Expand directory or playlist into the files to convert.
+  bool ListFiles(const std::string &fs_path, std::vector<std::string> *files,
+                 std::string *error);
+  bool ReadPlaylist(const std::string &fs_path,
+                    std::vector<std::string> *files, std::string *error);
+
+  // Work on queue. Called in worker thread; never returns.
+  void ProcessQueue();
+
+  // Read the file once from start to end, so that it gets converted.
+  bool Render(const std::string &fs_path);
+
+  FolveFilesystem *const fs_;
+  folve::Mutex mutex_;           // Protects the following.
+  std::deque<std::string> queue_;
+  std::string current_;
+  float current_progress_;
+  int done_;
+  int failed_;
+  pthread_cond_t queue_event_;   // Something queued.
+  WorkerThread *worker_;         // Lazily created.
+};
+
+#endif  // FOLVE_RENDER_AHEAD_H
@@ -0,0 +1,261 @@
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "render-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "conversion-buffer.h"
+#include "util.h"
+
+using folve::DLogf;
+using folve::StringPrintf;
+
+static const char kEntrySuffix[] = ".folve";
+
+class RenderCache::StoreThread : public folve::Thread {
+public:
+  StoreThread(RenderCache *cache) : cache_(cache) {}
+  virtual void Run() { cache_->ProcessPendingStores(); }
+
+private:
+  RenderCache *const cache_;
+};
+
+RenderCache::RenderCache(const std::string &directory, off_t max_bytes)
+  : directory_(directory), max_bytes_(max_bytes), hits_(0), misses_(0),
+    quit_(false), store_thread_(NULL) {
+  pthread_cond_init(&pending_changed_, NULL);
+}
+
+RenderCache::~RenderCache() {
+  {
+    folve::MutexLock l(&pending_mutex_);
+    quit_ = true;
+    pthread_cond_broadcast(&pending_changed_);
+  }
+  if (store_thread_ != NULL) {
+    store_thread_->Join();
+    delete store_thread_;
+  }
+  pthread_cond_destroy(&pending_changed_);
+}
+
+bool RenderCache::CheckInitialized() const {
+  struct stat st;
+  if (stat(directory_.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+    fprintf(stderr, "<cache-dir>: '%s' not a directory.\n",
+            directory_.c_str());
+    return false;
+  }
+  if (access(directory_.c_str(), W_OK) != 0) {
+    fprintf(stderr, "<cache-dir>: '%s' not writable.\n", directory_.c_str());
+    return false;
+  }
+  return true;
+}
+
+// FNV-1a; we only need something reasonably collision free to name files.
+static void HashAppend(uint64_t *hash, const void *data, size_t len) {
+  const unsigned char *p = (const unsigned char*) data;
+  for (size_t i = 0; i < len; ++i) {
+    *hash ^= p[i];
+    *hash *= 0x100000001b3ULL;
+  }
+}
+
+std::string RenderCache::CreateKey(const std::string &underlying_file,
+                                   const struct stat &source,
+                                   const std::string &config_file,
+                                   time_t config_timestamp,
+                                   const std::string &encoder_profile,
+                                   int output_options) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  // Include the terminating \0 to separate the strings.
+  HashAppend(&hash, underlying_file.c_str(), underlying_file.length() + 1);
+  const int64_t source_mtime = source.st_mtime;
+  const int64_t source_size = source.st_size;
+  HashAppend(&hash, &source_mtime, sizeof(source_mtime));
+  HashAppend(&hash, &source_size, sizeof(source_size));
+  HashAppend(&hash, config_file.c_str(), config_file.length() + 1);
+  const int64_t config_mtime = config_timestamp;
+  HashAppend(&hash, &config_mtime, sizeof(config_mtime));
+  HashAppend(&hash, encoder_profile.c_str(), encoder_profile.length() + 1);
+  const int32_t options = output_options;
+  HashAppend(&hash, &options, sizeof(options));
+  return StringPrintf("%016llx", (unsigned long long) hash);
+}
+
+std::string RenderCache::EntryPath(const std::string &key) const {
+  return directory_ + "/" + key + kEntrySuffix;
+}
+
+int RenderCache::Open(const std::string &key) {
+  const int fd = open(EntryPath(key).c_str(), O_RDONLY);
+  folve::MutexLock l(&mutex_);
+  if (fd < 0) {
+    ++misses_;
+    return -1;
+  }
+  ++hits_;
+  // The modification time is our LRU-marker. Access time is not reliable,
+  // many people mount noatime.
+  utimes(EntryPath(key).c_str(), NULL);
+  DLogf("Render cache: hit for %s", key.c_str());
+  return fd;
+}
+
+bool RenderCache::Store(const std::string &key, ConversionBuffer *buffer) {
+  std::string tmp_name = directory_ + "/tmp-" + key + "-XXXXXX";
+  const int fd = mkstemp(&tmp_name[0]);
+  if (fd < 0) {
+    syslog(LOG_ERR, "Render cache: can't create file in %s: %s",
+           directory_.c_str(), strerror(errno));
+    return false;
+  }
+  const off_t expected_size = buffer->FileSize();
+  char buf[64 << 10];
+  off_t pos = 0;
+  bool success = true;
+  while (success && pos < expected_size) {
+    const ssize_t r = buffer->Read(buf, sizeof(buf), pos);
+    if (r <= 0) break;
+    success = (write(fd, buf, r) == r);
+    pos += r;
+  }
+  success &= (close(fd) == 0) && (pos == expected_size);
+  if (!success) {
+    syslog(LOG_ERR, "Render cache: failed to write %s", tmp_name.c_str());
+    unlink(tmp_name.c_str());
+    return false;
+  }
+
+  folve::MutexLock l(&mutex_);
+  if (rename(tmp_name.c_str(), EntryPath(key).c_str()) != 0) {
+    unlink(tmp_name.c_str());
+    return false;
+  }
+  DLogf("Render cache: stored %s (%lld bytes)", key.c_str(),
+        (long long) expected_size);
+  Evict_Locked();
+  return true;
+}
+
+void RenderCache::StoreLater(const std::string &key,
+                             ConversionBuffer *buffer) {
+  PendingStore store;
+  store.key = key;
+  store.buffer = buffer;
+  folve::MutexLock l(&pending_mutex_);
+  pending_.push_back(store);
+  if (store_thread_ == NULL) {
+    store_thread_ = new StoreThread(this);
+    store_thread_->Start();
+  }
+  pthread_cond_broadcast(&pending_changed_);
+}
+
+void RenderCache::WaitForPendingStores() {
+  folve::MutexLock l(&pending_mutex_);
+  while (!pending_.empty()) {
+    pending_mutex_.WaitOn(&pending_changed_);
+  }
+}
+
+void RenderCache::ProcessPendingStores() {
+  folve::MutexLock l(&pending_mutex_);
+  for (;;) {
+    while (pending_.empty() && !quit_) {
+      pending_mutex_.WaitOn(&pending_changed_);
+    }
+    if (pending_.empty())
+      return;
+    const PendingStore store = pending_.front();
+    pending_mutex_.Unlock();
+    Store(store.key, store.buffer);
+    delete store.buffer;
+    pending_mutex_.Lock();
+    pending_.pop_front();
+    pthread_cond_broadcast(&pending_changed_);
+  }
+}
+
+namespace {
+struct CacheEntry {
+  time_t mtime;
+  off_t size;
+  std::string path;
+};
+struct CompareEntryAge {
+  bool operator() (const CacheEntry *a, const CacheEntry *b) {
+    return a->mtime < b->mtime;
+  }
+};
+}  // namespace
+
+void RenderCache::Evict_Locked() {
+  // We only get here after storing a complete file, which doesn't happen
+  // often. So just scanning the directory is fine.
+  DIR *dp = opendir(directory_.c_str());
+  if (dp == NULL) return;
+  std::vector<CacheEntry> entries;
+  off_t total_size = 0;
+  struct dirent *dent;
+  while ((dent = readdir(dp)) != NULL) {
+    if (!folve::HasSuffix(dent->d_name, kEntrySuffix))
+      continue;
+    CacheEntry entry;
+    entry.path = directory_ + "/" + dent->d_name;
+    struct stat st;
+    if (stat(entry.path.c_str(), &st) != 0)
+      continue;
+    entry.mtime = st.st_mtime;
+    entry.size = st.st_size;
+    total_size += entry.size;
+    entries.push_back(entry);
+  }
+  closedir(dp);
+  if (total_size <= max_bytes_)
+    return;
+
+  std::vector<CacheEntry *> by_age;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    by_age.push_back(&entries[i]);
+  }
+  CompareEntryAge comparator;
+  std::sort(by_age.begin(), by_age.end(), comparator);
+  for (size_t i = 0; i < by_age.size() && total_size > max_bytes_; ++i) {
+    DLogf("Render cache: evict %s", by_age[i]->path.c_str());
+    if (unlink(by_age[i]->path.c_str()) == 0) {
+      total_size -= by_age[i]->size;
+    }
+  }
+}
@@ -0,0 +1,129 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_RENDER_CACHE_H
+#define FOLVE_RENDER_CACHE_H
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <deque>
+#include <string>
+
+#include "util.h"
+
+class ConversionBuffer;
+
+// A persistent, size-bounded directory of completely convolved files.
+//
+// Converting a file is expensive, but people tend to listen to the same
+// albums over and over again. So whenever we finished convolving a file, we
+// keep the result around in this directory; the next time the same file is
+// opened with the same filter, it can be served verbatim without any
+// DSP work.
+//
+// Entries are identified by a key derived from the underlying file and
+// the filter configuration (see CreateKey()). If the total size exceeds the
+// limit, the least recently used entries are removed.
+// Only standalone renderings belong here: a file joined gapless with its
+// neighbours starts with another file's tail or lacks its own.
+// This class is thread-safe.
+class RenderCache {
+public:
+  // Create a cache storing files in "directory", using at most "max_bytes"
+  // of disk space.
+  RenderCache(const std::string &directory, off_t max_bytes);
+
+  // Finishes all pending stores.
+  ~RenderCache();
+
+  const std::string &directory() const { return directory_; }
+  off_t max_bytes() const { return max_bytes_; }
+
+  // Check if the cache directory is usable. Prints a message to stderr
+  // and returns false if not.
+  bool CheckInitialized() const;
+
+  // Create a key for the given underlying file (with its current "source"
+  // stat() result) convolved with filter "config_file", which has the
+  // modification time "config_timestamp" (as ProcessorPool::
+  // GetConfigTimestamp() reports, including impulse files) and encoded with
+  // "encoder_profile" (see FolveFilesystem::EncoderProfileName()) from
+  // samples converted with "output_options" (folve::PCM_*).
+  static std::string CreateKey(const std::string &underlying_file,
+                               const struct stat &source,
+                               const std::string &config_file,
+                               time_t config_timestamp,
+                               const std::string &encoder_profile,
+                               int output_options);
+
+  // Open the finished rendering for the given key. Returns a read-only
+  // file descriptor the caller has to close() or -1 if there is no such entry.
+  int Open(const std::string &key);
+
+  // Store the complete content of the given conversion buffer under the
+  // given key. The buffer must already be complete.
+  // Returns 'true' if successful.
+  bool Store(const std::string &key, ConversionBuffer *buffer);
+
+  // Like Store(), but done in a background thread, so that the caller
+  // doesn't wait for the copy. Takes over ownership of the buffer, which
+  // is deleted once stored.
+  void StoreLater(const std::string &key, ConversionBuffer *buffer);
+
+  // Wait until everything passed to StoreLater() is stored.
+  void WaitForPendingStores();
+
+  // Some stats.
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+private:
+  class StoreThread;
+  friend class StoreThread;
+
+  struct PendingStore {
+    std::string key;
+    ConversionBuffer *buffer;
+  };
+
+  std::string EntryPath(const std::string &key) const;
+
+  // Store what is passed to StoreLater(). Called in the store thread;
+  // returns once asked to quit and nothing is pending anymore.
+  void ProcessPendingStores();
+
+  // Remove least recently used entries until we're below max_bytes_.
+  void Evict_Locked();
+
+  const std::string directory_;
+  const off_t max_bytes_;
+  folve::Mutex mutex_;
+  int hits_;
+  int misses_;
+
+  folve::Mutex pending_mutex_;   // Protects the following.
+  std::deque<PendingStore> pending_;  // Front is being stored.
+  bool quit_;
+  pthread_cond_t pending_changed_;
+  StoreThread *store_thread_;    // Lazily created.
+};
+
+#endif  // FOLVE_RENDER_CACHE_H
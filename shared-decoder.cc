@@ -0,0 +1,232 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include "shared-decoder.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+
+#include "metrics.h"
+#include "read-ahead-file.h"
+
+using folve::DLogf;
+
+// Frames are decoded in blocks of this size; we keep the blocks of that
+// many seconds.
+static const int kBlockFrames = 8192;
+static const int kWindowSeconds = 30;
+
+struct SharedDecoder::Stream {
+  struct Block {
+    sf_count_t start;
+    int frames;
+    float *data;
+  };
+
+  Stream(const std::string &k, const std::string &p, const SF_INFO &i)
+    : key(k), path(p), info(i), readers(0), filedes(-1), file(NULL), snd(NULL),
+      open_failed(false), decoded_end(0) {
+    max_blocks = std::max(4, kWindowSeconds * info.samplerate / kBlockFrames);
+  }
+  ~Stream() { Clear_Locked(); }
+
+  // Copy decoded frames from "pos" to "buffer", decoding more if "pos" is
+  // just at the end of what we have. Returns 0 if not available.
+  int Read(sf_count_t pos, float *buffer, int frames);
+
+  // Open our own SNDFILE. Returns 'false' on failure.
+  bool Open_Locked();
+
+  // Decode the next block. Returns 'false' at the end or on error.
+  bool DecodeBlock_Locked();
+  void Clear_Locked();
+
+  const std::string key;
+  const std::string path;
+  const SF_INFO info;
+  size_t max_blocks;
+
+  folve::Mutex mutex;         // Protects the following.
+  int readers;
+  int filedes;                // Our own input; opened once shared.
+  ReadAheadFile *file;
+  SNDFILE *snd;
+  bool open_failed;
+  std::deque<Block> blocks;   // Consecutive decoded frames.
+  sf_count_t decoded_end;     // Frame after the last block.
+};
+
+void SharedDecoder::Stream::Clear_Locked() {
+  for (size_t i = 0; i < blocks.size(); ++i) delete [] blocks[i].data;
+  blocks.clear();
+  if (snd) sf_close(snd);
+  snd = NULL;
+  delete file;
+  file = NULL;
+  if (filedes >= 0) close(filedes);
+  filedes = -1;
+}
+
+bool SharedDecoder::Stream::Open_Locked() {
+  filedes = open(path.c_str(), O_RDONLY);
+  if (filedes < 0) {
+    DLogf("Shared decoding of %s: %s", path.c_str(), strerror(errno));
+    return false;
+  }
+  file = new ReadAheadFile(filedes);
+  SF_INFO open_info;
+  memset(&open_info, 0, sizeof(open_info));
+  snd = file->Open(&open_info);
+  if (snd == NULL) {
+    DLogf("Shared decoding of %s: %s", path.c_str(), sf_strerror(NULL));
+    Clear_Locked();
+    return false;
+  }
+  return true;
+}
+
+bool SharedDecoder::Stream::DecodeBlock_Locked() {
+  Block block;
+  block.start = decoded_end;
+  block.data = new float[kBlockFrames * info.channels];
+  block.frames = sf_readf_float(snd, block.data, kBlockFrames);
+  if (block.frames <= 0) {
+    delete [] block.data;
+    return false;
+  }
+  blocks.push_back(block);
+  decoded_end += block.frames;
+  while (blocks.size() > max_blocks) {
+    delete [] blocks.front().data;
+    blocks.pop_front();
+  }
+  return true;
+}
+
+int SharedDecoder::Stream::Read(sf_count_t pos, float *buffer, int frames) {
+  folve::MutexLock l(&mutex);
+  if (readers < 2)
+    return 0;  // Not worth it; the reader decodes itself.
+  bool decoded_now = false;
+  if (blocks.empty() || pos == decoded_end) {
+    if (snd == NULL) {
+      if (open_failed || !Open_Locked()) {
+        open_failed = true;
+        return 0;
+      }
+    }
+    if (blocks.empty()) {
+      // Start wherever the first reader is.
+      if (sf_seek(snd, pos, SEEK_SET) != pos)
+        return 0;
+      decoded_end = pos;
+    }
+    if (!DecodeBlock_Locked())
+      return 0;
+    decoded_now = true;
+  }
+  if (pos < blocks.front().start || pos >= decoded_end)
+    return 0;  // Too far behind or ahead of the others.
+  const Block &block = blocks[(pos - blocks.front().start) / kBlockFrames];
+  const int offset = pos - block.start;
+  const int count = std::min(frames, block.frames - offset);
+  memcpy(buffer, block.data + offset * info.channels,
+         count * info.channels * sizeof(float));
+  if (!decoded_now) folve::metrics::shared_decode_frames.Add(count);
+  return count;
+}
+
+SharedDecoder::Reader::Reader(SharedDecoder *decoder, Stream *stream,
+                              SNDFILE *own)
+  : decoder_(decoder), stream_(stream), own_(own), pos_(0), own_pos_(0) {
+}
+
+SharedDecoder::Reader::~Reader() {
+  decoder_->Release(stream_);
+}
+
+bool SharedDecoder::Reader::Seek(sf_count_t frame) {
+  if (sf_seek(own_, frame, SEEK_SET) != frame)
+    return false;
+  pos_ = own_pos_ = frame;
+  return true;
+}
+
+int SharedDecoder::Reader::ReadFrames(float *buffer, int frames) {
+  int r = stream_->Read(pos_, buffer, frames);
+  if (r <= 0) {
+    if (own_pos_ != pos_) {
+      if (sf_seek(own_, pos_, SEEK_SET) != pos_)
+        return 0;
+      own_pos_ = pos_;
+    }
+    r = sf_readf_float(own_, buffer, frames);
+    if (r <= 0)
+      return 0;
+    own_pos_ += r;
+  }
+  pos_ += r;
+  return r;
+}
+
+SharedDecoder::SharedDecoder() {}
+
+SharedDecoder::~SharedDecoder() {
+  for (StreamMap::iterator it = streams_.begin(); it != streams_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+SharedDecoder::Reader *SharedDecoder::CreateReader(const std::string &key,
+                                                   const std::string &path,
+                                                   SNDFILE *own,
+                                                   const SF_INFO &info) {
+  folve::MutexLock l(&mutex_);
+  Stream *&stream = streams_[key];
+  if (stream == NULL) {
+    stream = new Stream(key, path, info);
+  }
+  folve::MutexLock sl(&stream->mutex);
+  ++stream->readers;
+  if (stream->readers == 2) {
+    DLogf("Sharing decoding of %s", path.c_str());
+  }
+  return new Reader(this, stream, own);
+}
+
+void SharedDecoder::Release(Stream *stream) {
+  folve::MutexLock l(&mutex_);
+  int readers;
+  {
+    folve::MutexLock sl(&stream->mutex);
+    readers = --stream->readers;
+    if (readers == 1) {
+      stream->Clear_Locked();   // Alone again; not needed anymore.
+      stream->open_failed = false;
+    }
+  }
+  if (readers == 0) {
+    streams_.erase(stream->key);
+    delete stream;
+  }
+}
@@ -0,0 +1,85 @@
+// -*- c++ -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#ifndef FOLVE_SHARED_DECODER_H
+#define FOLVE_SHARED_DECODER_H
+
+#include <sndfile.h>
+
+#include <map>
+#include <string>
+
+#include "sound-processor.h"
+#include "util.h"
+
+// Shares decoding of a sound file between several conversions of it, e.g.
+// if clients read the same file through different filter directories.
+//
+// Each conversion reads its input through a Reader. As long as it is the
+// only one for a file, the Reader decodes from its own SNDFILE. With more
+// of them, the decoded frames of the last couple of seconds are kept, so
+// that readers close to each other decode the file only once; a reader
+// outside that window falls back to its own SNDFILE.
+// This class is thread-safe; a Reader is to be used by one thread at a time.
+class SharedDecoder {
+private:
+  struct Stream;
+
+public:
+  class Reader : public SoundProcessor::FrameSource {
+  public:
+    ~Reader();
+
+    // Continue reading at "frame". Returns 'false' if the underlying file
+    // is not seekable.
+    bool Seek(sf_count_t frame);
+
+    // -- FrameSource interface
+    virtual int ReadFrames(float *buffer, int frames);
+
+  private:
+    friend class SharedDecoder;
+    Reader(SharedDecoder *decoder, Stream *stream, SNDFILE *own);
+
+    SharedDecoder *const decoder_;
+    Stream *const stream_;
+    SNDFILE *const own_;        // Not owned.
+    sf_count_t pos_;            // Next frame we return.
+    sf_count_t own_pos_;        // Position of own_.
+  };
+
+  SharedDecoder();
+  ~SharedDecoder();
+
+  // Create a reader for the file at "path", decoding with "own" (not
+  // owned; needs to outlive the reader) unless shared data is available.
+  // Readers with the same "key" share decoding; it needs to identify the
+  // file content, e.g. including the modification time.
+  Reader *CreateReader(const std::string &key, const std::string &path,
+                       SNDFILE *own, const SF_INFO &info);
+
+private:
+  typedef std::map<std::string, Stream*> StreamMap;
+
+  void Release(Stream *stream);
+
+  folve::Mutex mutex_;
+  StreamMap streams_;
+};
+
+#endif  // FOLVE_SHARED_DECODER_H
@@ -19,68 +19,251 @@
 #include "sound-processor.h"
 
 #include <assert.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <syslog.h>
 #include <unistd.h>
 
+#include <algorithm>
+
+#include "channel-ops.h"
+#include "impulse-store.h"
+#include "metrics.h"
 #include "util.h"
 
+using folve::DLogf;
+
 // There seems to be a bug somewhere inside the fftwf library or the use
 // within Convproc::configure()
 // It creates a double-delete somewhere if accessed with multiple threads.
 static folve::Mutex fftw_mutex;
 
-SoundProcessor *SoundProcessor::Create(const std::string &config_file,
-                                       int samplerate, int channels) {
-  ZitaConfig zita;
-  memset(&zita, 0, sizeof(zita));
-  zita.fsamp = samplerate;
-  zita.ninp = channels;
-  zita.nout = channels;
-  zita.convproc = new Convproc();
+// Runs Convproc::process() of one lane in its own thread, whenever
+// triggered by the SoundProcessor. We start with the priority of the thread
+// creating us, never a background one, and are raised while a thread with
+// higher priority waits for us, e.g. for playback. Going back down is always
+// permitted, coming back up from idle usually not; so background threads
+// don't get us to work for them.
+class SoundProcessor::LaneThread : public folve::Thread {
+public:
+  LaneThread(Convproc *convproc)
+    : folve::Thread(false), convproc_(convproc), pending_(false), quit_(false) {
+    pthread_cond_init(&work_cond_, NULL);
+    pthread_cond_init(&done_cond_, NULL);
+  }
+  virtual ~LaneThread() {
+    {
+      folve::MutexLock l(&mutex_);
+      quit_ = true;
+      pthread_cond_signal(&work_cond_);
+    }
+    Join();
+    pthread_cond_destroy(&work_cond_);
+    pthread_cond_destroy(&done_cond_);
+  }
+
+  // Start processing the current input.
+  void Trigger() {
+    folve::ThreadScheduling scheduling;
+    folve::GetThreadScheduling(&scheduling);
+    folve::MutexLock l(&mutex_);
+    scheduling_ = scheduling;
+    pending_ = true;
+    pthread_cond_signal(&work_cond_);
+  }
+
+  // Wait until triggered processing is done.
+  void WaitDone() {
+    folve::MutexLock l(&mutex_);
+    while (pending_) mutex_.WaitOn(&done_cond_);
+  }
+
+  virtual void Run() {
+    folve::PinToConversionCpus();
+    folve::ThreadScheduling baseline;
+    folve::GetThreadScheduling(&baseline);
+    folve::ThreadScheduling current = baseline;
+    folve::MutexLock l(&mutex_);
+    for (;;) {
+      while (!pending_ && !quit_) mutex_.WaitOn(&work_cond_);
+      if (quit_) return;
+      const folve::ThreadScheduling caller = scheduling_;
+      mutex_.Unlock();
+      const folve::ThreadScheduling &wanted
+        = folve::IsHigherScheduling(caller, baseline) ? caller : baseline;
+      if (folve::IsHigherScheduling(wanted, current)
+          || folve::IsHigherScheduling(current, wanted)) {
+        if (folve::SetThreadScheduling(wanted)) {
+          current = wanted;
+        } else {
+          // Not permitted to go that high; back to where we started.
+          folve::SetThreadScheduling(baseline);
+          current = baseline;
+        }
+      }
+      convproc_->process(true);
+      mutex_.Lock();
+      pending_ = false;
+      pthread_cond_signal(&done_cond_);
+    }
+  }
+
+private:
+  Convproc *const convproc_;
+  folve::Mutex mutex_;
+  pthread_cond_t work_cond_;
+  pthread_cond_t done_cond_;
+  folve::ThreadScheduling scheduling_;  // Of the thread triggering us.
+  bool pending_;
+  bool quit_;
+};
+
+int SoundProcessor::CreateLane(const std::string &config_file,
+                               int samplerate, int channels,
+                               int lane, int num_lanes, int profile,
+                               ImpulseSource *impulses, ZitaConfig *zita) {
+  memset(zita, 0, sizeof(*zita));
+  zita->fsamp = samplerate;
+  zita->ninp = channels;
+  zita->nout = channels;
+  zita->lane = lane;
+  zita->num_lanes = num_lanes;
+  zita->profile = profile;
+  zita->impulses = impulses;
+  zita->convproc = new Convproc();
+  int status;
   { // fftw threading bug workaround, see above.
     folve::MutexLock l(&fftw_mutex);
-    if ((config(&zita, config_file.c_str()) != 0)
-        || zita.convproc->inpdata(zita.ninp - 1) == NULL
-        || zita.convproc->outdata(zita.nout - 1) == NULL) {
+    status = config(zita, config_file.c_str());
+  }
+  if (status == 0
+      && (zita->convproc->inpdata(zita->ninp - 1) == NULL
+          || zita->convproc->outdata(zita->nout - 1) == NULL)) {
+    status = ERR_OTHER;
+  }
+  if (status != 0) {
+    delete zita->convproc;
+    zita->convproc = NULL;
+  }
+  return status;
+}
+
+SoundProcessor *SoundProcessor::Create(const std::string &config_file,
+                                       int samplerate, int channels,
+                                       int max_threads, int profile) {
+  std::vector<ZitaConfig> lanes;
+  ImpulseStore::Holder *impulses = new ImpulseStore::Holder();
+  int num_lanes = std::max(1, max_threads);
+  for (int lane = 0; lane < num_lanes; ++lane) {
+    ZitaConfig zita;
+    const int status = CreateLane(config_file, samplerate, channels,
+                                  lane, num_lanes, profile, impulses, &zita);
+    if (status == 0 && lane == 0 && zita.nout < num_lanes) {
+      // Not enough outputs to keep all threads busy. Start over.
+      delete zita.convproc;
+      num_lanes = zita.nout;
+      lane = -1;
+      continue;
+    }
+    if (status == ERR_LANE) {
+      syslog(LOG_INFO, "%s: /impulse/copy across outputs; can't use "
+             "multiple convolver threads.", config_file.c_str());
+      for (size_t i = 0; i < lanes.size(); ++i) delete lanes[i].convproc;
+      lanes.clear();
+      num_lanes = 1;
+      lane = -1;
+      continue;
+    }
+    if (status != 0) {
+      for (size_t i = 0; i < lanes.size(); ++i) delete lanes[i].convproc;
+      delete impulses;
       return NULL;
     }
+    lanes.push_back(zita);
   }
-  return new SoundProcessor(zita, config_file);
+  DLogf("%s: using %d convolver thread(s)", config_file.c_str(), num_lanes);
+  std::vector<std::string> dependencies(1, config_file);
+  dependencies.insert(dependencies.end(),
+                      impulses->files().begin(), impulses->files().end());
+  // The convolvers have their own copy of the impulses now.
+  delete impulses;
+  for (size_t i = 0; i < lanes.size(); ++i) lanes[i].impulses = NULL;
+  return new SoundProcessor(lanes, config_file, dependencies);
 }
 
-static time_t GetModificationTime(const std::string &filename) {
-  struct stat st;
-  stat(filename.c_str(), &st);
-  return st.st_mtime;
+static std::vector<time_t> GetModificationTimes(
+     const std::vector<std::string> &files) {
+  std::vector<time_t> result;
+  for (size_t i = 0; i < files.size(); ++i) {
+    struct stat st;
+    result.push_back(stat(files[i].c_str(), &st) == 0 ? st.st_mtime : 0);
+  }
+  return result;
 }
 
-SoundProcessor::SoundProcessor(const ZitaConfig &config, const std::string &cfg)
-  : zita_config_(config), config_file_(cfg),
-    config_file_timestamp_(GetModificationTime(cfg)),
-    buffer_(new float[config.fragm
+SoundProcessor::SoundProcessor(const std::vector<ZitaConfig> &lanes,
+                               const std::string &cfg,
+                               const std::vector<std::string> &dependencies)
+  : zita_config_(lanes[0]), lanes_(lanes),
+    config_file_(cfg), dependencies_(dependencies),
+    dependency_timestamps_(GetModificationTimes(dependencies)),
+    config_file_timestamp_(*std::max_element(dependency_timestamps_.begin(),
+                                             dependency_timestamps_.end())),
+    watch_generation_(-1),
+    buffer_(new float[zita_config_.fragm
                       * std::max(input_channels(), output_channels())]),
+    pcm_buffer_(new int[zita_config_.fragm * output_channels()]),
+    output_options_(0),
     input_pos_(0), output_pos_(0),
     max_out_value_observed_(0.0) {
+  input_channels_.resize(input_channels());
+  output_channels_.resize(output_channels());
   Reset();
 }
 
 SoundProcessor::~SoundProcessor() {
-  zita_config_.convproc->stop_process();
-  zita_config_.convproc->cleanup();
-  delete zita_config_.convproc;
+  for (size_t i = 0; i < lane_threads_.size(); ++i) {
+    delete lane_threads_[i];
+  }
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    lanes_[i].convproc->stop_process();
+    lanes_[i].convproc->cleanup();
+    delete lanes_[i].convproc;
+  }
   delete [] buffer_;
+  delete [] pcm_buffer_;
 }
 
-int SoundProcessor::FillBuffer(SNDFILE *in) {
+int SoundProcessor::FillBuffer(FrameSource *in) {
   const int samples_needed = zita_config_.fragm - input_pos_;
   assert(samples_needed);  // Otherwise, call WriteProcessed() first.
   output_pos_ = -1;
-  int r = sf_readf_float(in, buffer_ + input_pos_ * input_channels(),
-                         samples_needed);
-  input_pos_ += r;
-  return r;
+  int total = 0;
+  while (total < samples_needed) {
+    const int r = in->ReadFrames(buffer_ + input_pos_ * input_channels(),
+                                 samples_needed - total);
+    if (r <= 0) break;
+    input_pos_ += r;
+    total += r;
+  }
+  return total;
+}
+
+// Bits of the integer samples "out" is written with; 0 if it is better
+// fed with floats.
+static int GetIntegerBits(SNDFILE *out) {
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  sf_command(out, SFC_GET_CURRENT_SF_INFO, &info, sizeof(info));
+  switch (info.format & SF_FORMAT_SUBMASK) {
+  case SF_FORMAT_PCM_S8:
+  case SF_FORMAT_PCM_U8: return 8;
+  case SF_FORMAT_PCM_16: return 16;
+  case SF_FORMAT_PCM_24: return 24;
+  default: return 0;   // Floats, more bits than floats have, lossy...
+  }
 }
 
 void SoundProcessor::WriteProcessed(SNDFILE *out, int sample_count) {
@@ -88,7 +271,20 @@ void SoundProcessor::WriteProcessed(SNDFILE *out, int sample_count) {
     Process();
   }
   assert(sample_count <= zita_config_.fragm - output_pos_);
-  sf_writef_float(out, buffer_ + output_pos_ * output_channels(), sample_count);
+  if (out != NULL) {
+    folve::ScopedTimer timer(&folve::metrics::encode_time);
+    const float *samples = buffer_ + output_pos_ * output_channels();
+    const int bits = GetIntegerBits(out);
+    if (bits > 0) {
+      // Converting ourselves is faster than libsndfile's generic way and
+      // clips instead of letting values overflow.
+      folve::ConvertToPcm(samples, sample_count * output_channels(), bits,
+                          output_options_, &dither_, pcm_buffer_);
+      sf_writef_int(out, pcm_buffer_, sample_count);
+    } else {
+      sf_writef_float(out, samples, sample_count);
+    }
+  }
   output_pos_ += sample_count;
   if (output_pos_ == zita_config_.fragm) {
     input_pos_ = 0;
@@ -96,40 +292,75 @@ void SoundProcessor::WriteProcessed(SNDFILE *out, int sample_count) {
 }
 
 void SoundProcessor::Process() {
+  folve::ScopedTimer timer(&folve::metrics::process_time);
   const int samples_missing = zita_config_.fragm - input_pos_;
   if (samples_missing) {
     memset(buffer_ + input_pos_ * input_channels(), 0x00,
            samples_missing * input_channels() * sizeof(float));
   }
 
-  // Flatten channels: LRLRLRLRLR -> LLLLL and RRRRR
+  // The convolver moves its buffers on with every process(), so we need to
+  // ask for the current location each time.
   for (int ch = 0; ch < input_channels(); ++ch) {
-    float *dest = zita_config_.convproc->inpdata(ch);
-    for (int j = 0; j < input_pos_; ++j) {
-      dest[j] = buffer_[j * input_channels() + ch];
+    input_channels_[ch] = zita_config_.convproc->inpdata(ch);
+  }
+
+  // Flatten channels: LRLRLRLRLR -> LLLLL and RRRRR
+  folve::DeinterleaveChannels(buffer_, input_channels(), input_pos_,
+                              &input_channels_[0]);
+  // All lanes see the same input.
+  for (size_t i = 1; i < lanes_.size(); ++i) {
+    for (int ch = 0; ch < input_channels(); ++ch) {
+      memcpy(lanes_[i].convproc->inpdata(ch), input_channels_[ch],
+             zita_config_.fragm * sizeof(float));
     }
   }
 
-  zita_config_.convproc->process();
+  // Background threads do all the work themselves; they would drag the
+  // lane threads down to their priority, and these might not be permitted
+  // to come up again. The lane threads are started by the first other
+  // thread that needs them, so they start with its priority.
+  const bool parallel = lanes_.size() > 1 && !folve::IsBackgroundThread();
+  if (parallel && lane_threads_.empty()) {
+    for (size_t i = 1; i < lanes_.size(); ++i) {
+      LaneThread *thread = new LaneThread(lanes_[i].convproc);
+      thread->Start();
+      lane_threads_.push_back(thread);
+    }
+  }
+  if (parallel) {
+    for (size_t i = 0; i < lane_threads_.size(); ++i) {
+      lane_threads_[i]->Trigger();
+    }
+  }
+  // With partitions larger than the fragment, these are computed in
+  // background threads; we need to wait for them.
+  zita_config_.convproc->process(true);
+  if (parallel) {
+    for (size_t i = 0; i < lane_threads_.size(); ++i) {
+      lane_threads_[i]->WaitDone();
+    }
+  } else {
+    for (size_t i = 1; i < lanes_.size(); ++i) {
+      lanes_[i].convproc->process(true);
+    }
+  }
 
-  // Join channels again.
+  // Join channels again. Each output is produced by the lane it belongs to.
   for (int ch = 0; ch < output_channels(); ++ch) {
-    float *source = zita_config_.convproc->outdata(ch);
-    for (int j = 0; j < input_pos_; ++j) {
-      buffer_[j * output_channels() + ch] = source[j];
-      const float out_abs = source[j];
-      if (out_abs > max_out_value_observed_) {
-        max_out_value_observed_ = out_abs;
-      }
-    }
+    output_channels_[ch] = lanes_[ch % lanes_.size()].convproc->outdata(ch);
+  }
+  const float peak = folve::InterleaveChannels(&output_channels_[0],
+                                               output_channels(), input_pos_,
+                                               buffer_);
+  if (peak > max_out_value_observed_) {
+    max_out_value_observed_ = peak;
   }
   output_pos_ = 0;
 }
 
 bool SoundProcessor::ConfigStillUpToDate() const {
-  // TODO(hzeller): this should as well check if any *.wav file mentioned in
-  // config is still the same timestamp.
-  return config_file_timestamp_ == GetModificationTime(config_file_);
+  return dependency_timestamps_ == GetModificationTimes(dependencies_);
 }
 
 void SoundProcessor::ResetMaxValues() {
@@ -137,9 +368,15 @@ void SoundProcessor::ResetMaxValues() {
 }
 
 void SoundProcessor::Reset() {
-  zita_config_.convproc->reset();
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    lanes_[i].convproc->reset();
+  }
   input_pos_ = 0;
   output_pos_ = -1;
   ResetMaxValues();
-  zita_config_.convproc->start_process(0, 0);
+  int policy, priority;
+  folve::GetPlaybackRealtimeScheduling(&policy, &priority);
+  for (size_t i = 0; i < lanes_.size(); ++i) {
+    lanes_[i].convproc->start_process(priority, policy);
+  }
 }
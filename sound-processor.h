@@ -19,23 +19,46 @@
 #ifndef FOLVE_SOUND_PROCESSOR_H
 #define FOLVE_SOUND_PROCESSOR_H
 
+#include <stdint.h>
+
 #include <string>
+#include <vector>
 #include <sndfile.h>
 
+#include "channel-ops.h"
 #include "zita-config.h"
 
 // The workhorse of processing data from soundfiles.
 class SoundProcessor {
 public:
+  // Provides interleaved input frames.
+  class FrameSource {
+  public:
+    virtual ~FrameSource() {}
+
+    // Read up to "frames" frames into "buffer". Returns the number of frames
+    // read; 0 at the end of the input.
+    virtual int ReadFrames(float *buffer, int frames) = 0;
+  };
+
+  // Create a sound processor from the given configuration file.
+  // With "max_threads" > 1, outputs are distributed among up to that many
+  // separate convolvers that are processed in parallel threads; this only
+  // works if the configuration doesn't /impulse/copy between these.
+  // "profile" is the default partition layout (PROFILE_* in zita-config.h)
+  // if the configuration doesn't choose one.
   static SoundProcessor *Create(const std::string &config_file,
-                                int samplerate, int channels);
+                                int samplerate, int channels,
+                                int max_threads, int profile);
   ~SoundProcessor();
 
-  // Fill Buffer from given sound file. Returns number of samples read.
-  int FillBuffer(SNDFILE *in);
+  // Fill Buffer from given source. Returns number of samples read; less
+  // than needed only at the end of the input.
+  int FillBuffer(FrameSource *in);
 
   inline int input_channels() const { return zita_config_.ninp; }
   inline int output_channels() const { return zita_config_.nout;}
+  inline int sample_rate() const { return zita_config_.fsamp; }
 
   // Returns if the input buffer has enought samples for the FIR-filter
   // to process. If not, another call to FillBuffer() is needed.
@@ -51,9 +74,15 @@ public:
 
   // Write number of processed samples out to given soundfile. Processes
   // the data first if necessary. assert(), that there is at least 1 sample
-  // to process.
+  // to process. If "out" is NULL, the samples are discarded.
+  // Integer formats up to 24 bits get samples already converted to their
+  // bit depth, as determined by set_output_options().
   void WriteProcessed(SNDFILE *out, int sample_count);
 
+  // folve::PCM_* options for converting to integer outputs. Default 0:
+  // just clip.
+  void set_output_options(int options) { output_options_ = options; }
+
   // Reset procesor for re-use
   void Reset();
 
@@ -63,20 +92,66 @@ public:
 
   // Config file used to create this processor.
   const std::string &config_file() const { return config_file_; }
+
+  // The config file and all impulse files read by it.
+  const std::vector<std::string> &dependencies() const { return dependencies_; }
+
+  // Newest modification time of the dependencies.
   time_t config_file_timestamp() const { return config_file_timestamp_; }
 
-  // Verifies if configuration is still up-to-date.
+  // Verifies if configuration is still up-to-date by looking at the
+  // modification times of all dependencies.
   bool ConfigStillUpToDate() const;
 
+  // ConfigWatcher generation at the time this processor was created, or -1
+  // if its dependencies are not watched. Maintained by the ProcessorPool.
+  int64_t watch_generation() const { return watch_generation_; }
+  void set_watch_generation(int64_t generation) {
+    watch_generation_ = generation;
+  }
+
+  // Maximum length of the impulse responses in frames. This is the number
+  // of input frames it takes until the output doesn't depend on the past
+  // anymore.
+  int filter_length() const { return zita_config_.size; }
+
+  // Number of frames processed in one go.
+  int fragment_size() const { return zita_config_.fragm; }
+
+  // Number of convolvers working in parallel.
+  int lane_count() const { return lanes_.size(); }
+
 private:
-  SoundProcessor(const ZitaConfig &config, const std::string &cfg_file);
+  class LaneThread;
+
+  SoundProcessor(const std::vector<ZitaConfig> &lanes,
+                 const std::string &cfg_file,
+                 const std::vector<std::string> &dependencies);
   void Process();
 
-  const ZitaConfig zita_config_;
+  // Create convolver for the given lane. Returns the config() status.
+  static int CreateLane(const std::string &config_file,
+                        int samplerate, int channels,
+                        int lane, int num_lanes, int profile,
+                        ImpulseSource *impulses, ZitaConfig *result);
+
+  const ZitaConfig zita_config_;   // Lane 0; determines the parameters.
+  const std::vector<ZitaConfig> lanes_;
+  std::vector<LaneThread*> lane_threads_;  // Lanes 1..n-1; see Process().
+  // Per channel convolver input and output of the responsible lane; only
+  // valid for one Process().
+  std::vector<float*> input_channels_;
+  std::vector<const float*> output_channels_;
   const std::string config_file_;
+  const std::vector<std::string> dependencies_;
+  const std::vector<time_t> dependency_timestamps_;
   const time_t config_file_timestamp_;
+  int64_t watch_generation_;
 
   float *const buffer_;
+  int *const pcm_buffer_;   // Output converted to integer.
+  int output_options_;
+  folve::DitherState dither_;
   // TODO: instead of two positions, better have one position and two states
   // READ, WRITE
   int input_pos_;
@@ -0,0 +1,211 @@
+//  -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//  Folve - A fuse filesystem that convolves audio files on-the-fly.
+//
+//  Copyright (C) 2012 Henner Zeller <h.zeller@acm.org>
+//
+//  This program is free software; you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation; either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  This program is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+// Convolves a known signal with a filter made of dirac pulses over many
+// fragments and compares the output with what it has to be; for every
+// partition layout, with one and with several convolver threads.
+
+#include <math.h>
+#include <sndfile.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include "sound-processor.h"
+#include "zita-config.h"
+
+namespace {
+const int kSampleRate = 44100;
+const int kChannels = 2;
+const int kInputFrames = 20000;   // Many fragments with either profile.
+const int kFilterSize = 2048;
+const float kTolerance = 1e-4;
+
+struct Dirac {
+  int in, out;    // Channels, starting at 0.
+  float gain;
+  int delay;
+};
+
+// Delays crossing the boundaries of fragments and partitions.
+const Dirac kFilter[] = {
+  { 0, 0,  0.5,    0 },
+  { 0, 0,  0.25, 700 },
+  { 1, 1,  0.5,    3 },
+  { 1, 1, -0.25, 1500 },
+  { 0, 1,  0.125, 129 },
+};
+const int kFilterCount = sizeof(kFilter) / sizeof(kFilter[0]);
+
+// Deterministic noise, followed by silence for the filter tail.
+class NoiseSource : public SoundProcessor::FrameSource {
+public:
+  NoiseSource(int frames, int tail) : frames_(frames), tail_(tail), pos_(0) {
+    unsigned int state = 42;
+    for (int i = 0; i < frames * kChannels; ++i) {
+      state = state * 1103515245 + 12345;
+      samples_.push_back(((state >> 16) & 0x7fff) / 65536.0 - 0.25);
+    }
+  }
+
+  virtual int ReadFrames(float *buffer, int frames) {
+    int r = 0;
+    for (/**/; r < frames && pos_ < frames_ + tail_; ++r, ++pos_) {
+      for (int ch = 0; ch < kChannels; ++ch) {
+        *buffer++ = (pos_ < frames_) ? input(pos_, ch) : 0.0;
+      }
+    }
+    return r;
+  }
+
+  float input(int frame, int ch) const {
+    if (frame < 0 || frame >= frames_) return 0.0;
+    return samples_[frame * kChannels + ch];
+  }
+
+private:
+  const int frames_;
+  const int tail_;
+  int pos_;
+  std::vector<float> samples_;
+};
+
+bool WriteConfig(const std::string &filename, const char *profile) {
+  FILE *config = fopen(filename.c_str(), "w");
+  if (config == NULL) return false;
+  fprintf(config, "/convolver/profile %s\n", profile);
+  fprintf(config, "/convolver/new %d %d 64 %d\n",
+          kChannels, kChannels, kFilterSize);
+  for (int i = 0; i < kFilterCount; ++i) {
+    fprintf(config, "/impulse/dirac %d %d %f %d\n",
+            kFilter[i].in + 1, kFilter[i].out + 1, kFilter[i].gain,
+            kFilter[i].delay);
+  }
+  return fclose(config) == 0;
+}
+
+// Returns the number of mismatching samples; -1 on setup errors.
+int RunConvolution(const std::string &config_file, int threads,
+                   int expected_fragment) {
+  SoundProcessor *processor = SoundProcessor::Create(config_file, kSampleRate,
+                                                     kChannels, threads,
+                                                     PROFILE_THROUGHPUT);
+  if (processor == NULL) {
+    fprintf(stderr, "Can't create processor from %s\n", config_file.c_str());
+    return -1;
+  }
+  char out_file[] = "/tmp/folve-test-out-XXXXXX";
+  const int fd = mkstemp(out_file);
+  if (fd < 0) {
+    delete processor;
+    return -1;
+  }
+  close(fd);
+  SF_INFO info;
+  memset(&info, 0, sizeof(info));
+  info.samplerate = kSampleRate;
+  info.channels = kChannels;
+  info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+  SNDFILE *out = sf_open(out_file, SFM_WRITE, &info);
+  if (out == NULL) {
+    delete processor;
+    unlink(out_file);
+    return -1;
+  }
+  NoiseSource source(kInputFrames, kFilterSize);
+  int r;
+  while ((r = processor->FillBuffer(&source)) > 0) {
+    processor->WriteProcessed(out, r);
+  }
+  sf_close(out);
+  const int fragment = processor->fragment_size();
+  const int lanes = processor->lane_count();
+  delete processor;
+  if (fragment != expected_fragment) {
+    fprintf(stderr, "Expected fragment size %d, got %d\n",
+            expected_fragment, fragment);
+    unlink(out_file);
+    return -1;
+  }
+
+  const int total_frames = kInputFrames + kFilterSize;
+  std::vector<float> output(total_frames * kChannels);
+  memset(&info, 0, sizeof(info));
+  SNDFILE *in = sf_open(out_file, SFM_READ, &info);
+  const int got = in ? sf_readf_float(in, &output[0], total_frames) : 0;
+  if (in) sf_close(in);
+  unlink(out_file);
+  if (got != total_frames) {
+    fprintf(stderr, "Expected %d output frames, got %d\n", total_frames, got);
+    return -1;
+  }
+
+  int errors = 0;
+  for (int frame = 0; frame < total_frames; ++frame) {
+    for (int ch = 0; ch < kChannels; ++ch) {
+      float expected = 0.0;
+      for (int i = 0; i < kFilterCount; ++i) {
+        if (kFilter[i].out != ch) continue;
+        expected += kFilter[i].gain * source.input(frame - kFilter[i].delay,
+                                                   kFilter[i].in);
+      }
+      const float value = output[frame * kChannels + ch];
+      if (fabs(value - expected) > kTolerance) {
+        if (errors < 5) {
+          fprintf(stderr, "  frame %d channel %d: expected %f, got %f\n",
+                  frame, ch, expected, value);
+        }
+        ++errors;
+      }
+    }
+  }
+  fprintf(stderr, "%s, %d thread(s): fragment %d, %d lane(s): %s\n",
+          config_file.c_str(), threads, fragment, lanes,
+          errors ? "FAIL" : "ok");
+  return errors;
+}
+}  // namespace
+
+int main(int argc, char *argv[]) {
+  // The latency profile processes in fragments of the smallest partition,
+  // while the partitions grow up to the throughput fragment.
+  const struct { const char *name; int fragment; } profiles[] = {
+    { "throughput", kFilterSize },
+    { "latency",    64 },
+  };
+  const int profile_count = sizeof(profiles) / sizeof(profiles[0]);
+  int failures = 0;
+  for (int p = 0; p < profile_count; ++p) {
+    const std::string config_file = std::string("/tmp/folve-test-")
+      + profiles[p].name + ".conf";
+    if (!WriteConfig(config_file, profiles[p].name)) {
+      perror(config_file.c_str());
+      return 1;
+    }
+    for (int threads = 1; threads <= 2; ++threads) {
+      if (RunConvolution(config_file, threads, profiles[p].fragment) != 0)
+        ++failures;
+    }
+    unlink(config_file.c_str());
+  }
+  return failures == 0 ? 0 : 1;
+}
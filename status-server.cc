@@ -33,6 +33,8 @@
 #include <algorithm>
 
 #include "folve-filesystem.h"
+#include "metrics.h"
+#include "render-ahead.h"
 #include "status-server.h"
 #include "util.h"
 
@@ -48,6 +50,11 @@ static const char kActiveBufferProgress[]  = "#bbffbb";
 static const char kRetiredAccessProgress[] = "#d0d0e8";
 static const char kRetiredBufferProgress[] = "#e0f0e0";
 static const char kSettingsUrl[] = "/settings";
+static const char kMetricsUrl[] = "/metrics";
+static const char kJsonStatusUrl[] = "/status.json";
+static const char kRenderAheadUrl[] = "/render-ahead";
+static const size_t kMaxShownRenderQueue = 10;
+static const int kHttpThreads = 2;
 
 // Aaah, I need to find the right Browser-Tab :)
 // Sneak in a favicon without another resource access.
@@ -154,8 +161,33 @@ int StatusServer::HandleHttp(void* user_argument,
                                                MHD_RESPMEM_PERSISTENT);
     MHD_add_response_header(response, "Location", "/");
     ret = MHD_queue_response(connection, 302, response);
+  } else if (strcmp(url, kRenderAheadUrl) == 0) {
+    server->QueueRenderAhead(MHD_lookup_connection_value(connection,
+                                                         MHD_GET_ARGUMENT_KIND,
+                                                         "path"));
+    response = MHD_create_response_from_buffer(0, (void*)"",
+                                               MHD_RESPMEM_PERSISTENT);
+    MHD_add_response_header(response, "Location", "/");
+    ret = MHD_queue_response(connection, 302, response);
+  } else if (strcmp(url, kMetricsUrl) == 0 || strcmp(url, kJsonStatusUrl) == 0) {
+    const bool json = (strcmp(url, kJsonStatusUrl) == 0);
+    std::string content;
+    if (json) {
+      server->CreateJsonStatus(&content);
+    } else {
+      server->CreateMetricsPage(&content);
+    }
+    response = MHD_create_response_from_buffer(content.length(),
+                                               (void*) content.data(),
+                                               MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(response, "Content-Type",
+                            json
+                            ? "application/json; charset=utf-8"
+                            : "text/plain; version=0.0.4; charset=utf-8");
+    ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
   } else {
-    const std::string &page = server->CreateHttpPage();
+    std::string page;
+    server->GetHttpPage(&page);
     response = MHD_create_response_from_buffer(page.length(),
                                                (void*) page.data(),
                                                MHD_RESPMEM_MUST_COPY);
@@ -173,7 +205,8 @@ int StatusServer::HandleHttp(void* user_argument,
 StatusServer::StatusServer(FolveFilesystem *fs)
   : expunged_retired_(0),
     meta_refresh_time_(-1),
-    filesystem_(fs), daemon_(NULL), filter_switched_(false) {
+    filesystem_(fs), daemon_(NULL), http_page_time_(0),
+    filter_switched_(false) {
   fs->handler_cache()->SetObserver(this);
 }
 
@@ -183,12 +216,31 @@ FileHandler *StatusServer::CreateStatusFileHandler() {
 
 void StatusServer::SetFilter(const char *filter) {
   if (filter == NULL) return;
-  filter_switched_ = filesystem_->SwitchCurrentConfigDir(filter);
+  const bool switched = filesystem_->SwitchCurrentConfigDir(filter);
+  {
+    folve::MutexLock l(&page_mutex_);
+    filter_switched_ = switched;
+  }
+  InvalidateHttpPage();
+}
+
+void StatusServer::QueueRenderAhead(const char *fs_path) {
+  if (fs_path == NULL) return;
+  std::string error;
+  const int queued = filesystem_->render_ahead()->Enqueue(fs_path, &error);
+  {
+    folve::MutexLock l(&page_mutex_);
+    render_ahead_message_ = (queued < 0)
+      ? error
+      : folve::StringPrintf("Queued %d files.", queued);
+  }
+  InvalidateHttpPage();
 }
 
 bool StatusServer::Start(int port) {
   daemon_ = MHD_start_daemon(MHD_USE_SELECT_INTERNALLY, port, NULL, NULL,
                              &HandleHttp, this,
+                             MHD_OPTION_THREAD_POOL_SIZE, kHttpThreads,
                              MHD_OPTION_END);
   return daemon_ != NULL;
 }
@@ -364,6 +416,49 @@ void StatusServer::AppendSettingsForm(bool for_http, std::string *out) {
   out->append("</p>");
 }
 
+void StatusServer::AppendRenderAhead(bool for_http, std::string *out) {
+  RenderAhead::Status status;
+  filesystem_->render_ahead()->GetStatus(&status);
+  out->append("<h3>Render Ahead</h3>\n");
+  if (for_http) {
+    Appendf(out, "<form action='%s'>Directory or playlist: "
+            "<input name='path' size='50'/> "
+            "<input type='submit' value='Queue'/>", kRenderAheadUrl);
+    if (!render_ahead_message_.empty()) {
+      out->append(" <span style='font-size:small;background:#FFFFa0;'>");
+      AppendSanitizedHTML(render_ahead_message_, out);
+      out->append("</span>");
+      render_ahead_message_.clear();  // only show once.
+    }
+    out->append("</form>\n");
+  }
+  Appendf(out, "Done <b>%d</b>, failed <b>%d</b>, queued <b>%d</b>.\n",
+          status.done, status.failed, (int) status.queued.size());
+  if (!status.current.empty() || !status.queued.empty()) {
+    out->append("<table>\n");
+    if (!status.current.empty()) {
+      Appendf(out, "<tr><td><div class='pf'><div style='width:%dpx;"
+              "background:%s;'>&nbsp;</div></div></td><td class='fn'>",
+              (int) (kProgressWidth * status.current_progress),
+              kActiveBufferProgress);
+      AppendSanitizedHTML(status.current, out);
+      out->append("</td></tr>\n");
+    }
+    for (size_t i = 0; i < status.queued.size(); ++i) {
+      out->append("<tr><td></td><td class='fn'>");
+      if (i == kMaxShownRenderQueue) {
+        Appendf(out, "... (%d more)</td></tr>\n",
+                (int) (status.queued.size() - i));
+        break;
+      }
+      AppendSanitizedHTML(status.queued[i], out);
+      out->append("</td></tr>\n");
+    }
+    out->append("</table>\n");
+  }
+  out->append("<hr/>\n");
+}
+
 struct CompareStats {
   bool operator() (const HandlerStats *a, const HandlerStats *b) {
     if (a->status < b->status) return true;   // open before idle.
@@ -373,16 +468,29 @@ struct CompareStats {
 };
 
 
-const std::string &StatusServer::CreateHttpPage() {
-  CreatePage(true, &http_content_);
-  return http_content_;
+void StatusServer::GetHttpPage(std::string *page) {
+  // Browsers refreshing the page all get the same one, for up to one refresh
+  // interval; so that watching doesn't cost more with more watchers.
+  folve::MutexLock l(&http_page_mutex_);
+  const double max_age = meta_refresh_time_ > 0 ? meta_refresh_time_ : 1;
+  const double now = folve::CurrentTime();
+  if (now - http_page_time_ >= max_age) {
+    CreatePage(true, &http_content_);
+    http_page_time_ = now;
+    folve::metrics::status_pages_rendered.Add(1);
+  }
+  *page = http_content_;
+}
+
+void StatusServer::InvalidateHttpPage() {
+  folve::MutexLock l(&http_page_mutex_);
+  http_page_time_ = 0;
 }
 
 void StatusServer::CreatePage(bool for_http, std::string *content) {
   const double start = folve::CurrentTime();
-  // We re-use a string to avoid re-allocing memory every time we generate
-  // a page. Since we run with MHD_USE_SELECT_INTERNALLY, this is only accessed
-  // by one thread.
+  // Several HTTP threads and the status file might ask at the same time.
+  folve::MutexLock l(&page_mutex_);
   content->clear();
   content->append(kStartHtmlHeader);
   if (for_http && meta_refresh_time_ > 0) {
@@ -457,10 +565,14 @@ void StatusServer::CreatePage(bool for_http, std::string *content) {
   }
   content->append("</table><hr/>\n");
 
+  if (filesystem_->render_cache() != NULL) {
+    AppendRenderAhead(for_http, content);
+  }
+
+  folve::MutexLock rl(&retired_mutex_);
   if (retired_.size() > 0) {
     content->append("<h3>Retired</h3>\n");
     content->append("<table>\n");
-    folve::MutexLock l(&retired_mutex_);
     for (RetiredList::const_iterator it = retired_.begin();
          it != retired_.end(); ++it) {
       AppendFileInfo(kRetiredAccessProgress, kRetiredBufferProgress, *it,
@@ -483,3 +595,120 @@ void StatusServer::CreatePage(bool for_http, std::string *content) {
           "<a href='http://www.gnu.org/licenses/gpl.html'>GPLv3</a>.</span>"
           "</body></html>\n", duration * 1000.0);
 }
+
+static void AppendJsonString(const std::string &in, std::string *out) {
+  out->append("\"");
+  for (std::string::const_iterator i = in.begin(); i != in.end(); ++i) {
+    switch (*i) {
+    case '"':  out->append("\\\""); break;
+    case '\\': out->append("\\\\"); break;
+    default:
+      if ((unsigned char) *i < 0x20) {
+        Appendf(out, "\\u%04x", (unsigned char) *i);
+      } else {
+        out->append(1, *i);
+      }
+    }
+  }
+  out->append("\"");
+}
+
+static void AppendJsonStats(const HandlerStats &stats, std::string *out) {
+  static const char *const kStatusNames[] = { "open", "idle", "retired" };
+  out->append("{\"filename\":");
+  AppendJsonString(stats.filename, out);
+  out->append(",\"format\":");
+  AppendJsonString(stats.format, out);
+  out->append(",\"filter\":");
+  AppendJsonString(stats.filter_dir, out);
+  out->append(",\"message\":");
+  AppendJsonString(stats.message, out);
+  Appendf(out, ",\"status\":\"%s\",\"duration_seconds\":%d,"
+          "\"access_progress\":%.4f,\"buffer_progress\":%.4f,"
+          "\"last_access\":%.3f,\"max_output_value\":%.5f,"
+          "\"in_gapless\":%s,\"out_gapless\":%s}",
+          kStatusNames[stats.status], stats.duration_seconds,
+          stats.access_progress, stats.buffer_progress,
+          stats.last_access, stats.max_output_value,
+          stats.in_gapless ? "true" : "false",
+          stats.out_gapless ? "true" : "false");
+}
+
+void StatusServer::CreateJsonStatus(std::string *content) {
+  content->clear();
+  content->append("{\"version\":");
+  AppendJsonString(FOLVE_VERSION, content);
+  content->append(",\"filter\":");
+  AppendJsonString(filesystem_->current_config_subdir(), content);
+  Appendf(content, ",\"total_file_openings\":%d,\"total_file_reopen\":%d,"
+          "\"prebuffer_queue_depth\":%d",
+          filesystem_->total_file_openings(),
+          filesystem_->total_file_reopen(),
+          filesystem_->prebuffer_queue_depth());
+
+  std::vector<HandlerStats> stat_list;
+  filesystem_->handler_cache()->GetStats(&stat_list);
+  content->append(",\"files\":[");
+  for (size_t i = 0; i < stat_list.size(); ++i) {
+    if (i > 0) content->append(",");
+    AppendJsonStats(stat_list[i], content);
+  }
+  content->append("],\"retired\":[");
+  {
+    folve::MutexLock l(&retired_mutex_);
+    for (RetiredList::const_iterator it = retired_.begin();
+         it != retired_.end(); ++it) {
+      if (it != retired_.begin()) content->append(",");
+      AppendJsonStats(*it, content);
+    }
+  }
+  content->append("]");
+  if (filesystem_->render_cache() != NULL) {
+    RenderAhead::Status status;
+    filesystem_->render_ahead()->GetStatus(&status);
+    content->append(",\"render_ahead\":{\"current\":");
+    AppendJsonString(status.current, content);
+    Appendf(content, ",\"current_progress\":%.4f,\"done\":%d,"
+            "\"failed\":%d,\"queued\":[",
+            status.current_progress, status.done, status.failed);
+    for (size_t i = 0; i < status.queued.size(); ++i) {
+      if (i > 0) content->append(",");
+      AppendJsonString(status.queued[i], content);
+    }
+    content->append("]}");
+  }
+  content->append(",\"metrics\":");
+  folve::AppendMetricsJson(content);
+  content->append("}\n");
+}
+
+void StatusServer::CreateMetricsPage(std::string *content) {
+  content->clear();
+  std::vector<HandlerStats> stat_list;
+  filesystem_->handler_cache()->GetStats(&stat_list);
+  int open_count = 0;
+  for (size_t i = 0; i < stat_list.size(); ++i) {
+    if (stat_list[i].status == HandlerStats::OPEN) ++open_count;
+  }
+  Appendf(content,
+          "# HELP folve_file_openings_total Files opened.\n"
+          "# TYPE folve_file_openings_total counter\n"
+          "folve_file_openings_total %d\n"
+          "# HELP folve_file_reopen_total Files re-opened from the recency "
+          "cache.\n"
+          "# TYPE folve_file_reopen_total counter\n"
+          "folve_file_reopen_total %d\n"
+          "# HELP folve_prebuffer_queue_depth Buffers queued for "
+          "pre-buffering.\n"
+          "# TYPE folve_prebuffer_queue_depth gauge\n"
+          "folve_prebuffer_queue_depth %d\n"
+          "# HELP folve_handlers File handlers in the recency cache.\n"
+          "# TYPE folve_handlers gauge\n"
+          "folve_handlers{status=\"open\"} %d\n"
+          "folve_handlers{status=\"idle\"} %d\n",
+          filesystem_->total_file_openings(),
+          filesystem_->total_file_reopen(),
+          filesystem_->prebuffer_queue_depth(),
+          open_count, (int) stat_list.size() - open_count);
+  folve::AppendMetricsPrometheus(content);
+}
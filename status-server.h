@@ -58,7 +58,13 @@ private:
 
   void CreatePage(bool for_http, std::string *content);
 
-  const std::string &CreateHttpPage();
+  // Get the HTTP status page; cached up to the refresh interval.
+  void GetHttpPage(std::string *page);
+  void InvalidateHttpPage();   // Something to show right away.
+
+  // Machine readable status: JSON and Prometheus text format.
+  void CreateJsonStatus(std::string *content);
+  void CreateMetricsPage(std::string *content);
 
   // Some helper functions to create the page:
   void AppendSettingsForm(bool for_http, std::string *out);
@@ -67,9 +73,14 @@ private:
                       const HandlerStats &stats,
                       std::string *out);
 
+  void AppendRenderAhead(bool for_http, std::string *out);
+
   // Set filter from http-request. Gracefully handles garbage.
   void SetFilter(const char *value);
 
+  // Queue files in the filesystem path for render ahead.
+  void QueueRenderAhead(const char *fs_path);
+
   // Show details that might only be interesting while setting up things.
   bool show_details();
 
@@ -85,8 +96,14 @@ private:
   int meta_refresh_time_;
   FolveFilesystem *filesystem_;
   struct MHD_Daemon *daemon_;
+
+  folve::Mutex http_page_mutex_;      // Protects the cached page.
   std::string http_content_;
+  double http_page_time_;             // When it was created; 0 for stale.
+
+  folve::Mutex page_mutex_;           // Protects the following.
   bool filter_switched_;
+  std::string render_ahead_message_;  // Result of last request; shown once.
 };
 
 #endif  // FOLVE_STATUS_SERVER_H
@@ -18,8 +18,10 @@
 #include "util.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <linux/sched.h>  // for SCHED_IDLE, <sched.h> doesn't do it everywhere
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/resource.h>
 #include <sys/syscall.h>   // need to call gettid syscall.
 #include <sys/time.h>
@@ -85,21 +87,219 @@ bool folve::HasSuffix(const std::string &str, const std::string &suffix) {
                      suffix.length(), suffix) == 0;
 }
 
+// Conversion cpus as bitmap; zero for any. Good for the first 64 cpus,
+// which should be enough for a music server.
+static unsigned long long conversion_cpus = 0;
+
+static int playback_policy = SCHED_OTHER;
+static int playback_priority = 0;   // Realtime priority or nice value.
+static bool playback_scheduling_set = false;
+
+static __thread bool thread_pinned = false;
+static __thread int thread_playback_reads = 0;  // Nesting PlaybackRead.
+
+bool folve::SetConversionCpus(const std::string &cpus) {
+  unsigned long long result = 0;
+  const char *pos = cpus.c_str();
+  while (*pos) {
+    char *end;
+    const long first = strtol(pos, &end, 10);
+    long last = first;
+    if (end == pos) return false;
+    if (*end == '-') {
+      pos = end + 1;
+      last = strtol(pos, &end, 10);
+      if (end == pos) return false;
+    }
+    if (first < 0 || last < first || last >= 64) return false;
+    for (long cpu = first; cpu <= last; ++cpu) result |= 1ULL << cpu;
+    if (*end != ',' && *end != '\0') return false;
+    pos = (*end == ',') ? end + 1 : end;
+  }
+  conversion_cpus = result;
+  return true;
+}
+
+void folve::PinToConversionCpus() {
+  if (conversion_cpus == 0 || thread_pinned) return;
+  thread_pinned = true;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu = 0; cpu < 64; ++cpu) {
+    if (conversion_cpus & (1ULL << cpu)) CPU_SET(cpu, &set);
+  }
+  const int result = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (result != 0) {
+    syslog(LOG_WARNING, "Can't pin to conversion cpus: %s", strerror(result));
+  }
+}
+
+bool folve::SetPlaybackScheduling(const std::string &spec,
+                                  std::string *error) {
+  int policy, priority;
+  char *end;
+  const std::string::size_type colon = spec.find(':');
+  const std::string name = spec.substr(0, colon);
+  if (colon == std::string::npos) {
+    *error = "Expected <policy>:<priority>";
+    return false;
+  }
+  priority = strtol(spec.c_str() + colon + 1, &end, 10);
+  if (end == spec.c_str() + colon + 1 || *end != '\0') {
+    *error = "Invalid priority";
+    return false;
+  }
+  if (name == "nice") policy = SCHED_OTHER;
+  else if (name == "fifo") policy = SCHED_FIFO;
+  else if (name == "rr") policy = SCHED_RR;
+  else {
+    *error = "Unknown policy '" + name + "'; choose one of nice, fifo, rr";
+    return false;
+  }
+  // Find out right away if we're permitted to do this by trying it on a
+  // thread of our own.
+  int old_policy;
+  struct sched_param old_param;
+  pthread_getschedparam(pthread_self(), &old_policy, &old_param);
+  int result;
+  if (policy == SCHED_OTHER) {
+    const int old_nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    result = (setpriority(PRIO_PROCESS, syscall(SYS_gettid), priority) == 0)
+      ? 0 : errno;
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), old_nice);
+  } else {
+    struct sched_param param;
+    param.sched_priority = priority;
+    result = pthread_setschedparam(pthread_self(), policy, &param);
+    pthread_setschedparam(pthread_self(), old_policy, &old_param);
+  }
+  if (result != 0) {
+    *error = strerror(result);
+    if (result == EPERM) {
+      *error += " (needs CAP_SYS_NICE, or a large enough "
+        "RLIMIT_RTPRIO/RLIMIT_NICE)";
+    }
+    return false;
+  }
+  playback_policy = policy;
+  playback_priority = priority;
+  playback_scheduling_set = true;
+  return true;
+}
+
+void folve::GetPlaybackRealtimeScheduling(int *policy, int *priority) {
+  const bool realtime = playback_policy != SCHED_OTHER;
+  *policy = realtime ? playback_policy : SCHED_OTHER;
+  *priority = realtime ? playback_priority : 0;
+}
+
+void folve::GetThreadScheduling(ThreadScheduling *scheduling) {
+  struct sched_param param;
+  pthread_getschedparam(pthread_self(), &scheduling->policy, &param);
+  scheduling->priority = param.sched_priority;
+  scheduling->nice = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+}
+
+bool folve::SetThreadScheduling(const ThreadScheduling &scheduling) {
+  struct sched_param param;
+  param.sched_priority = scheduling.priority;
+  bool success = (pthread_setschedparam(pthread_self(), scheduling.policy,
+                                        &param) == 0);
+  success &= (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                          scheduling.nice) == 0);
+  return success;
+}
+
+static int SchedulingClass(int policy) {
+  switch (policy) {
+  case SCHED_FIFO:
+  case SCHED_RR:    return 2;
+#ifdef SCHED_IDLE
+  case SCHED_IDLE:  return 0;
+#endif
+  default:          return 1;
+  }
+}
+
+bool folve::IsHigherScheduling(const ThreadScheduling &a,
+                               const ThreadScheduling &b) {
+  const int a_class = SchedulingClass(a.policy);
+  const int b_class = SchedulingClass(b.policy);
+  if (a_class != b_class)
+    return a_class > b_class;
+  if (a_class == 2)
+    return a.priority > b.priority;
+  return a.nice < b.nice;
+}
+
+bool folve::IsBackgroundThread() {
+  ThreadScheduling scheduling;
+  GetThreadScheduling(&scheduling);
+  // The main thread has the id of the process.
+  return (SchedulingClass(scheduling.policy) == 0
+          || scheduling.nice > getpriority(PRIO_PROCESS, getpid()));
+}
+
+folve::PlaybackRead::PlaybackRead() { ++thread_playback_reads; }
+folve::PlaybackRead::~PlaybackRead() { --thread_playback_reads; }
+
+folve::ScopedPlaybackPriority::ScopedPlaybackPriority() : changed_(false) {
+  PinToConversionCpus();
+  // Pre-buffering and rendering ahead keep their low priority.
+  if (!playback_scheduling_set || thread_playback_reads == 0) return;
+  struct sched_param param;
+  pthread_getschedparam(pthread_self(), &old_policy_, &param);
+  if (playback_policy != SCHED_OTHER) {
+    if (old_policy_ == playback_policy) return;  // Already.
+    old_priority_ = param.sched_priority;
+    param.sched_priority = playback_priority;
+    changed_ = (pthread_setschedparam(pthread_self(), playback_policy,
+                                      &param) == 0);
+  } else {
+    old_priority_ = getpriority(PRIO_PROCESS, syscall(SYS_gettid));
+    if (old_priority_ <= playback_priority) return;
+    changed_ = (setpriority(PRIO_PROCESS, syscall(SYS_gettid),
+                            playback_priority) == 0);
+  }
+}
+
+folve::ScopedPlaybackPriority::~ScopedPlaybackPriority() {
+  if (!changed_) return;
+  if (playback_policy != SCHED_OTHER) {
+    struct sched_param param;
+    param.sched_priority = old_priority_;
+    pthread_setschedparam(pthread_self(), old_policy_, &param);
+  } else {
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), old_priority_);
+  }
+}
+
 void *folve::Thread::PthreadCallRun(void *tobject) {
-  // Some hardcoded nicification of the thread. We use it for the pre-buffering
-  // which is nice-to-have and shouldn't interfere too much with other stuff.
-  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 2);
+  folve::Thread *thread = reinterpret_cast<folve::Thread*>(tobject);
+  if (thread->background_) {
+    // Some hardcoded nicification of the thread. We use it for the
+    // pre-buffering which is nice-to-have and shouldn't interfere too much
+    // with other stuff.
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 2);
+  }
 
-  reinterpret_cast<folve::Thread*>(tobject)->Run();
+  thread->Run();
   return NULL;
 }
 
-folve::Thread::Thread() : started_(false) {}
+folve::Thread::Thread(bool background)
+  : background_(background), started_(false), joined_(false) {}
 folve::Thread::~Thread() {
+  Join();
+}
+
+void folve::Thread::Join() {
+  if (!started_ || joined_) return;
   int result = pthread_join(thread_, NULL);
   if (result != 0) {
     fprintf(stderr, "err code: %d %s\n", result, strerror(result));
   }
+  joined_ = true;
 }
 
 void folve::Thread::Start() {
@@ -107,10 +307,11 @@ void folve::Thread::Start() {
   pthread_create(&thread_, NULL, &PthreadCallRun, this);
 
 #ifdef SCHED_IDLE
-  // Background thread:
-  struct sched_param p;
-  p.sched_priority = 0;
-  pthread_setschedparam(thread_, SCHED_IDLE, &p);
+  if (background_) {
+    struct sched_param p;
+    p.sched_priority = 0;
+    pthread_setschedparam(thread_, SCHED_IDLE, &p);
+  }
 #endif
 
   started_ = true;
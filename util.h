@@ -58,6 +58,7 @@ namespace folve {
     ~Mutex() { pthread_mutex_destroy(&mutex_); }
     void Lock() { pthread_mutex_lock(&mutex_); }
     void Unlock() { pthread_mutex_unlock(&mutex_); }
+    bool TryLock() { return pthread_mutex_trylock(&mutex_) == 0; }
     void WaitOn(pthread_cond_t *cond) { pthread_cond_wait(cond, &mutex_); }
 
   private:
@@ -73,20 +74,90 @@ namespace folve {
     Mutex *const mutex_;
   };
 
-  // Thread.
+  // Scheduling of threads doing conversion work; set up once at startup.
+
+  // Restrict conversion to the cpus in "cpus", a list such as "2,3" or
+  // "1-3". Returns 'false' if it can't be parsed.
+  bool SetConversionCpus(const std::string &cpus);
+
+  // Run the calling thread on the conversion cpus, if set.
+  void PinToConversionCpus();
+
+  // Scheduling of conversion that a reader is waiting for: "nice:<n>",
+  // "fifo:<priority>" or "rr:<priority>". Returns 'false' with a message in
+  // "error" if it can't be parsed or we're not permitted to use it.
+  bool SetPlaybackScheduling(const std::string &spec, std::string *error);
+
+  // The realtime policy and priority for playback; SCHED_OTHER and 0 if
+  // none is set. As needed by Convproc::start_process().
+  void GetPlaybackRealtimeScheduling(int *policy, int *priority);
+
+  // Scheduling of a thread: policy with its realtime priority, and the
+  // nice value.
+  struct ThreadScheduling {
+    int policy;
+    int priority;
+    int nice;
+  };
+
+  // Get the scheduling of the calling thread.
+  void GetThreadScheduling(ThreadScheduling *scheduling);
+
+  // Schedule the calling thread as given. Returns 'false' if we're not
+  // permitted to; the scheduling might be partially applied then.
+  bool SetThreadScheduling(const ThreadScheduling &scheduling);
+
+  // Returns if "a" gets the cpu before "b": realtime before normal before
+  // idle, then by realtime priority or nice value.
+  bool IsHigherScheduling(const ThreadScheduling &a, const ThreadScheduling &b);
+
+  // Returns if the calling thread runs with lower priority than the
+  // process, like a folve::Thread started in the background.
+  bool IsBackgroundThread();
+
+  // While in scope, the calling thread reads for a client that plays the
+  // file. To be used on the path of FUSE reads only.
+  class PlaybackRead {
+  public:
+    PlaybackRead();
+    ~PlaybackRead();
+  };
+
+  // While in scope, the calling thread is scheduled as playback if it is
+  // within a PlaybackRead; it is pinned to the conversion cpus from then on.
+  class ScopedPlaybackPriority {
+  public:
+    ScopedPlaybackPriority();
+    ~ScopedPlaybackPriority();
+  private:
+    bool changed_;
+    int old_policy_;
+    int old_priority_;   // Realtime priority or nice value.
+  };
+
+  // Thread. By default, threads are started as low-priority background
+  // threads; with "background" set to false, they run with the same
+  // priority as the thread that starts them.
   class Thread {
   public:
-    Thread();
+    explicit Thread(bool background = true);
     virtual ~Thread();
 
     void Start();
 
+    // Wait for Run() to finish. Also called by the destructor, but
+    // subclasses whose Run() accesses their own members need to call it
+    // in their destructor.
+    void Join();
+
     // Override this.
     virtual void Run() = 0;
 
   private:
     static void *PthreadCallRun(void *tobject);
+    const bool background_;
     bool started_;
+    bool joined_;
     pthread_t thread_;
   };
 }  // namespece folve
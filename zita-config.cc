@@ -47,6 +47,80 @@ static int check_inout (ZitaConfig *cfg, int ip, int op)
 }
 
 
+// Returns if the given output (1-based) is handled by the lane of this config.
+static bool in_lane (ZitaConfig *cfg, int op)
+{
+    if (cfg->num_lanes <= 1) return true;
+    return (op - 1) % cfg->num_lanes == cfg->lane;
+}
+
+
+// /impulse/read with the samples coming from the shared cfg->impulses.
+static int readshared (ZitaConfig *cfg, int lnum, const char *path,
+                       unsigned int ip1, unsigned int op1, float gain,
+                       unsigned int delay, unsigned int offset,
+                       unsigned int length, unsigned int ichan)
+{
+    int           rate, nchan, nfram, err;
+    unsigned int  i;
+    const float   *data;
+    float         *buff;
+
+    data = cfg->impulses->GetFile (path, &rate, &nchan, &nfram);
+    if (!data)
+    {
+        syslog(LOG_ERR, "%s:%d: Unable to open '%s'.\n", cfg->config_file,
+               lnum, path);
+        return ERR_OTHER;
+    }
+
+    if (rate != (int) cfg->fsamp)
+    {
+         syslog(LOG_ERR, "%s:%d: Sample rate (%d) of '%s' does not match.\n",
+                cfg->config_file, lnum, rate, path);
+    }
+
+    if ((ichan < 1) || (ichan > (unsigned int) nchan))
+    {
+        syslog(LOG_ERR, "%s:%d: Channel not available.\n",
+               cfg->config_file, lnum);
+        return ERR_OTHER;
+    }
+    if (offset > (unsigned int) nfram)
+    {
+        syslog(LOG_ERR, "%s:%d: Can't seek to offset.\n",
+               cfg->config_file, lnum);
+        return ERR_OTHER;
+    }
+    if (! length || length > nfram - offset) length = nfram - offset;
+    if (length > cfg->size - delay)
+    {
+	length = cfg->size - delay;
+   	syslog(LOG_ERR, "%s:%d: Data truncated.\n", cfg->config_file, lnum);
+    }
+    if (! length) return 0;
+
+    try
+    {
+        buff = new float [length];
+    }
+    catch (...)
+    {
+        return ERR_ALLOC;
+    }
+
+    data += offset * nchan + ichan - 1;
+    for (i = 0; i < length; i++) buff [i] = data [i * nchan] * gain;
+    err = 0;
+    if (cfg->convproc->impdata_create (ip1 - 1, op1 - 1, 1, buff, delay, delay + length))
+    {
+        err = ERR_ALLOC;
+    }
+    delete[] buff;
+    return err;
+}
+
+
 static int readfile (ZitaConfig *cfg,
                      const char *line, int lnum, const char *cdir)
 {
@@ -84,6 +158,7 @@ static int readfile (ZitaConfig *cfg,
     }
     err = check_inout (cfg, ip1, op1);
     if (err) return err;
+    if (!in_lane (cfg, op1)) return 0;
 
     if (*file == '/') strcpy (path, file);
     else
@@ -93,6 +168,12 @@ static int readfile (ZitaConfig *cfg,
         strcat (path, file);
     }
 
+    if (cfg->impulses)
+    {
+        return readshared (cfg, lnum, path, ip1, op1, gain,
+                           delay, offset, length, ichan);
+    }
+
     if (audio.open_read (path))
     {
        syslog(LOG_ERR, "%s:%d: Unable to open '%s' >%s<.\n", cfg->config_file,
@@ -183,6 +264,7 @@ static int impdirac (ZitaConfig *cfg, const char *line, int lnum)
 
     stat = check_inout (cfg, ip1, op1);
     if (stat) return stat;
+    if (!in_lane (cfg, op1)) return 0;
 
     k = cfg->latency;
     if (delay < k)
@@ -223,6 +305,7 @@ static int imphilbert (ZitaConfig *cfg, const char *line, int lnum)
     {
 	return ERR_PARAM;
     }
+    if (!in_lane (cfg, op1)) return 0;
     k = cfg->latency;
     if (delay < k + length / 2)
     {
@@ -263,6 +346,13 @@ static int impcopy (ZitaConfig *cfg, const char *line, int lnum)
 
     stat = check_inout (cfg, ip1, op1) | check_inout (cfg, ip2, op2);
     if (stat) return stat;
+    if ((cfg->num_lanes > 1)
+        && ((op1 - 1) % cfg->num_lanes != (op2 - 1) % cfg->num_lanes))
+    {
+        // The source impulse lives in a different Convproc.
+        return ERR_LANE;
+    }
+    if (!in_lane (cfg, op1)) return 0;
 
     if ((ip1 != ip2) || (op1 != op2))
     {
@@ -327,6 +417,7 @@ int config (ZitaConfig *cfg, const char *config_file)
             }
         }
         else if (! strcmp (p, "/convolver/new"))   stat = convnew (cfg, q, lnum);
+        else if (! strcmp (p, "/convolver/profile")) stat = convprofile (cfg, q, lnum);
         else if (! strcmp (p, "/impulse/read"))    stat = readfile (cfg, q, lnum, cdir);
         else if (! strcmp (p, "/impulse/dirac"))   stat = impdirac (cfg, q, lnum);
         else if (! strcmp (p, "/impulse/hilbert")) stat = imphilbert (cfg, q, lnum);
@@ -338,7 +429,7 @@ int config (ZitaConfig *cfg, const char *config_file)
 
     fclose (F);
     if (stat == ERR_OTHER) stat = 0;
-    if (stat)
+    if (stat && stat != ERR_LANE)  // Caller deals with that.
     {
         syslog(LOG_ERR, "%s:%d: ", config_file, lnum);
 	switch (stat)
@@ -371,3 +462,51 @@ int config (ZitaConfig *cfg, const char *config_file)
 
     return stat;
 }
+
+
+int impulse_files (const char *config_file, std::vector<std::string> *files)
+{
+    FILE          *F;
+    int           n;
+    unsigned int  u;
+    float         f;
+    char          line [1024];
+    char          cdir [1024];
+    char          file [1024];
+    char          *p, *q;
+
+    // Like config(), but only follows /cd and /impulse/read.
+    if (! (F = fopen (config_file, "r"))) return ERR_OTHER;
+    char *config_name_copy = strdup(config_file);
+    strcpy (cdir, dirname(config_name_copy));
+    free(config_name_copy);
+
+    while (fgets (line, 1024, F))
+    {
+        p = line;
+        if (*p != '/') continue;
+        for (q = p; (*q >= ' ') && !isspace (*q); q++);
+        for (*q++ = 0; (*q >= ' ') && isspace (*q); q++);
+
+        if (! strcmp (p, "/cd"))
+        {
+            if (sstring (q, file, 1024) == 0) continue;
+            if (file[0] == '/') {
+              strcpy(cdir, file);
+            } else {
+              strcat(cdir, "/");
+              strcat(cdir, file);
+            }
+        }
+        else if (! strcmp (p, "/impulse/read"))
+        {
+            if (sscanf (q, "%u %u %f %u %u %u %u %n",
+                        &u, &u, &f, &u, &u, &u, &u, &n) != 7) continue;
+            if (sstring (q + n, file, 1024) == 0) continue;
+            if (*file == '/') files->push_back (file);
+            else files->push_back (std::string (cdir) + "/" + file);
+        }
+    }
+    fclose (F);
+    return 0;
+}
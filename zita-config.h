@@ -26,9 +26,25 @@
 #define __CONFIG_H
 
 
+#include <string>
+#include <vector>
 #include <zita-convolver.h>
 #include "zita-sstring.h"
 
+// Provides the decoded content of impulse response files. If set in the
+// ZitaConfig, /impulse/read takes the samples from here instead of reading
+// the file itself.
+class ImpulseSource {
+public:
+  virtual ~ImpulseSource() {}
+
+  // Returns interleaved samples of the given audio file and its parameters,
+  // or NULL if it can't be read. The data stays valid for the lifetime
+  // of the source.
+  virtual const float *GetFile(const char *path,
+                               int *rate, int *channels, int *frames) = 0;
+};
+
 struct ZitaConfig {
   const char *config_file;   // Configuration file we're reading from.
   Convproc *convproc;        // Resulting filter object.
@@ -41,13 +57,35 @@ struct ZitaConfig {
   int ninp;
   int nout;
   int size;
+
+  // If num_lanes > 1, the convolution is split into multiple Convprocs, one
+  // per lane; outputs are distributed round robin (output % num_lanes).
+  // Only impulses for outputs of this lane are created.
+  int lane;
+  int num_lanes;
+
+  // Partition layout; one of PROFILE_*. Set by the caller as default, can be
+  // overridden by /convolver/profile in the configuration file.
+  int profile;
+
+  ImpulseSource *impulses;   // Optional; NULL to read files directly.
 };
 
-enum { NOERR, ERR_OTHER, ERR_SYNTAX, ERR_PARAM, ERR_ALLOC, ERR_CANTCD, ERR_COMMAND, ERR_NOCONV, ERR_IONUM };
+// PROFILE_THROUGHPUT: process in large fragments with uniform partitions.
+// PROFILE_LATENCY: process in fragments of the partition size given in
+// /convolver/new, with partitions growing up to the throughput fragment;
+// first output is available sooner, at some cost of overall throughput.
+enum { PROFILE_THROUGHPUT, PROFILE_LATENCY };
+
+enum { NOERR, ERR_OTHER, ERR_SYNTAX, ERR_PARAM, ERR_ALLOC, ERR_CANTCD, ERR_COMMAND, ERR_NOCONV, ERR_IONUM, ERR_LANE };
 
 
 extern int  config (ZitaConfig *cfg, const char *config_file);
+// Append the paths of all files /impulse/read in the configuration to "files"
+// without reading them; as config() would see them.
+extern int  impulse_files (const char *config_file, std::vector<std::string> *files);
 extern int  convnew (ZitaConfig *cfg, const char *line, int lnum);
+extern int  convprofile (ZitaConfig *cfg, const char *line, int lnum);
 extern int  inpname (ZitaConfig *cfg, const char *line);
 extern int  outname (ZitaConfig *cfg, const char *line);
 extern void makeports (void);
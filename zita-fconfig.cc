@@ -66,14 +66,23 @@ int convnew (ZitaConfig *cfg, const char *line, int lnum)
         return ERR_OTHER;
     }
 
-    cfg->fragm = Convproc::MAXQUANT;
-    while ((cfg->fragm > Convproc::MINPART) && (cfg->fragm >= 2 * cfg->size)) {
-      cfg->fragm /= 2;
+    int maxpart = Convproc::MAXQUANT;
+    while ((maxpart > Convproc::MINPART) && (maxpart >= 2 * cfg->size)) {
+      maxpart /= 2;
+    }
+    cfg->fragm = maxpart;
+    if (cfg->profile == PROFILE_LATENCY)
+    {
+        // Smallest partitions (and output fragments) as requested, rounded
+        // to a power of two.
+        int minpart = Convproc::MINPART;
+        while ((minpart < maxpart) && (minpart < (int) part)) minpart *= 2;
+        cfg->fragm = minpart;
     }
     cfg->convproc->set_options (cfg->options);
     cfg->convproc->set_density (dens);
     if (cfg->convproc->configure (cfg->ninp, cfg->nout, cfg->size,
-                                  cfg->fragm, cfg->fragm, cfg->fragm))
+                                  cfg->fragm, cfg->fragm, maxpart))
       {   
         syslog(LOG_ERR, "Can't initialise convolution engine\n");
         return ERR_OTHER;
@@ -83,6 +92,24 @@ int convnew (ZitaConfig *cfg, const char *line, int lnum)
 }
 
 
+int convprofile (ZitaConfig *cfg, const char *line, int lnum)
+{
+    char name[64];
+
+    if (sscanf (line, "%63s", name) != 1) return ERR_PARAM;
+    if (cfg->size)
+    {
+        syslog(LOG_ERR, "%s:%d: /convolver/profile needs to come before "
+               "/convolver/new.\n", cfg->config_file, lnum);
+        return ERR_PARAM;
+    }
+    if (! strcmp (name, "throughput")) cfg->profile = PROFILE_THROUGHPUT;
+    else if (! strcmp (name, "latency")) cfg->profile = PROFILE_LATENCY;
+    else return ERR_PARAM;
+    return 0;
+}
+
+
 int inpname (ZitaConfig *, const char *)
 {
     return 0;